@@ -6,11 +6,54 @@
 #include <iomanip>
 #include <memory> // For smart pointers
 #include <map>
+#include <limits>
+#include <unordered_map>
 #include <cmath> // For log10 and min/max
 #include <algorithm> // For remove_if
 #include <climits>
+#include <charconv> // For from_chars
+#include <string_view>
+#include <chrono>
+#include <cstring> // For memchr
+#include <cstdint>
+#include <sys/mman.h> // For mmap
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h> // For the query server
+#include <sys/un.h>
+#include <sys/inotify.h> // For the server's --watch reloads
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h> // For the AVX2 classification kernels
+#define WIPS_AVX2_KERNELS 1
+#endif
+#if defined(WIPS_WITH_ZLIB)
+#include <zlib.h> // For .gz data files, build with -DWIPS_WITH_ZLIB ... -lz
+#endif
+#if defined(WIPS_WITH_ZSTD)
+#include <zstd.h> // For .zst data files, build with -DWIPS_WITH_ZSTD ... -lzstd
+#endif
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <random> // For the benchmark workload generator
+#include <vector>
 using namespace std;
 
+// 64 cells of one grid row, x = 64 * word .. 64 * word + 63 (0-based offsets), one bit per cell
+struct NeighborhoodWord
+{
+    int y;
+    int word;
+    uint64_t bits;
+};
+
 struct CityData 
 {
     std::pair<int, int> lowerLeftCoord = {INT_MAX, INT_MAX}; // Initialize to max integer values as this is the lower left corner (lower bound)
@@ -18,8 +61,15 @@ struct CityData
     float avgAtmosphericPressure = 0.f; // Initialize to 0
     float avgCloudCover = 0.f; // Initialize to 0
     std::string cityname; // Add this field to store the city name
+    long long totalAtmosphericPressure = 0; // Exact sums behind the averages, so an update can adjust them
+    long long totalCloudCover = 0;
+    long long neighborhoodCells = 0; // Number of cells averaged (bounding box plus border, or the exact mask)
+    std::vector<NeighborhoodWord> neighborhoodMask; // Exact mode: the cells averaged, sorted by (y, word)
+    std::vector<float> layerAverages; // Named config layers in dataLayers order, NaN until the layer is loaded
 };
 
+struct RegionContext;
+
 struct GridCellInfo 
 {
     bool isCity = false;
@@ -27,305 +77,6760 @@ struct GridCellInfo
     float atmosphericPressure = 0.f; // integer input but allow to store as float when doing avg
     float cloudCover = 0.f; 
 
-    static unsigned numberOfDigits; // Number of digits for city ID, used for padding when printing city map
-    static unsigned numberOfDigitsYaxis ; // Number of digits for city ID, used for padding when printing city map
-    static unsigned leftPadding; // Number of digits for city ID, used for padding when printing city map
-    static unsigned rightPadding; // Number of digits for city ID, used for padding when printing city map
+    // The padding comes from the region the cell belongs to (RegionContext)
+    string cityMapPrintCell(const RegionContext& region); // Print the cell for city map, pad with 2 spaces (left and right)
+    string lmhMapPrintCell(const RegionContext& region, bool cloud = false); // Print the cell for LMH map, pad with 2 spaces (left and right)
+    string indMapPrintCell(const RegionContext& region, bool cloud = false); // Print the cell for Atmospheric Pressure map, pad with 2 spaces 
+};
+
+char convertToLMHSymbol(float value) {
+    if (value < 35) {
+        return 'L'; // Low cloud cover
+    } else if (value < 65) {
+        return 'M'; // Medium cloud cover
+    } else {
+        return 'H'; // High cloud cover
+    }
+}
+
+int countNumberOfDigits(int number) 
+{
+    if (number == 0) return 1; // Log10 of 0 is undefined, so we handle it separately
+    return static_cast<int>(log10(abs(number))) + 1; //log10 is from cmath
+}
+
+
+// Memory mapping of a whole file, so input can be parsed and snapshots used without copying.
+// A copy-on-write mapping may be modified in memory; changes never reach the file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    string cityMapPrintCell(); // Print the cell for city map, pad with 2 spaces (left and right)
-    string lmhMapPrintCell(bool cloud = false); // Print the cell for LMH map, pad with 2 spaces (left and right)
-    string indMapPrintCell(bool cloud = false); // Print the cell for Atmospheric Pressure map, pad with 2 spaces 
+    bool open(const string& filename, bool copyOnWrite = false);
+    void close();
+
+    const char* data() const { return static_cast<const char*>(mapping); }
+    char* writableData() { return static_cast<char*>(mapping); } // Only valid for copy-on-write mappings
+    size_t size() const { return length; }
+    std::string_view view() const { return std::string_view(data(), length); }
+
+private:
+    int fd = -1;
+    void* mapping = nullptr;
+    size_t length = 0;
 };
 
-string GridCellInfo::cityMapPrintCell() 
+bool MappedFile::open(const string& filename, bool copyOnWrite)
 {
-    ostringstream oss;
+    close();
 
-    // Check if the cell is a city
-    if(cityId >= 0) 
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
     {
-        // Format the city ID with padding and add it to the output stream
-        // Format the output with the letter centered and padded with spaces
-        oss << setw(leftPadding + 1) << setfill(' ') << ' ' << cityId << setw(rightPadding + 1) << ' ';
-    } 
-    else 
+        return false;
+    }
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0)
     {
-        // If the cell is not a city, output a blank space with the same width
-        oss << setw(leftPadding + 1) << setfill(' ') << ' ' << ' ' << setw(rightPadding + 1) << ' ';
+        close();
+        return false;
+    }
+
+    length = static_cast<size_t>(fileInfo.st_size);
+    if (length == 0)
+    {
+        return true; // Nothing to map, an empty file is still a valid (empty) input
+    }
+
+    int protection = copyOnWrite ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    mapping = mmap(nullptr, length, protection, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = nullptr;
+        close();
+        return false;
+    }
+    if (!copyOnWrite)
+    {
+        madvise(mapping, length, MADV_SEQUENTIAL); // Input lines are consumed front to back
+    }
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, length);
+        mapping = nullptr;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    length = 0;
+}
+
+// ---- Compressed data files ----
+// City, cloud and pressure files whose name ends in .gz or .zst are decompressed while they are
+// read, a fixed input buffer at a time, so they never have to be unpacked to disk first. gzip needs
+// a build with -DWIPS_WITH_ZLIB -lz and zstd one with -DWIPS_WITH_ZSTD -lzstd.
+
+enum class Compression { None, Gzip, Zstd };
+
+Compression compressionOf(const string& filename)
+{
+    auto endsWith = [&](const char* suffix) {
+        size_t length = strlen(suffix);
+        return filename.size() > length && filename.compare(filename.size() - length, length, suffix) == 0;
+    };
+    if (endsWith(".gz")) return Compression::Gzip;
+    if (endsWith(".zst")) return Compression::Zstd;
+    return Compression::None;
+}
+
+class CompressedReader
+{
+public:
+    CompressedReader() = default;
+    ~CompressedReader() { close(); }
+    CompressedReader(const CompressedReader&) = delete;
+    CompressedReader& operator=(const CompressedReader&) = delete;
+
+    bool open(const string& filename); // False when unreadable or not supported by this build, see error()
+    ssize_t read(char* out, size_t capacity); // Bytes decompressed into out, 0 at the end, -1 on corrupt or truncated data
+    void close();
+
+    uint64_t declaredSize() const { return declared; } // Decompressed size the file states (gzip: modulo 4 GB), 0 if unknown
+    const string& error() const { return message; }
+
+private:
+    Compression kind = Compression::None;
+    uint64_t declared = 0;
+    string message;
+#if defined(WIPS_WITH_ZLIB)
+    gzFile gzip = nullptr;
+#endif
+#if defined(WIPS_WITH_ZSTD)
+    int fd = -1;
+    ZSTD_DStream* zstd = nullptr;
+    std::unique_ptr<char[]> input; // Compressed bytes not yet decompressed
+    ZSTD_inBuffer pending{nullptr, 0, 0};
+    size_t frameRemaining = 0; // Nonzero while a frame is unfinished
+#endif
+};
+
+bool CompressedReader::open(const string& filename)
+{
+    close();
+    kind = compressionOf(filename);
+    int file = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        message = "Unable to open " + filename;
+        return false;
+    }
+    struct stat fileInfo;
+    unsigned char header[18] = {}; // Enough for a zstd frame header
+    ssize_t headerBytes = pread(file, header, sizeof(header), 0);
+    if (kind == Compression::Gzip)
+    {
+#if defined(WIPS_WITH_ZLIB)
+        unsigned char trailer[4];
+        if (fstat(file, &fileInfo) == 0 && fileInfo.st_size >= 18 && pread(file, trailer, 4, fileInfo.st_size - 4) == 4)
+        {
+            declared = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (static_cast<uint64_t>(trailer[3]) << 24); // ISIZE, little endian
+        }
+        gzip = gzdopen(file, "rb");
+        if (gzip != nullptr)
+        {
+            gzbuffer(gzip, 256 * 1024);
+            return true;
+        }
+        message = "Unable to read " + filename;
+#else
+        message = filename + " is gzip compressed, which needs a build with -DWIPS_WITH_ZLIB -lz";
+#endif
+    }
+    else if (kind == Compression::Zstd)
+    {
+#if defined(WIPS_WITH_ZSTD)
+        unsigned long long size = (headerBytes > 0) ? ZSTD_getFrameContentSize(header, static_cast<size_t>(headerBytes)) : ZSTD_CONTENTSIZE_UNKNOWN;
+        declared = (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) ? 0 : size;
+        zstd = ZSTD_createDStream();
+        if (zstd != nullptr)
+        {
+            fd = file;
+            input.reset(new char[ZSTD_DStreamInSize()]);
+            return true;
+        }
+        message = "Unable to read " + filename;
+#else
+        message = filename + " is zstd compressed, which needs a build with -DWIPS_WITH_ZSTD -lzstd";
+#endif
+    }
+    (void)headerBytes;
+    (void)fileInfo;
+    ::close(file);
+    return false;
+}
+
+ssize_t CompressedReader::read(char* out, size_t capacity)
+{
+#if defined(WIPS_WITH_ZLIB)
+    if (gzip != nullptr)
+    {
+        int length = gzread(gzip, out, static_cast<unsigned>(std::min<size_t>(capacity, 1u << 30)));
+        int status = Z_OK;
+        gzerror(gzip, &status);
+        if (length < 0 || (length == 0 && status != Z_OK))
+        {
+            message = "corrupt or truncated gzip data";
+            return -1;
+        }
+        return length;
+    }
+#endif
+#if defined(WIPS_WITH_ZSTD)
+    if (zstd != nullptr)
+    {
+        ZSTD_outBuffer output{out, capacity, 0};
+        while (output.pos < output.size)
+        {
+            if (pending.pos == pending.size)
+            {
+                ssize_t length = ::read(fd, input.get(), ZSTD_DStreamInSize());
+                if (length < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (length <= 0)
+                {
+                    if (length < 0 || frameRemaining != 0)
+                    {
+                        message = "corrupt or truncated zstd data";
+                        return -1;
+                    }
+                    break;
+                }
+                pending = ZSTD_inBuffer{input.get(), static_cast<size_t>(length), 0};
+            }
+            frameRemaining = ZSTD_decompressStream(zstd, &output, &pending);
+            if (ZSTD_isError(frameRemaining))
+            {
+                message = string("corrupt zstd data: ") + ZSTD_getErrorName(frameRemaining);
+                return -1;
+            }
+        }
+        return static_cast<ssize_t>(output.pos);
+    }
+#endif
+    (void)out;
+    (void)capacity;
+    return 0;
+}
+
+void CompressedReader::close()
+{
+#if defined(WIPS_WITH_ZLIB)
+    if (gzip != nullptr)
+    {
+        gzclose(gzip); // Also closes the file
+        gzip = nullptr;
+    }
+#endif
+#if defined(WIPS_WITH_ZSTD)
+    if (zstd != nullptr)
+    {
+        ZSTD_freeDStream(zstd);
+        zstd = nullptr;
+        ::close(fd);
+        fd = -1;
+        pending = ZSTD_inBuffer{nullptr, 0, 0};
+        frameRemaining = 0;
+    }
+#endif
+    declared = 0;
+}
+
+enum class GridLayout { RowMajor, ColumnMajor }; // Memory order of the grid layers
+enum class GridBackend { Auto, Dense, Sparse, Compact }; // Storage used for the grid, Auto decides from the input size
+
+// Grid storage. The dense backend carves a single allocation into one array per layer
+// (structure-of-arrays), so a scan only streams through the layer it actually reads.
+// The sparse backend splits the grid into fixed 64x64 tiles that are only allocated when a
+// data line writes into them; cells of missing tiles read as the defaults.
+// The compact backend is dense but quantized: valid input values are integers 0-100, so cloud
+// cover and pressure are one byte per cell, city membership is one bit per cell and city IDs
+// use the narrowest of 1, 2 or 4 bytes that holds the largest ID. The rare value that does not
+// fit its byte is stored behind an escape code in a side table.
+// Cells are addressed with 0-based (x, y) offsets from gridXmin/gridYmin.
+class GridStore
+{
+private:
+    static const int tileShift = 6;
+    static const int tileMask = (1 << tileShift) - 1;
+    static const size_t tileCells = size_t(1) << (2 * tileShift);
+
+    struct Tile
+    {
+        int cityIds[tileCells];
+        float cloudCover[tileCells];
+        float atmosphericPressure[tileCells];
+
+        Tile()
+        {
+            std::fill(cityIds, cityIds + tileCells, -1);
+            std::fill(cloudCover, cloudCover + tileCells, 0.f);
+            std::fill(atmosphericPressure, atmosphericPressure + tileCells, 0.f);
+        }
+    };
+
+    static size_t offsetInTile(int x, int y) { return (static_cast<size_t>(y & tileMask) << tileShift) | static_cast<size_t>(x & tileMask); }
+
+    static const uint8_t valueEscape = 255; // Compact value byte meaning "look in the wide table"
+
+public:
+    static const int tileSize = 1 << tileShift; // Tile edge of the sparse backend, in cells
+
+    // Read-only view of one map row (fixed y), strided according to the layout
+    struct RowView
+    {
+        const int* cityIds;
+        const float* cloudCover;
+        const float* atmosphericPressure;
+        size_t stride;
+        const std::unique_ptr<Tile>* tileRow = nullptr; // Sparse backend: the tiles this row crosses
+        size_t tileRowOffset = 0; // Sparse backend: offset of the row inside each tile
+        const GridStore* compactStore = nullptr; // Compact backend: the store to decode from
+        int rowY = 0; // Compact backend: y of this row
+
+        int cityId(int x) const
+        {
+            if (cityIds != nullptr) return cityIds[x * stride];
+            if (compactStore != nullptr) return compactStore->compactCityIdAt(x, rowY);
+            const Tile* tile = tileRow[x >> tileShift].get();
+            return (tile != nullptr) ? tile->cityIds[tileRowOffset + (x & tileMask)] : -1;
+        }
+        float cloud(int x) const
+        {
+            if (cloudCover != nullptr) return cloudCover[x * stride];
+            if (compactStore != nullptr) return static_cast<float>(compactStore->compactValueAt(compactStore->compactCloud, compactStore->wideCloud, x, rowY));
+            const Tile* tile = tileRow[x >> tileShift].get();
+            return (tile != nullptr) ? tile->cloudCover[tileRowOffset + (x & tileMask)] : 0.f;
+        }
+        float pressure(int x) const
+        {
+            if (atmosphericPressure != nullptr) return atmosphericPressure[x * stride];
+            if (compactStore != nullptr) return static_cast<float>(compactStore->compactValueAt(compactStore->compactPressure, compactStore->widePressure, x, rowY));
+            const Tile* tile = tileRow[x >> tileShift].get();
+            return (tile != nullptr) ? tile->atmosphericPressure[tileRowOffset + (x & tileMask)] : 0.f;
+        }
+        GridCellInfo cell(int x) const; // Materialize a cell for the GridCellInfo print helpers
+    };
+
+    void allocate(int width, int height, GridLayout layout = GridLayout::RowMajor);
+    void allocateSparse(int width, int height); // Tiles are laid out row-major
+    void allocateCompact(int width, int height, GridLayout layout = GridLayout::RowMajor);
+    // Compact backend: make the city ID layer wide enough for IDs up to largestId. Widening copies
+    // the layer, so it must not run concurrently with writes; the parallel loader calls it between
+    // parsing and applying. Other backends ignore it.
+    void reserveCityIds(int largestId);
+    // Use layers stored back to back at layerOffset inside a (copy-on-write) mapping, without copying
+    void adopt(std::unique_ptr<MappedFile> mapping, size_t layerOffset, int width, int height, GridLayout layout);
+    void release();
+
+    // All layers as one block (cityIds, cloudCover, atmosphericPressure), e.g. for writing a snapshot.
+    // Only the dense backend has one; null for a sparse grid.
+    const unsigned char* layerBlock() const { return reinterpret_cast<const unsigned char*>(cityIds); }
+
+    bool empty() const { return cellCount == 0; }
+    bool isSparse() const { return sparse; }
+    bool isCompact() const { return compact; }
+    int width() const { return gridWidth; }
+    int height() const { return gridHeight; }
+    GridLayout layout() const { return cellLayout; }
+    size_t cells() const { return cellCount; }
+    // A dense layer in storage order (see index), null unless the backend is dense
+    const float* cloudLayer() const { return cloudCover; }
+    const float* pressureLayer() const { return atmosphericPressure; }
+    // Compact backend: the byte layers in storage order, null otherwise. A byte of valueEscape
+    // stands for the value forEachWideValue reports for that cell.
+    const uint8_t* compactCloudLayer() const { return compact ? compactCloud.get() : nullptr; }
+    const uint8_t* compactPressureLayer() const { return compact ? compactPressure.get() : nullptr; }
+    size_t denseBytes() const { return cellCount * bytesPerCell; } // Size of all layers stored densely
+    size_t memoryBytes() const; // Bytes actually held for the layers
+    size_t allocatedTiles() const;
+
+    size_t index(int x, int y) const
+    {
+        return (cellLayout == GridLayout::RowMajor) ? static_cast<size_t>(y) * gridWidth + x
+                                                    : static_cast<size_t>(x) * gridHeight + y;
+    }
+
+    int cityIdAt(int x, int y) const
+    {
+        if (compact) return compactCityIdAt(x, y);
+        if (!sparse) return cityIds[index(x, y)];
+        const Tile* tile = tileAt(x, y);
+        return (tile != nullptr) ? tile->cityIds[offsetInTile(x, y)] : -1;
+    }
+    bool isCityAt(int x, int y) const { return cityIdAt(x, y) >= 0; }
+    // Sparse backend: whether the tile holding (x, y) was ever written (a missing tile is all
+    // zeros and no cities). Always true for the other backends.
+    bool tilePopulated(int x, int y) const { return !sparse || tileAt(x, y) != nullptr; }
+    float cloudAt(int x, int y) const
+    {
+        if (compact) return static_cast<float>(compactValueAt(compactCloud, wideCloud, x, y));
+        if (!sparse) return cloudCover[index(x, y)];
+        const Tile* tile = tileAt(x, y);
+        return (tile != nullptr) ? tile->cloudCover[offsetInTile(x, y)] : 0.f;
+    }
+    float pressureAt(int x, int y) const
+    {
+        if (compact) return static_cast<float>(compactValueAt(compactPressure, widePressure, x, y));
+        if (!sparse) return atmosphericPressure[index(x, y)];
+        const Tile* tile = tileAt(x, y);
+        return (tile != nullptr) ? tile->atmosphericPressure[offsetInTile(x, y)] : 0.f;
+    }
+    GridCellInfo cellAt(int x, int y) const;
+
+    // Writes to a sparse grid allocate the tile on first touch. Writers on different threads
+    // must stay in different tile rows (bands of tileSize rows), which the parallel loader does.
+    void setCity(int x, int y, int cityId)
+    {
+        if (compact) setCompactCityId(x, y, cityId);
+        else if (!sparse) cityIds[index(x, y)] = cityId;
+        else touchTile(x, y).cityIds[offsetInTile(x, y)] = cityId;
+    }
+    void setCloud(int x, int y, float value)
+    {
+        if (compact) setCompactValue(compactCloud, wideCloud, x, y, static_cast<int>(value));
+        else if (!sparse) cloudCover[index(x, y)] = value;
+        else touchTile(x, y).cloudCover[offsetInTile(x, y)] = value;
+    }
+    void setPressure(int x, int y, float value)
+    {
+        if (compact) setCompactValue(compactPressure, widePressure, x, y, static_cast<int>(value));
+        else if (!sparse) atmosphericPressure[index(x, y)] = value;
+        else touchTile(x, y).atmosphericPressure[offsetInTile(x, y)] = value;
+    }
+
+    // Exact sums of the cloud and pressure layers over the inclusive rectangle [x0, x1] x [y0, y1].
+    // Missing sparse tiles are skipped, so the cost follows the populated area.
+    void rectSums(int x0, int y0, int x1, int y1, long long& cloudTotal, long long& pressureTotal) const;
+
+    RowView row(int y) const;
+
+    // Compact backend: call visit(cell index, value) for every escaped cell of the cloud (layer 1)
+    // or pressure (layer 2) byte layer
+    template <typename Visitor>
+    void forEachWideValue(int layer, Visitor visit) const
+    {
+        for (const auto& entry : (layer == 1) ? wideCloud : widePressure)
+        {
+            visit(entry.first, entry.second);
+        }
+    }
+
+    // Visit rows from the top of the map (y = height - 1) down to y = 0, the order printMap draws them
+    template <typename Visitor>
+    void forEachRowTopDown(Visitor visit) const
+    {
+        for (int y = gridHeight - 1; y >= 0; y--)
+        {
+            visit(y, row(y));
+        }
+    }
+
+    // Visit every cell of the inclusive rectangle [x0, x1] x [y0, y1] in memory order,
+    // calling visit(cityId, cloudCover, atmosphericPressure) once per cell
+    template <typename Visitor>
+    void forEachInRect(int x0, int y0, int x1, int y1, Visitor visit) const
+    {
+        if (sparse || compact)
+        {
+            for (int y = y0; y <= y1; y++)
+            {
+                RowView view = row(y);
+                for (int x = x0; x <= x1; x++)
+                {
+                    visit(view.cityId(x), view.cloud(x), view.pressure(x));
+                }
+            }
+        }
+        else if (cellLayout == GridLayout::RowMajor)
+        {
+            for (int y = y0; y <= y1; y++)
+            {
+                size_t base = index(0, y);
+                for (int x = x0; x <= x1; x++)
+                {
+                    visit(cityIds[base + x], cloudCover[base + x], atmosphericPressure[base + x]);
+                }
+            }
+        }
+        else
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                size_t base = index(x, 0);
+                for (int y = y0; y <= y1; y++)
+                {
+                    visit(cityIds[base + y], cloudCover[base + y], atmosphericPressure[base + y]);
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr size_t bytesPerCell = sizeof(int) + 2 * sizeof(float);
+
+    const Tile* tileAt(int x, int y) const { return tiles[static_cast<size_t>(y >> tileShift) * tilesAcross + (x >> tileShift)].get(); }
+    Tile& touchTile(int x, int y)
+    {
+        std::unique_ptr<Tile>& tile = tiles[static_cast<size_t>(y >> tileShift) * tilesAcross + (x >> tileShift)];
+        if (!tile) tile.reset(new Tile);
+        return *tile;
+    }
+
+    typedef std::unordered_map<size_t, int> WideValues; // Cell index -> value that did not fit
+
+    // Bit of a cell in the compact city bitmap. Every major-axis line starts on a fresh word, so
+    // loader stripes (bands of whole lines) never write the same word.
+    size_t cityBitOf(int x, int y) const
+    {
+        return (cellLayout == GridLayout::RowMajor) ? static_cast<size_t>(y) * cityBitsPerLine + x
+                                                    : static_cast<size_t>(x) * cityBitsPerLine + y;
+    }
+    uint32_t cityCodeEscape() const { return (cityCodeBytes == 4) ? UINT32_MAX : (1u << (8 * cityCodeBytes)) - 1; }
+    uint32_t cityCodeAt(size_t cell) const
+    {
+        switch (cityCodeBytes)
+        {
+            case 1: return cityCodes[cell];
+            case 2: return reinterpret_cast<const uint16_t*>(cityCodes.get())[cell];
+            default: return reinterpret_cast<const uint32_t*>(cityCodes.get())[cell];
+        }
+    }
+    void setCityCode(size_t cell, uint32_t code)
+    {
+        switch (cityCodeBytes)
+        {
+            case 1: cityCodes[cell] = static_cast<uint8_t>(code); break;
+            case 2: reinterpret_cast<uint16_t*>(cityCodes.get())[cell] = static_cast<uint16_t>(code); break;
+            default: reinterpret_cast<uint32_t*>(cityCodes.get())[cell] = code; break;
+        }
+    }
+    int wideValueAt(const WideValues& values, size_t cell) const
+    {
+        auto found = values.find(cell);
+        return (found != values.end()) ? found->second : 0;
+    }
+    int compactCityIdAt(int x, int y) const
+    {
+        size_t bit = cityBitOf(x, y);
+        if (((cityBits[bit >> 6] >> (bit & 63)) & 1) == 0) return -1;
+        size_t cell = index(x, y);
+        uint32_t code = cityCodeAt(cell);
+        return (code != cityCodeEscape()) ? static_cast<int>(code) : wideValueAt(wideCityIds, cell);
+    }
+    int compactValueAt(const std::unique_ptr<uint8_t[]>& layer, const WideValues& wide, int x, int y) const
+    {
+        size_t cell = index(x, y);
+        uint8_t value = layer[cell];
+        return (value != valueEscape) ? value : wideValueAt(wide, cell);
+    }
+    void setCompactCityId(int x, int y, int cityId);
+    void setCompactValue(std::unique_ptr<uint8_t[]>& layer, WideValues& wide, int x, int y, int value);
+
+    std::unique_ptr<unsigned char[]> storage; // Single backing allocation for all layers
+    std::unique_ptr<MappedFile> mappedStorage; // Or: the snapshot mapping the layers live in
+    int* cityIds = nullptr; // -1 where the cell is not part of a city
+    float* cloudCover = nullptr;
+    float* atmosphericPressure = nullptr;
+    int gridWidth = 0;
+    int gridHeight = 0;
+    size_t cellCount = 0;
+    GridLayout cellLayout = GridLayout::RowMajor;
+
+    bool compact = false;
+    std::unique_ptr<uint8_t[]> compactCloud; // Compact backend layers, in storage order
+    std::unique_ptr<uint8_t[]> compactPressure;
+    std::unique_ptr<uint64_t[]> cityBits; // 1 where the cell belongs to a city
+    size_t cityBitsPerLine = 0; // Minor-axis length rounded up to whole words
+    std::unique_ptr<uint8_t[]> cityCodes; // City ID of each city cell, cityCodeBytes wide
+    int cityCodeBytes = 1;
+    WideValues wideCloud, widePressure, wideCityIds; // Escaped cells
+    std::mutex wideLock; // Stripes of the parallel loader may escape values concurrently. Nothing reads
+                         // a grid while it is written, so lookups (server requests included) take no lock.
+
+    bool sparse = false;
+    std::vector<std::unique_ptr<Tile>> tiles; // Sparse backend, row-major tile table, null = never written
+    size_t tilesAcross = 0;
+};
+
+GridCellInfo GridStore::RowView::cell(int x) const
+{
+    GridCellInfo info;
+    info.cityId = cityId(x);
+    info.isCity = info.cityId >= 0;
+    info.cloudCover = cloud(x);
+    info.atmosphericPressure = pressure(x);
+    return info;
+}
+
+void GridStore::allocate(int width, int height, GridLayout layout)
+{
+    release(); // Re-running option 1 replaces the previous grid instead of leaking it
+
+    gridWidth = width;
+    gridHeight = height;
+    cellLayout = layout;
+    cellCount = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+    // Layers are laid out back to back: cityIds, cloudCover, atmosphericPressure (all 4-byte aligned)
+    storage.reset(new unsigned char[cellCount * bytesPerCell]);
+    cityIds = reinterpret_cast<int*>(storage.get());
+    cloudCover = reinterpret_cast<float*>(cityIds + cellCount);
+    atmosphericPressure = cloudCover + cellCount;
+
+    std::fill(cityIds, cityIds + cellCount, -1);
+    std::fill(cloudCover, cloudCover + cellCount, 0.f);
+    std::fill(atmosphericPressure, atmosphericPressure + cellCount, 0.f);
+}
+
+void GridStore::allocateSparse(int width, int height)
+{
+    release();
+
+    gridWidth = width;
+    gridHeight = height;
+    cellLayout = GridLayout::RowMajor;
+    cellCount = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+    sparse = true;
+    tilesAcross = (static_cast<size_t>(width) + tileSize - 1) >> tileShift;
+    size_t tilesDown = (static_cast<size_t>(height) + tileSize - 1) >> tileShift;
+    tiles.resize(tilesAcross * tilesDown);
+}
+
+void GridStore::allocateCompact(int width, int height, GridLayout layout)
+{
+    release();
+
+    gridWidth = width;
+    gridHeight = height;
+    cellLayout = layout;
+    cellCount = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+    compact = true;
+    compactCloud.reset(new uint8_t[cellCount]());
+    compactPressure.reset(new uint8_t[cellCount]());
+    size_t lines = static_cast<size_t>((layout == GridLayout::RowMajor) ? height : width);
+    size_t lineLength = static_cast<size_t>((layout == GridLayout::RowMajor) ? width : height);
+    cityBitsPerLine = (lineLength + 63) & ~size_t(63);
+    cityBits.reset(new uint64_t[lines * cityBitsPerLine / 64]());
+    cityCodeBytes = 1;
+    cityCodes.reset(new uint8_t[cellCount]());
+}
+
+void GridStore::reserveCityIds(int largestId)
+{
+    if (!compact || largestId < 0 || static_cast<uint32_t>(largestId) < cityCodeEscape())
+    {
+        return;
+    }
+    int bytes = (largestId < 0xFFFF) ? 2 : 4;
+    std::unique_ptr<uint8_t[]> narrow = std::move(cityCodes);
+    int narrowBytes = cityCodeBytes;
+    uint32_t narrowEscape = cityCodeEscape();
+    cityCodes.reset(new uint8_t[cellCount * bytes]());
+    cityCodeBytes = bytes;
+    for (size_t cell = 0; cell < cellCount; cell++)
+    {
+        uint32_t code = (narrowBytes == 1) ? narrow[cell] : reinterpret_cast<const uint16_t*>(narrow.get())[cell];
+        setCityCode(cell, (code == narrowEscape) ? cityCodeEscape() : code);
+    }
+}
+
+void GridStore::setCompactCityId(int x, int y, int cityId)
+{
+    size_t bit = cityBitOf(x, y);
+    size_t cell = index(x, y);
+    if (cityCodeAt(cell) == cityCodeEscape())
+    {
+        std::lock_guard<std::mutex> guard(wideLock);
+        wideCityIds.erase(cell);
+    }
+    if (cityId == -1)
+    {
+        cityBits[bit >> 6] &= ~(uint64_t(1) << (bit & 63));
+        setCityCode(cell, 0);
+        return;
+    }
+    cityBits[bit >> 6] |= uint64_t(1) << (bit & 63);
+    if (cityId >= 0 && static_cast<uint32_t>(cityId) < cityCodeEscape())
+    {
+        setCityCode(cell, static_cast<uint32_t>(cityId));
+        return;
+    }
+    setCityCode(cell, cityCodeEscape()); // Larger than reserved, or an invalid negative ID
+    std::lock_guard<std::mutex> guard(wideLock);
+    wideCityIds[cell] = cityId;
+}
+
+void GridStore::setCompactValue(std::unique_ptr<uint8_t[]>& layer, WideValues& wide, int x, int y, int value)
+{
+    size_t cell = index(x, y);
+    if (layer[cell] == valueEscape)
+    {
+        std::lock_guard<std::mutex> guard(wideLock);
+        wide.erase(cell);
+    }
+    if (value >= 0 && value < valueEscape)
+    {
+        layer[cell] = static_cast<uint8_t>(value);
+        return;
+    }
+    layer[cell] = valueEscape;
+    std::lock_guard<std::mutex> guard(wideLock);
+    wide[cell] = value;
+}
+
+void GridStore::adopt(std::unique_ptr<MappedFile> mapping, size_t layerOffset, int width, int height, GridLayout layout)
+{
+    release();
+
+    gridWidth = width;
+    gridHeight = height;
+    cellLayout = layout;
+    cellCount = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+    mappedStorage = std::move(mapping);
+    cityIds = reinterpret_cast<int*>(mappedStorage->writableData() + layerOffset);
+    cloudCover = reinterpret_cast<float*>(cityIds + cellCount);
+    atmosphericPressure = cloudCover + cellCount;
+}
+
+void GridStore::release()
+{
+    storage.reset();
+    mappedStorage.reset();
+    tiles.clear();
+    tiles.shrink_to_fit();
+    sparse = false;
+    compact = false;
+    compactCloud.reset();
+    compactPressure.reset();
+    cityBits.reset();
+    cityCodes.reset();
+    cityBitsPerLine = 0;
+    cityCodeBytes = 1;
+    WideValues().swap(wideCloud);
+    WideValues().swap(widePressure);
+    WideValues().swap(wideCityIds);
+    tilesAcross = 0;
+    cityIds = nullptr;
+    cloudCover = nullptr;
+    atmosphericPressure = nullptr;
+    gridWidth = gridHeight = 0;
+    cellCount = 0;
+}
+
+GridCellInfo GridStore::cellAt(int x, int y) const
+{
+    return row(y).cell(x);
+}
+
+size_t GridStore::allocatedTiles() const
+{
+    return static_cast<size_t>(std::count_if(tiles.begin(), tiles.end(), [](const std::unique_ptr<Tile>& tile) { return tile != nullptr; }));
+}
+
+size_t GridStore::memoryBytes() const
+{
+    if (compact)
+    {
+        // Layers plus a rough size for the hash nodes of the escaped cells
+        size_t lines = (cellLayout == GridLayout::RowMajor) ? gridHeight : gridWidth;
+        size_t escaped = wideCloud.size() + widePressure.size() + wideCityIds.size();
+        return cellCount * (2 + cityCodeBytes) + lines * cityBitsPerLine / 8 + escaped * 4 * sizeof(size_t);
+    }
+    return sparse ? allocatedTiles() * sizeof(Tile) + tiles.size() * sizeof(tiles[0]) : denseBytes();
+}
+
+void GridStore::rectSums(int x0, int y0, int x1, int y1, long long& cloudTotal, long long& pressureTotal) const
+{
+    cloudTotal = pressureTotal = 0;
+    if (compact)
+    {
+        // Sum the bytes directly in memory order; only escaped cells need the side table
+        bool rowMajor = (cellLayout == GridLayout::RowMajor);
+        int majorFrom = rowMajor ? y0 : x0, majorTo = rowMajor ? y1 : x1;
+        int minorFrom = rowMajor ? x0 : y0, minorTo = rowMajor ? x1 : y1;
+        size_t lineLength = static_cast<size_t>(rowMajor ? gridWidth : gridHeight);
+        for (int major = majorFrom; major <= majorTo; major++)
+        {
+            for (size_t cell = major * lineLength + minorFrom; cell <= major * lineLength + minorTo; cell++)
+            {
+                uint8_t cloud = compactCloud[cell], pressure = compactPressure[cell];
+                cloudTotal += (cloud != valueEscape) ? cloud : wideValueAt(wideCloud, cell);
+                pressureTotal += (pressure != valueEscape) ? pressure : wideValueAt(widePressure, cell);
+            }
+        }
+        return;
+    }
+    if (!sparse)
+    {
+        forEachInRect(x0, y0, x1, y1, [&](int, float cloud, float pressure) {
+            cloudTotal += static_cast<long long>(cloud);
+            pressureTotal += static_cast<long long>(pressure);
+        });
+        return;
+    }
+
+    for (int tileY = y0 >> tileShift; tileY <= (y1 >> tileShift); tileY++)
+    {
+        for (int tileX = x0 >> tileShift; tileX <= (x1 >> tileShift); tileX++)
+        {
+            const Tile* tile = tiles[static_cast<size_t>(tileY) * tilesAcross + tileX].get();
+            if (tile == nullptr)
+            {
+                continue; // Never written: all zeros
+            }
+            int yFrom = std::max(y0, tileY << tileShift), yTo = std::min(y1, ((tileY + 1) << tileShift) - 1);
+            int xFrom = std::max(x0, tileX << tileShift), xTo = std::min(x1, ((tileX + 1) << tileShift) - 1);
+            for (int y = yFrom; y <= yTo; y++)
+            {
+                size_t offset = offsetInTile(0, y);
+                for (int x = xFrom; x <= xTo; x++)
+                {
+                    cloudTotal += static_cast<long long>(tile->cloudCover[offset + (x & tileMask)]);
+                    pressureTotal += static_cast<long long>(tile->atmosphericPressure[offset + (x & tileMask)]);
+                }
+            }
+        }
+    }
+}
+
+GridStore::RowView GridStore::row(int y) const
+{
+    if (sparse)
+    {
+        RowView view{nullptr, nullptr, nullptr, 1};
+        view.tileRow = &tiles[static_cast<size_t>(y >> tileShift) * tilesAcross];
+        view.tileRowOffset = offsetInTile(0, y);
+        return view;
+    }
+    if (compact)
+    {
+        RowView view{nullptr, nullptr, nullptr, 1};
+        view.compactStore = this;
+        view.rowY = y;
+        return view;
+    }
+
+    size_t base = index(0, y);
+    size_t stride = (cellLayout == GridLayout::RowMajor) ? 1 : static_cast<size_t>(gridHeight);
+    return RowView{cityIds + base, cloudCover + base, atmosphericPressure + base, stride};
+}
+
+GridLayout gridLayout = GridLayout::RowMajor; // Layout used when option 1 allocates the grid
+GridBackend gridBackend = GridBackend::Auto; // Dense, sparse or compact storage when option 1 allocates the grid
+const double sparseFillThreshold = 0.25; // Auto picks sparse tiles below this estimated fill ratio
+// Cells averaged for a city: its bounding box plus a one-cell border (the original rule), or
+// exactly its own cells and their eight neighbours
+enum class NeighborhoodMode { BoundingBox, Exact };
+NeighborhoodMode neighborhoodMode = NeighborhoodMode::BoundingBox;
+
+// Summed-area table (integral image) of one grid layer. Every input value is an integer, so the
+// sums are kept exact and any rectangle sum costs four lookups. They are 32-bit when no entry can
+// overflow (no negative value and a layer total below 2^32, e.g. valid percentages on up to 42
+// million cells), halving the table; otherwise 64-bit.
+class SummedAreaTable
+{
+public:
+    typedef float (GridStore::RowView::*LayerReader)(int) const;
+
+    void build(const GridStore& store, LayerReader valueAt);
+    void clear()
+    {
+        std::vector<uint32_t>().swap(narrowSums);
+        std::vector<long long>().swap(sums);
+        tableWidth = tableHeight = 0;
+    }
+    bool empty() const { return sums.empty() && narrowSums.empty(); }
+    size_t memoryBytes() const { return sums.size() * sizeof(long long) + narrowSums.size() * sizeof(uint32_t); }
+
+    // Sum over the inclusive 0-based rectangle [x0, x1] x [y0, y1]
+    long long rectSum(int x0, int y0, int x1, int y1) const
+    {
+        return at(x1 + 1, y1 + 1) - at(x0, y1 + 1) - at(x1 + 1, y0) + at(x0, y0);
+    }
+
+private:
+    // Entry (x, y) holds the sum of all cells strictly left of x and below y
+    long long at(int x, int y) const
+    {
+        size_t entry = static_cast<size_t>(y) * (tableWidth + 1) + x;
+        return narrowSums.empty() ? sums[entry] : static_cast<long long>(narrowSums[entry]);
+    }
+    template <typename Sum>
+    void accumulate(const GridStore& store, LayerReader valueAt, std::vector<Sum>& table);
+
+    std::vector<long long> sums;
+    std::vector<uint32_t> narrowSums; // Used instead of sums when every entry fits
+    int tableWidth = 0;
+    int tableHeight = 0;
+};
+
+// Byte layers derived from a dense or compact grid for the renderers, built on first use and dropped whenever
+// the grid is reallocated or edited. They are in grid storage order (GridStore::index), so building
+// one is a single contiguous pass over its source layer.
+struct ClassifiedLayers
+{
+    std::mutex lock; // Concurrent server requests may ask for the same layer first
+    std::vector<uint8_t> cloudLmh, pressureLmh, cloudIndex, pressureIndex;
+    std::vector<uint8_t> rainChance; // Probability of rain in percent
+    std::array<std::atomic<const uint8_t*>, 7> ready{}; // Layer of each printMap option once built, read without the lock
+};
+
+// One cell of a level of detail pyramid level L: the block of 2^L x 2^L grid cells starting at
+// (bx << L, by << L), clipped to the grid
+struct PyramidCell
+{
+    float cloudMean = 0.f;
+    float cloudMax = 0.f;
+    float pressureMean = 0.f;
+    float pressureMax = 0.f;
+    int cityId = -1; // City holding most of the block's city cells, -1 when it has none
+    uint32_t cityCells = 0; // Cells of cityId in the block, weights the majority one level up
+};
+
+// Downsampled copies of the grid for viewport rendering, built on first use like the classified
+// layers and dropped with them. Levels up to the sparse tile size are summarized from the grid,
+// each further level from the one below, up to a single cell.
+struct MapPyramid
+{
+    std::mutex lock;
+    std::atomic<bool> built{false}; // Set once the levels are written, so a set flag is read without the lock
+    int baseLevel = 0; // 0 while nothing is built
+    std::vector<std::vector<PyramidCell>> levels; // levels[L - baseLevel], row-major
+};
+
+// Which rectangle of a city an index holds: its bounding box, or the box plus the one-cell ring
+// that the averages cover
+enum class CityArea { BoundingBox, Neighborhood };
+
+// Bucketed index of city areas (0-based offsets, clipped to the grid). The buckets are sized so
+// there are about as many buckets as cities, so memory follows the number of cities rather than
+// the grid area, and a point lookup only looks at the few cities sharing its bucket.
+class CityAreaIndex
+{
+public:
+    struct Entry
+    {
+        int cityId;
+        int xFrom, yFrom, xTo, yTo;
+    };
+
+    void build(const RegionContext& region, CityArea area = CityArea::Neighborhood); // From region's cities, clipped to its grid
+    const std::vector<Entry>& entries() const { return cityEntries; }
+
+    // Call visit(entryIndex) for every city whose area contains the cell (x, y)
+    template <typename Visitor>
+    void forEachContaining(int x, int y, Visitor visit) const
+    {
+        if (cityEntries.empty() || x < 0 || y < 0 || x >= gridWidth || y >= gridHeight)
+        {
+            return;
+        }
+        size_t bucket = static_cast<size_t>(y / bucketSize) * bucketsAcross + static_cast<size_t>(x / bucketSize);
+        for (size_t i = bucketStart[bucket]; i < bucketStart[bucket + 1]; i++)
+        {
+            const Entry& entry = cityEntries[bucketEntries[i]];
+            if (x >= entry.xFrom && x <= entry.xTo && y >= entry.yFrom && y <= entry.yTo)
+            {
+                visit(static_cast<size_t>(bucketEntries[i]));
+            }
+        }
+    }
+
+    // Call visit(entryIndex) once for every city whose area intersects the inclusive rectangle
+    template <typename Visitor>
+    void forEachIntersecting(int x0, int y0, int x1, int y1, Visitor visit) const
+    {
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, gridWidth - 1);
+        y1 = std::min(y1, gridHeight - 1);
+        if (cityEntries.empty() || x0 > x1 || y0 > y1)
+        {
+            return;
+        }
+        int firstBucketX = x0 / bucketSize, firstBucketY = y0 / bucketSize;
+        for (int by = firstBucketY; by <= y1 / bucketSize; by++)
+        {
+            for (int bx = firstBucketX; bx <= x1 / bucketSize; bx++)
+            {
+                size_t bucket = static_cast<size_t>(by) * bucketsAcross + static_cast<size_t>(bx);
+                for (size_t i = bucketStart[bucket]; i < bucketStart[bucket + 1]; i++)
+                {
+                    const Entry& entry = cityEntries[bucketEntries[i]];
+                    // A city listed in several buckets is reported only from the first one the rectangle shares with it
+                    bool firstShared = (bx == std::max(entry.xFrom / bucketSize, firstBucketX)) && (by == std::max(entry.yFrom / bucketSize, firstBucketY));
+                    if (firstShared && entry.xFrom <= x1 && entry.xTo >= x0 && entry.yFrom <= y1 && entry.yTo >= y0)
+                    {
+                        visit(static_cast<size_t>(bucketEntries[i]));
+                    }
+                }
+            }
+        }
+    }
+
+    // The k cities whose area is closest to the cell (x, y), as (squared distance in cells, entry index)
+    // pairs, nearest first; ties go to the lower city ID. Rings of buckets are searched outwards until
+    // no unvisited bucket can hold anything nearer than the k-th city found.
+    std::vector<std::pair<long long, size_t>> nearest(int x, int y, size_t k) const;
+
+private:
+    long long squaredDistance(const Entry& entry, int x, int y) const
+    {
+        long long dx = std::max({static_cast<long long>(entry.xFrom) - x, static_cast<long long>(x) - entry.xTo, 0LL});
+        long long dy = std::max({static_cast<long long>(entry.yFrom) - y, static_cast<long long>(y) - entry.yTo, 0LL});
+        return dx * dx + dy * dy;
+    }
+
+    std::vector<Entry> cityEntries;
+    std::vector<size_t> bucketStart; // Bucket b lists bucketEntries[bucketStart[b] .. bucketStart[b + 1])
+    std::vector<uint32_t> bucketEntries;
+    int gridWidth = 0;
+    int gridHeight = 0;
+    int bucketSize = 1;
+    size_t bucketsAcross = 0;
+};
+
+// Everything one loaded configuration (a region) owns: its ranges, map padding, grid, cities and
+// the tables, city indexes and map caches derived from them. The menu and the batch options work on
+// mainRegion; the --regions driver and --watch reloads load further regions side by side, one context each.
+struct RegionContext
+{
+    int gridXmin = 0, gridXmax = 0, gridYmin = 0, gridYmax = 0;
+    unsigned numberOfDigits = 0; // Map padding, used by the GridCellInfo print helpers
+    unsigned numberOfDigitsYaxis = 0;
+    unsigned leftPadding = 0;
+    unsigned rightPadding = 0;
+    GridStore grid;
+    std::map<int, CityData> cityDataMap; // Key is city ID
+    SummedAreaTable cloudCoverSums; // Built once after the data is loaded
+    SummedAreaTable pressureSums;
+    ClassifiedLayers classifiedLayers; // Built on first use by the map renderers
+    MapPyramid mapPyramid;
+    bool cityIndexesStale = true; // Set whenever cityDataMap is reloaded, the city indexes are rebuilt on demand
+    CityAreaIndex cityNeighborhoods; // Which cities average each cell, used to route updates
+    CityAreaIndex cityBoxes; // City bounding boxes, for point, rectangle and nearest-city queries
+    ostream* errors = &cerr; // Per-line validation messages of the loaders
+};
+
+RegionContext mainRegion; // The configuration the menu and the batch options load
+
+string GridCellInfo::cityMapPrintCell(const RegionContext& region) 
+{
+    ostringstream oss;
+
+    // Check if the cell is a city
+    if(cityId >= 0) 
+    {
+        // Format the city ID with padding and add it to the output stream
+        // Format the output with the letter centered and padded with spaces
+        oss << setw(region.leftPadding + 1) << setfill(' ') << ' ' << cityId << setw(region.rightPadding + 1) << ' ';
+    } 
+    else 
+    {
+        // If the cell is not a city, output a blank space with the same width
+        oss << setw(region.leftPadding + 1) << setfill(' ') << ' ' << ' ' << setw(region.rightPadding + 1) << ' ';
+    }
+
+    // Return the formatted string
+    return (oss.str());
+}
+
+string GridCellInfo::indMapPrintCell(const RegionContext& region, bool cloud) 
+{
+    ostringstream oss;
+
+    float value = 0;
+
+    if (cloud) 
+    {
+        value = cloudCover;
+    } 
+    
+    else 
+    {
+        value = atmosphericPressure;
+    }
+    oss << setw(region.leftPadding + 1) << setfill(' ') << ' ' << static_cast<int>(std::max(0.f, value-1)/10.f) << setw(region.rightPadding + 1) << ' ';
+
+    // Return the formatted string
+    return (oss.str());
+}
+
+string GridCellInfo::lmhMapPrintCell(const RegionContext& region, bool cloud) {
+    ostringstream oss;
+    char letter = ' ';
+
+    float value = 0;
+    if (cloud) 
+    {
+        value = cloudCover;
+    } 
+    
+    else 
+    {
+        value = atmosphericPressure;
+    }
+    letter = convertToLMHSymbol(value);
+
+    // Format the output with the letter centered and padded with spaces
+    oss << setw(region.leftPadding + 1) << setfill(' ') << ' ' << letter << setw(region.rightPadding + 1) << ' ';
+
+    // Return the formatted string
+    return (oss.str());
+}
+
+
+// Cloud cover and pressure for a series of forecast timesteps over the same grid and city layout.
+// Each timestep keeps one byte per cell and layer (row-major), and each city's averages over time
+// are stored next to each other, so a city's whole series is one contiguous run. The planes are
+// dense whatever backend the grid uses: 2 bytes per cell of the grid area for every timestep.
+class ForecastCube
+{
+public:
+    void allocate(int width, int height, size_t timesteps)
+    {
+        cubeWidth = width;
+        cubeHeight = height;
+        stepCount = timesteps;
+        layers.assign(stepCount * 2 * cellsPerLayer(), 0);
+        cityIds.clear();
+        cloudSeries.clear();
+        pressureSeries.clear();
+    }
+    void release() { allocate(0, 0, 0); layers.shrink_to_fit(); }
+
+    size_t timesteps() const { return stepCount; }
+    int width() const { return cubeWidth; }
+    int height() const { return cubeHeight; }
+
+    // layer 0 is cloud cover, 1 is atmospheric pressure
+    uint8_t* layer(size_t step, int which) { return &layers[(step * 2 + which) * cellsPerLayer()]; }
+    const uint8_t* layer(size_t step, int which) const { return &layers[(step * 2 + which) * cellsPerLayer()]; }
+
+    // Values are percentages; anything outside a byte (only invalid input) saturates
+    static uint8_t compact(int value) { return static_cast<uint8_t>(std::min(std::max(value, 0), 255)); }
+
+    // Averages per city and timestep: series[cityIndex * timesteps() + step], cities in cityIds order
+    std::vector<int> cityIds;
+    std::vector<float> cloudSeries;
+    std::vector<float> pressureSeries;
+
+private:
+    size_t cellsPerLayer() const { return static_cast<size_t>(cubeWidth) * static_cast<size_t>(cubeHeight); }
+
+    int cubeWidth = 0;
+    int cubeHeight = 0;
+    size_t stepCount = 0;
+    std::vector<uint8_t> layers;
+};
+
+ForecastCube forecastCube; // Timestep 0 mirrors the grid; later steps come from the extra config entries
+
+void promptToEnterOnly() 
+{
+	char enter_key = ' ';
+	do 
+    {
+		cout << endl;
+		cout << "Press <Enter> to go back to main menu ... ";
+		cin.clear(); // resets any error flags which may have been set
+		cin.ignore(numeric_limits<streamsize>::max(), '\n'); // This will clear buffer before taking new
+		enter_key = cin.get();
+	} while (enter_key != '\n');
+}
+
+enum class LoadStatus { Loaded, ConfigUnreadable, DataIncomplete }; // Outcome of option 1
+
+// Process exit codes for the non-interactive mode
+enum ExitStatus
+{
+    ExitOk = 0,
+    ExitUsage = 1, // Bad command line
+    ExitConfigUnreadable = 2, // The configuration file could not be opened
+    ExitDataIncomplete = 3, // A data file was missing from the config or could not be opened
+    ExitOutputFailed = 4 // Writing the report failed (e.g. closed pipe)
+};
+
+// Function prototypes
+LoadStatus loadConfiguration(const string& fileName, ostream& log);
+bool isSnapshotFile(const string& fileName);
+bool saveSnapshot(const string& fileName, const RegionContext& region = mainRegion);
+LoadStatus loadSnapshot(const string& fileName, ostream& log, bool verifyLayers, RegionContext& region = mainRegion);
+LoadStatus streamCitySummaries(const string& fileName, ostream& log, RegionContext& region = mainRegion);
+struct DeltaResult
+{
+    size_t linesApplied = 0; // Value lines inside the grid
+    size_t cellsChanged = 0; // Lines that actually changed a cell
+    size_t citiesRecomputed = 0;
+};
+bool applyDeltaFile(const string& fileName, int fileDataType, DeltaResult& result, RegionContext& region = mainRegion); // fileDataType 1 cloud cover, 2 pressure
+int runBatch(int argc, char *argv[]);
+void buildSummedAreaTables(RegionContext& region = mainRegion);
+bool gridUsesSummedAreaTables(const RegionContext& region = mainRegion);
+void computeCityAverages(RegionContext& region = mainRegion);
+void updateCityAverages(CityData& data);
+void cityNeighborhood(const CityData& data, int& xFrom, int& yFrom, int& xTo, int& yTo, const RegionContext& region = mainRegion);
+void rectangleSums(int xFrom, int yFrom, int xTo, int yTo, long long& cloudTotal, long long& pressureTotal, RegionContext& region = mainRegion);
+bool regionAverage(int x0, int y0, int x1, int y1, float& avgCloudCover, float& avgAtmosphericPressure, RegionContext& region = mainRegion);
+int mainMenu();
+void allocateMemory(int colSize, int rowSize, GridBackend backend = GridBackend::Dense, RegionContext& region = mainRegion);
+void deallocateMemory(int colSize, int rowSize, RegionContext& region = mainRegion);
+// fileDataType of the three core files; further named layers live in dataLayers
+enum DataFileType { CityFile = 0, CloudFile = 1, PressureFile = 2 };
+void processCityData(const string& line, int fileDataType, RegionContext& region = mainRegion); // fileDataType: 0 is citylocation.txt, 1 is cloudcover.txt, 2 is pressure.txt
+void processCityData(std::string_view line, int fileDataType, RegionContext& region = mainRegion); // Same as above, parses the line in place
+struct IngestRequest
+{
+    string filename;
+    int fileDataType; // 0 is citylocation.txt, 1 is cloudcover.txt, 2 is pressure.txt
+};
+std::vector<bool> ingestDataFiles(const std::vector<IngestRequest>& requests, ostream& log = cout, RegionContext& region = mainRegion); // Load files concurrently, returns which ones opened
+void printMap(int option);
+void city_Location(const string& filename);
+void cloud_Coverage(const string& filename);
+void pressure_File(const string& filename);
+void displaySummary();
+int rainchance(char acc, char ap);
+void invalidateClassifiedLayers(RegionContext& region = mainRegion); // Drop the map symbol layers and the pyramid after the grid changed
+void writeSummary(ostream& out, const RegionContext& region = mainRegion); // displaySummary to any stream
+void writeCitySummary(ostream& out, int cityID, const CityData& data);
+void writeTimelineSummary(ostream& out);
+const int layerMapOption = 7; // renderMap option drawing the symbols of a named data layer
+void renderMap(ostream& out, int option, const uint8_t* layerCodes = nullptr, RegionContext& region = mainRegion);
+void setupGrid(const std::vector<IngestRequest>& requests, ostream& log, RegionContext& region = mainRegion);
+
+int main(int argc, char *argv[]) 
+{
+    int exitStatus = ExitOk;
+    if (argc > 1)
+    {
+        exitStatus = runBatch(argc, argv); // Any argument selects the non-interactive mode
+    }
+    else
+    {
+        mainMenu(); // Call the mainMenu function
+    }
+    deallocateMemory((mainRegion.gridYmax - mainRegion.gridYmin) + 1, (mainRegion.gridXmax - mainRegion.gridXmin) + 1); // Deallocate memory (colSize is the y range, rowSize the x range)
+    return exitStatus;
+}
+
+void allocateMemory(int colSize, int rowSize, GridBackend backend, RegionContext& region) 
+{
+    invalidateClassifiedLayers(region);
+    // rowSize is the number of x positions, colSize the number of y positions
+    if (backend == GridBackend::Sparse)
+    {
+        region.grid.allocateSparse(rowSize, colSize);
+    }
+    else if (backend == GridBackend::Compact)
+    {
+        region.grid.allocateCompact(rowSize, colSize, gridLayout);
+    }
+    else
+    {
+        region.grid.allocate(rowSize, colSize, gridLayout);
+    }
+}
+
+void deallocateMemory(int colSize, int rowSize, RegionContext& region) 
+{
+    // The contiguous store frees every layer at once; the sizes are only checked for consistency
+    GridStore& grid = region.grid;
+    if (!grid.empty() && (grid.width() != rowSize || grid.height() != colSize))
+    {
+        cerr << "Warning: deallocating a " << grid.width() << "x" << grid.height() << " grid with sizes " << rowSize << "x" << colSize << endl;
+    }
+    grid.release();
+    invalidateClassifiedLayers(region);
+}
+
+// One parsed "[x, y]-value" or "[x, y]-id-name" line. Views point into the caller's buffer.
+struct ParsedLine
+{
+    enum Kind { Skip, OutOfBounds, Value, City };
+
+    Kind kind = Skip;
+    int xPos = -1; // Grid offset from gridXmin (raw coordinate when OutOfBounds)
+    int yPos = -1; // Grid offset from gridYmin (raw coordinate when OutOfBounds)
+    int value = -1; // Cloud cover / pressure value, or the city ID for City lines
+    std::string_view cityname;
+};
+
+// Drop the characters the original parser ignored around numbers (spaces and brackets)
+std::string_view trimField(std::string_view field)
+{
+    auto ignored = [](char c) { return c == ' ' || c == '[' || c == ']' || c == '\t' || c == '\r'; };
+    while (!field.empty() && ignored(field.front())) field.remove_prefix(1);
+    while (!field.empty() && ignored(field.back())) field.remove_suffix(1);
+    return field;
+}
+
+bool parseIntField(std::string_view field, int& result)
+{
+    field = trimField(field);
+    if (!field.empty() && field.front() == '+') field.remove_prefix(1); // stoi accepted a leading '+'
+    auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), result);
+    return ec == std::errc() && end != field.data();
+}
+
+// Parse a line in place. No allocation: the city name is returned as a view into the line.
+ParsedLine parseDataLine(std::string_view line, const RegionContext& region = mainRegion)
+{
+    ParsedLine parsed;
+
+    size_t dashPosition = line.find('-');
+    if (dashPosition == std::string_view::npos)
+    {
+        return parsed; // Comments, blank lines and anything else without a dash are ignored
+    }
+
+    std::string_view beforeDash = line.substr(0, dashPosition); // e.g. "[10, 20]"
+    std::string_view afterDash = line.substr(dashPosition + 1); // e.g. "50" or "5-Big_City"
+
+    size_t commaPosition = beforeDash.find(',');
+    if (commaPosition == std::string_view::npos ||
+        !parseIntField(beforeDash.substr(0, commaPosition), parsed.xPos) ||
+        !parseIntField(beforeDash.substr(commaPosition + 1), parsed.yPos))
+    {
+        parsed.xPos = parsed.yPos = -1;
+        return parsed; // No usable coordinates on this line
+    }
+
+    // Validate coordinates by checking for out of bounds
+    if (parsed.xPos < region.gridXmin || parsed.xPos > region.gridXmax || parsed.yPos < region.gridYmin || parsed.yPos > region.gridYmax)
+    {
+        parsed.kind = ParsedLine::OutOfBounds;
+        return parsed;
+    }
+    parsed.xPos -= region.gridXmin; // Adjust x position to start from 0
+    parsed.yPos -= region.gridYmin; // Adjust y position to start from 0
+
+    // Only a city location line has a second hyphen, e.g. "5-Big_City"
+    size_t hyphenPosition = afterDash.find('-');
+    if (hyphenPosition != std::string_view::npos)
+    {
+        if (!parseIntField(afterDash.substr(0, hyphenPosition), parsed.value))
+        {
+            return parsed;
+        }
+        parsed.cityname = afterDash.substr(hyphenPosition + 1);
+        if (!parsed.cityname.empty() && parsed.cityname.back() == '\r')
+        {
+            parsed.cityname.remove_suffix(1); // Tolerate CRLF line endings
+        }
+        parsed.kind = ParsedLine::City;
+    }
+    else
+    {
+        if (!parseIntField(afterDash, parsed.value))
+        {
+            return parsed;
+        }
+        parsed.kind = ParsedLine::Value;
+    }
+    return parsed;
+}
+
+// City metadata (name and bounding box) has to go through cityDataMap in line order
+struct CityLine
+{
+    int cityId;
+    int xPos;
+    int yPos;
+    std::string_view cityname; // Points into the file mapping
+};
+
+void applyCityLine(const CityLine& line, RegionContext& region = mainRegion)
+{
+    CityData& city = region.cityDataMap[line.cityId];
+    if (city.cityname != line.cityname)
+    {
+        city.cityname.assign(line.cityname.data(), line.cityname.size()); // Only copies the first time a city is seen
+    }
+    city.lowerLeftCoord = std::make_pair(std::min(line.xPos, city.lowerLeftCoord.first), std::min(line.yPos, city.lowerLeftCoord.second));
+    city.topRightCoord = std::make_pair(std::max(line.xPos, city.topRightCoord.first), std::max(line.yPos, city.topRightCoord.second));
+}
+
+// Validation messages for a parsed line, in the wording the readers have always used
+void appendDiagnostics(const ParsedLine& parsed, string& diagnostics)
+{
+    if (parsed.kind == ParsedLine::OutOfBounds)
+    {
+        diagnostics += "Error: Coordinates (" + to_string(parsed.xPos) + ", " + to_string(parsed.yPos) + ") are out of bounds.\n";
+    }
+    else if (parsed.kind == ParsedLine::City && parsed.value < 0)
+    {
+        diagnostics += "Error: Invalid city ID.\n"; // Validate city ID
+    }
+    else if (parsed.kind == ParsedLine::Value && (parsed.value < 0 || parsed.value > 100))
+    {
+        diagnostics += "Error: Invalid atmospheric pressure value.\n"; // Validate value
+    }
+}
+
+void processCityData(const string& line, int fileDataType, RegionContext& region) 
+{
+    processCityData(std::string_view(line), fileDataType, region);
+}
+
+void processCityData(std::string_view line, int fileDataType, RegionContext& region) 
+{ // fileDataType: 0 is citylocation.txt, 1 is cloudcover.txt, 2 is pressure.txt
+    ParsedLine parsed = parseDataLine(line);
+
+    string diagnostics;
+    appendDiagnostics(parsed, diagnostics);
+    if (!diagnostics.empty())
+    {
+        cerr << diagnostics << flush;
+    }
+
+    switch (parsed.kind)
+    {
+        case ParsedLine::City:
+        {
+            region.grid.reserveCityIds(parsed.value); // Widens a compact ID layer when needed (lines arrive one at a time here)
+            region.grid.setCity(parsed.xPos, parsed.yPos, parsed.value); // Set the cell as a city with this city ID
+            applyCityLine({parsed.value, parsed.xPos, parsed.yPos, parsed.cityname}, region);
+            break;
+        }
+
+        case ParsedLine::Value:
+            if (fileDataType == CloudFile) 
+            {
+                // Cloud cover
+                region.grid.setCloud(parsed.xPos, parsed.yPos, static_cast<float>(parsed.value)); // Explicitly cast to float for code readability
+            } else if (fileDataType == PressureFile) 
+            {
+                // Atmospheric pressure
+                region.grid.setPressure(parsed.xPos, parsed.yPos, static_cast<float>(parsed.value)); // Explicitly cast to float for code readability
+            }
+            break;
+
+        case ParsedLine::OutOfBounds:
+        case ParsedLine::Skip:
+            break;
+    }
+}
+
+// Size and rate of one file; a negative seconds leaves the rate out (the file was timed with others)
+void reportThroughput(ostream& log, const string& filename, size_t bytes, double seconds, const char* action = "Reading in")
+{
+    double megabytes = static_cast<double>(bytes) / (1024.0 * 1024.0);
+    ios::fmtflags savedFlags = log.flags();
+    streamsize savedPrecision = log.precision();
+    log << action << ' ' << filename << " ... done! (" << fixed << setprecision(2) << megabytes << " MB";
+    if (seconds >= 0)
+    {
+        log << ", " << (seconds > 0 ? megabytes / seconds : 0.0) << " MB/s";
+    }
+    log << ")\n";
+    log.flags(savedFlags);
+    log.precision(savedPrecision);
+}
+
+// Number of threads used by the parallel loaders (0 picks one per hardware thread)
+unsigned workerThreadLimit = 0;
+thread_local bool nestedWorker = false; // Set while a thread runs one task of an outer loop; its own loops then run inline
+
+unsigned workerThreadCount()
+{
+    if (nestedWorker)
+    {
+        return 1;
+    }
+    if (workerThreadLimit > 0)
+    {
+        return workerThreadLimit;
+    }
+    unsigned hardwareThreads = std::thread::hardware_concurrency();
+    return (hardwareThreads > 0) ? hardwareThreads : 1;
+}
+
+// Run task(0) .. task(taskCount - 1) on up to workerThreadCount() threads, the caller included
+template <typename Task>
+void parallelFor(size_t taskCount, Task task)
+{
+    size_t workerCount = std::min<size_t>(workerThreadCount(), taskCount);
+    if (workerCount <= 1)
+    {
+        for (size_t i = 0; i < taskCount; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> nextTask{0};
+    auto worker = [&]() {
+        for (size_t i = nextTask.fetch_add(1); i < taskCount; i = nextTask.fetch_add(1))
+        {
+            task(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workerCount - 1);
+    for (size_t w = 1; w < workerCount; w++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// parallelFor for many small tasks of uneven cost. Every worker starts with an equal share of the
+// index range and runs it grainSize tasks at a time; a worker whose share runs dry steals the back
+// half of the largest share left, so no thread idles while another still has a long tail.
+template <typename Task>
+void parallelForStealing(size_t taskCount, size_t grainSize, Task task)
+{
+    grainSize = std::max<size_t>(grainSize, 1);
+    size_t workerCount = std::min<size_t>(workerThreadCount(), (taskCount + grainSize - 1) / grainSize);
+    if (workerCount <= 1)
+    {
+        for (size_t i = 0; i < taskCount; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    struct Share
+    {
+        std::mutex lock;
+        size_t next = 0; // Remaining tasks are [next, end)
+        size_t end = 0;
+    };
+    std::vector<Share> shares(workerCount);
+    for (size_t w = 0; w < workerCount; w++)
+    {
+        shares[w].next = taskCount * w / workerCount;
+        shares[w].end = taskCount * (w + 1) / workerCount;
+    }
+
+    auto takeOwn = [&](Share& share, size_t& from, size_t& to) {
+        std::lock_guard<std::mutex> guard(share.lock);
+        if (share.next >= share.end)
+        {
+            return false;
+        }
+        from = share.next;
+        to = std::min(share.end, from + grainSize);
+        share.next = to;
+        return true;
+    };
+
+    // Move the back half of the busiest other share into shares[self]; false once every share is empty
+    auto steal = [&](size_t self) {
+        while (true)
+        {
+            size_t victim = self, mostLeft = 0;
+            for (size_t w = 0; w < workerCount; w++)
+            {
+                std::lock_guard<std::mutex> guard(shares[w].lock);
+                size_t left = shares[w].end - shares[w].next;
+                if (w != self && left > mostLeft)
+                {
+                    victim = w;
+                    mostLeft = left;
+                }
+            }
+            if (mostLeft == 0)
+            {
+                return false;
+            }
+
+            size_t stolenFrom, stolenTo;
+            {
+                std::lock_guard<std::mutex> guard(shares[victim].lock);
+                size_t left = shares[victim].end - shares[victim].next;
+                if (left == 0)
+                {
+                    continue; // Drained since the scan, look again
+                }
+                stolenTo = shares[victim].end;
+                stolenFrom = stolenTo - (left + 1) / 2;
+                shares[victim].end = stolenFrom;
+            }
+            std::lock_guard<std::mutex> guard(shares[self].lock);
+            shares[self].next = stolenFrom;
+            shares[self].end = stolenTo;
+            return true;
+        }
+    };
+
+    auto worker = [&](size_t self) {
+        size_t from, to;
+        do
+        {
+            while (takeOwn(shares[self], from, to))
+            {
+                for (size_t i = from; i < to; i++)
+                {
+                    task(i);
+                }
+            }
+        } while (steal(self));
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workerCount - 1);
+    for (size_t w = 1; w < workerCount; w++)
+    {
+        threads.emplace_back(worker, w);
+    }
+    worker(0);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// Per-phase figures for the most recent load, for --stats and the statistics menu entry.
+// Line and rejection counts come for free from the parser; clocks are only read when enabled.
+struct FileLoadStats
+{
+    string filename;
+    int fileDataType = 0;
+    size_t bytes = 0;
+    size_t lines = 0;
+    size_t outOfBounds = 0; // Lines rejected for coordinates outside the grid
+    size_t invalidValues = 0; // Lines with a negative city ID or a value outside 0-100
+    double parseSeconds = 0; // Summed over the file's chunks, so it can exceed the wall time
+};
+
+struct LoadStats
+{
+    double configSeconds = 0; // Config parsing and grid allocation
+    double ingestSeconds = 0; // Wall time of the concurrent data file load
+    double diagnosticsSeconds = 0; // Writing the validation messages to cerr
+    double averagesSeconds = 0; // Summed-area tables and city averages
+    std::vector<FileLoadStats> files;
+    size_t peakGridBytes = 0; // Grid layers plus summed-area tables
+    size_t citiesAggregated = 0;
+};
+
+bool statsEnabled = false;
+LoadStats loadStats;
+
+// Adds the time until the end of the scope to a LoadStats field when statistics are enabled
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(double& seconds) : target(statsEnabled ? &seconds : nullptr)
+    {
+        if (target != nullptr)
+        {
+            started = std::chrono::steady_clock::now();
+        }
+    }
+    ~PhaseTimer()
+    {
+        if (target != nullptr)
+        {
+            *target += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        }
+    }
+
+private:
+    double* target;
+    std::chrono::steady_clock::time_point started;
+};
+
+void notePeakGridMemory(const RegionContext& region = mainRegion); // Defined once the summed-area tables exist
+
+// A grid write produced by a parse worker, applied later by the worker owning its stripe
+struct CellWrite
+{
+    int xPos;
+    int yPos;
+    int value; // City ID for layer 0, otherwise the cloud cover / pressure value
+    int layer; // Same numbering as fileDataType: 0 city, 1 cloud cover, 2 pressure
+};
+
+// A newline-aligned slice of one input file and everything parsed out of it
+struct IngestChunk
+{
+    size_t fileIndex = 0;
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    std::vector<std::vector<CellWrite>> stripes = {}; // Writes grouped by owning stripe, in line order
+    std::vector<CityLine> cityLines = {};
+    string diagnostics = {}; // Validation messages in line order
+    size_t lines = 0;
+    size_t outOfBounds = 0;
+    size_t invalidValues = 0;
+    double parseSeconds = 0; // Only measured when statistics are enabled
+    std::unique_ptr<char[]> text = {}; // Decompressed lines the chunk owns; mapped files are read in place
+};
+
+const size_t ingestChunkBytes = 4u << 20; // Target size of one parse task
+const int ingestStripeSpan = GridStore::tileSize; // Grid rows (row-major) or columns (column-major) per stripe band, one sparse tile row
+
+// Stripe owning a cell: bands of ingestStripeSpan major-axis lines are dealt round-robin,
+// so each stripe can be written by exactly one thread without locking
+size_t ingestStripeOf(int xPos, int yPos, size_t stripeCount, const RegionContext& region = mainRegion)
+{
+    int major = (region.grid.layout() == GridLayout::RowMajor) ? yPos : xPos;
+    return static_cast<size_t>(major / ingestStripeSpan) % stripeCount;
+}
+
+// Call visit(line) for every line in [begin, end), without the trailing newline
+template <typename Visitor>
+void forEachLine(const char* begin, const char* end, Visitor visit)
+{
+    const char* cursor = begin;
+    while (cursor < end)
+    {
+        const char* newline = static_cast<const char*>(memchr(cursor, '\n', static_cast<size_t>(end - cursor)));
+        const char* lineEnd = (newline != nullptr) ? newline : end;
+        visit(std::string_view(cursor, static_cast<size_t>(lineEnd - cursor)));
+        cursor = lineEnd + 1;
+    }
+}
+
+// Cut a mapped file into chunks of about ingestChunkBytes that end right after a newline
+void appendFileChunks(const MappedFile& file, size_t fileIndex, std::vector<IngestChunk>& chunks)
+{
+    const char* cursor = file.data();
+    const char* end = cursor + file.size();
+    while (cursor < end)
+    {
+        const char* chunkEnd = end;
+        if (static_cast<size_t>(end - cursor) > ingestChunkBytes)
+        {
+            const char* newline = static_cast<const char*>(memchr(cursor + ingestChunkBytes, '\n', static_cast<size_t>(end - cursor) - ingestChunkBytes));
+            chunkEnd = (newline != nullptr) ? newline + 1 : end;
+        }
+        chunks.push_back(IngestChunk{fileIndex, cursor, chunkEnd});
+        cursor = chunkEnd;
+    }
+}
+
+// Chunks of a compressed input on their way from its decompressing thread to the parsers. It
+// holds at most capacity chunks, so decompression runs only a little ahead of the parsing.
+class ChunkQueue
+{
+public:
+    ChunkQueue(size_t capacity, size_t producers) : capacity(capacity), producers(producers) {}
+
+    void push(std::unique_ptr<IngestChunk> chunk)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notFull.wait(guard, [&]() { return chunks.size() < capacity; });
+        chunks.push_back(std::move(chunk));
+        notEmpty.notify_one();
+    }
+
+    void producerDone()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        producers--;
+        notEmpty.notify_all();
+    }
+
+    // Next chunk to parse, or null once every producer is done and the queue is empty
+    std::unique_ptr<IngestChunk> pop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait(guard, [&]() { return !chunks.empty() || producers == 0; });
+        if (chunks.empty())
+        {
+            return nullptr;
+        }
+        std::unique_ptr<IngestChunk> chunk = std::move(chunks.front());
+        chunks.pop_front();
+        notFull.notify_one();
+        return chunk;
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable notFull, notEmpty;
+    std::deque<std::unique_ptr<IngestChunk>> chunks;
+    size_t capacity;
+    size_t producers;
+};
+
+// Decompress a file into newline-aligned chunks of about ingestChunkBytes, each handed to the
+// parsers as it fills. Returns the decompressed size, or -1 on corrupt data.
+long long decompressFileChunks(CompressedReader& reader, size_t fileIndex, ChunkQueue& queue)
+{
+    long long total = 0;
+    string carry; // Unfinished last line of the previous chunk
+    bool atEnd = false;
+    while (!atEnd)
+    {
+        size_t capacity = carry.size() + ingestChunkBytes;
+        std::unique_ptr<char[]> text(new char[capacity]);
+        memcpy(text.get(), carry.data(), carry.size());
+        size_t size = carry.size();
+        while (size < capacity)
+        {
+            ssize_t length = reader.read(text.get() + size, capacity - size);
+            if (length < 0)
+            {
+                return -1;
+            }
+            if (length == 0)
+            {
+                atEnd = true;
+                break;
+            }
+            size += static_cast<size_t>(length);
+            total += length;
+        }
+
+        size_t chunkEnd = size;
+        if (!atEnd)
+        {
+            const char* newline = static_cast<const char*>(memrchr(text.get(), '\n', size));
+            chunkEnd = (newline != nullptr) ? static_cast<size_t>(newline - text.get()) + 1 : 0; // 0: a line longer than the chunk, keep reading
+        }
+        carry.assign(text.get() + chunkEnd, size - chunkEnd);
+        if (chunkEnd > 0)
+        {
+            std::unique_ptr<IngestChunk> chunk(new IngestChunk{fileIndex, text.get(), text.get() + chunkEnd});
+            chunk->text = std::move(text);
+            queue.push(std::move(chunk));
+        }
+    }
+    return total;
+}
+
+// Call visit(line) for every line of a data file that is read whole by one thread: a plain file
+// is mapped, a compressed one decompressed a block at a time. Returns false if the file could not
+// be opened or its data is corrupt; error then holds the message to print (empty for a missing
+// file, which the callers report themselves). Lines before the corruption have been visited.
+template <typename Visitor>
+bool forEachInputLine(const string& fileName, string& error, Visitor visit)
+{
+    if (compressionOf(fileName) == Compression::None)
+    {
+        MappedFile file;
+        if (!file.open(fileName))
+        {
+            return false;
+        }
+        forEachLine(file.data(), file.data() + file.size(), visit);
+        return true;
+    }
+
+    CompressedReader reader;
+    if (!reader.open(fileName))
+    {
+        if (access(fileName.c_str(), F_OK) == 0)
+        {
+            error = "Error: " + reader.error() + '\n';
+        }
+        return false;
+    }
+    std::unique_ptr<char[]> block(new char[ingestChunkBytes]);
+    string carry; // Unfinished last line of the previous block
+    bool atEnd = false;
+    while (!atEnd)
+    {
+        // A block is filled before any of it is visited, so corrupt data drops the whole block as ingestDataFiles does
+        size_t length = 0;
+        while (length < ingestChunkBytes)
+        {
+            ssize_t read = reader.read(block.get() + length, ingestChunkBytes - length);
+            if (read < 0)
+            {
+                error = "Error: " + fileName + ": " + reader.error() + '\n';
+                return false;
+            }
+            if (read == 0)
+            {
+                atEnd = true;
+                break;
+            }
+            length += static_cast<size_t>(read);
+        }
+        const char* begin = block.get();
+        const char* end = begin + length;
+        const char* lastNewline = static_cast<const char*>(memrchr(begin, '\n', length));
+        if (lastNewline == nullptr)
+        {
+            carry.append(begin, end); // A line longer than the block
+            continue;
+        }
+        if (!carry.empty())
+        {
+            const char* newline = static_cast<const char*>(memchr(begin, '\n', length));
+            carry.append(begin, newline);
+            visit(std::string_view(carry));
+            begin = newline + 1;
+        }
+        forEachLine(begin, lastNewline + 1, visit);
+        carry.assign(lastNewline + 1, end);
+    }
+    if (!carry.empty())
+    {
+        visit(std::string_view(carry));
+    }
+    return true;
+}
+
+void parseIngestChunk(IngestChunk& chunk, int fileDataType, size_t stripeCount, const RegionContext& region = mainRegion)
+{
+    PhaseTimer timer(chunk.parseSeconds);
+    chunk.stripes.resize(stripeCount);
+    size_t expectedWrites = static_cast<size_t>(chunk.end - chunk.begin) / 10 / stripeCount + 1; // ~10 bytes per line
+    for (std::vector<CellWrite>& stripe : chunk.stripes)
+    {
+        stripe.reserve(expectedWrites);
+    }
+
+    forEachLine(chunk.begin, chunk.end, [&](std::string_view line) {
+        ParsedLine parsed = parseDataLine(line, region);
+        appendDiagnostics(parsed, chunk.diagnostics);
+        chunk.lines++;
+        chunk.outOfBounds += (parsed.kind == ParsedLine::OutOfBounds);
+        chunk.invalidValues += (parsed.kind == ParsedLine::City && parsed.value < 0) ||
+                               (parsed.kind == ParsedLine::Value && (parsed.value < 0 || parsed.value > 100));
+        if (parsed.kind == ParsedLine::City)
+        {
+            chunk.stripes[ingestStripeOf(parsed.xPos, parsed.yPos, stripeCount, region)].push_back({parsed.xPos, parsed.yPos, parsed.value, CityFile});
+            chunk.cityLines.push_back({parsed.value, parsed.xPos, parsed.yPos, parsed.cityname});
+        }
+        else if (parsed.kind == ParsedLine::Value && (fileDataType == CloudFile || fileDataType == PressureFile))
+        {
+            chunk.stripes[ingestStripeOf(parsed.xPos, parsed.yPos, stripeCount, region)].push_back({parsed.xPos, parsed.yPos, parsed.value, fileDataType});
+        }
+    });
+}
+
+
+// Load several data files at once. Every file is mapped and split into newline-aligned chunks,
+// which are handled a window at a time in (file, chunk) order: the window's chunks are parsed on
+// the worker pool, then its writes are applied stripe by stripe in (file, chunk, line) order and
+// freed before the next window is parsed, so the pending writes stay bounded by the window.
+// Duplicate coordinates therefore resolve exactly as the sequential readers did: the last line
+// wins, city file before cloud before pressure. A compressed file gets a thread of its own that
+// decompresses it into chunks a window or so ahead of the parsers.
+std::vector<bool> ingestDataFiles(const std::vector<IngestRequest>& requests, ostream& log, RegionContext& region)
+{
+    GridStore& grid = region.grid;
+    auto startTime = std::chrono::steady_clock::now();
+    PhaseTimer timer(loadStats.ingestSeconds);
+
+    std::vector<bool> opened(requests.size(), false);
+    std::vector<MappedFile> files(requests.size());
+    std::vector<size_t> fileBytes(requests.size(), 0); // Decompressed size for compressed files
+    std::vector<IngestChunk> chunks; // Chunks of the mapped files
+    std::vector<std::unique_ptr<CompressedReader>> readers(requests.size());
+    std::vector<std::unique_ptr<ChunkQueue>> queues(requests.size());
+    std::vector<string> readErrors(requests.size());
+    size_t windowChunks = static_cast<size_t>(workerThreadCount()) * 2;
+
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (compressionOf(requests[f].filename) != Compression::None)
+        {
+            readers[f].reset(new CompressedReader);
+            opened[f] = readers[f]->open(requests[f].filename);
+            if (!opened[f] && access(requests[f].filename.c_str(), F_OK) == 0)
+            {
+                readErrors[f] = "Error: " + readers[f]->error() + '\n'; // A missing file is reported by the caller
+            }
+        }
+    }
+    std::vector<std::thread> decompressors;
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (readers[f] && opened[f])
+        {
+            queues[f].reset(new ChunkQueue(windowChunks, 1));
+            decompressors.emplace_back([&, f]() {
+                long long bytes = decompressFileChunks(*readers[f], f, *queues[f]);
+                if (bytes < 0)
+                {
+                    readErrors[f] = "Error: " + requests[f].filename + ": " + readers[f]->error() + '\n';
+                }
+                fileBytes[f] = static_cast<size_t>(std::max(bytes, 0LL));
+                queues[f]->producerDone();
+            });
+        }
+    }
+
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (!readers[f])
+        {
+            opened[f] = files[f].open(requests[f].filename);
+        }
+        if (!readers[f] && opened[f])
+        {
+            fileBytes[f] = files[f].size();
+            appendFileChunks(files[f], f, chunks);
+        }
+    }
+
+    size_t firstStatsFile = loadStats.files.size();
+    if (statsEnabled)
+    {
+        for (size_t f = 0; f < requests.size(); f++)
+        {
+            FileLoadStats file;
+            file.filename = requests[f].filename;
+            file.fileDataType = requests[f].fileDataType;
+            loadStats.files.push_back(file);
+        }
+    }
+
+    size_t stripeCount = static_cast<size_t>(workerThreadCount()) * 4;
+    std::vector<double> firstWindowStart(requests.size(), -1), lastWindowEnd(requests.size(), 0); // Seconds since startTime
+    std::vector<IngestChunk*> window;
+    std::vector<std::unique_ptr<IngestChunk>> decompressed; // The window's chunks of compressed files
+    size_t file = 0, nextMapped = 0;
+    while (true)
+    {
+        // Next window: up to windowChunks chunks in (file, chunk) order
+        std::chrono::duration<double> windowStart = std::chrono::steady_clock::now() - startTime; // Includes waiting for decompression
+        window.clear();
+        decompressed.clear();
+        while (window.size() < windowChunks && file < requests.size())
+        {
+            if (queues[file])
+            {
+                std::unique_ptr<IngestChunk> chunk = queues[file]->pop();
+                if (chunk)
+                {
+                    window.push_back(chunk.get());
+                    decompressed.push_back(std::move(chunk));
+                    continue;
+                }
+            }
+            else if (nextMapped < chunks.size() && chunks[nextMapped].fileIndex == file)
+            {
+                window.push_back(&chunks[nextMapped++]);
+                continue;
+            }
+            file++;
+        }
+        if (window.empty())
+        {
+            break;
+        }
+
+        // Phase 1: parse the window's chunks concurrently
+        parallelFor(window.size(), [&](size_t w) {
+            parseIngestChunk(*window[w], requests[window[w]->fileIndex].fileDataType, stripeCount, region);
+        });
+
+        // A compact grid sizes its city ID layer before the stripes write into it concurrently
+        int largestCityId = -1;
+        for (const IngestChunk* chunk : window)
+        {
+            for (const CityLine& line : chunk->cityLines)
+            {
+                largestCityId = std::max(largestCityId, line.cityId);
+            }
+        }
+        grid.reserveCityIds(largestCityId);
+
+        // Phase 2: task 0 replays the city metadata, the others each own one stripe of the grid
+        parallelFor(stripeCount + 1, [&](size_t task) {
+            if (task == 0)
+            {
+                for (const IngestChunk* chunk : window)
+                {
+                    for (const CityLine& line : chunk->cityLines)
+                    {
+                        applyCityLine(line, region);
+                    }
+                }
+                return;
+            }
+
+            size_t stripe = task - 1;
+            for (const IngestChunk* chunk : window)
+            {
+                for (const CellWrite& write : chunk->stripes[stripe])
+                {
+                    switch (write.layer)
+                    {
+                        case CityFile: grid.setCity(write.xPos, write.yPos, write.value); break;
+                        case CloudFile: grid.setCloud(write.xPos, write.yPos, static_cast<float>(write.value)); break;
+                        case PressureFile: grid.setPressure(write.xPos, write.yPos, static_cast<float>(write.value)); break;
+                    }
+                }
+            }
+        });
+
+        {
+            PhaseTimer diagnosticsTimer(loadStats.diagnosticsSeconds);
+            for (const IngestChunk* chunk : window)
+            {
+                *region.errors << chunk->diagnostics;
+            }
+        }
+        std::chrono::duration<double> windowEnd = std::chrono::steady_clock::now() - startTime;
+        for (IngestChunk* chunk : window)
+        {
+            if (firstWindowStart[chunk->fileIndex] < 0)
+            {
+                firstWindowStart[chunk->fileIndex] = windowStart.count();
+            }
+            lastWindowEnd[chunk->fileIndex] = windowEnd.count();
+            if (statsEnabled)
+            {
+                FileLoadStats& stats = loadStats.files[firstStatsFile + chunk->fileIndex];
+                stats.lines += chunk->lines;
+                stats.outOfBounds += chunk->outOfBounds;
+                stats.invalidValues += chunk->invalidValues;
+                stats.parseSeconds += chunk->parseSeconds;
+            }
+            // The window is applied: free its writes (decompressed chunks go with the window)
+            std::vector<std::vector<CellWrite>>().swap(chunk->stripes);
+            std::vector<CityLine>().swap(chunk->cityLines);
+            string().swap(chunk->diagnostics);
+        }
+    }
+    for (std::thread& decompressor : decompressors)
+    {
+        decompressor.join();
+    }
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        opened[f] = opened[f] && readErrors[f].empty(); // A corrupt file counts as missing, like a file that failed to open
+    }
+
+    {
+        PhaseTimer diagnosticsTimer(loadStats.diagnosticsSeconds);
+        for (const string& error : readErrors)
+        {
+            *region.errors << error;
+        }
+        *region.errors << flush;
+    }
+
+    if (statsEnabled)
+    {
+        for (size_t f = 0; f < requests.size(); f++)
+        {
+            loadStats.files[firstStatsFile + f].bytes = opened[f] ? fileBytes[f] : 0;
+        }
+        notePeakGridMemory(region); // Sparse tiles are allocated while loading
+    }
+
+    // Each file's rate covers the windows that held its chunks, from the first one's start to the
+    // last one's apply; files sharing a window were read together and share its time
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (opened[f])
+        {
+            double seconds = (firstWindowStart[f] < 0) ? 0 : lastWindowEnd[f] - firstWindowStart[f]; // An empty file had no window
+            reportThroughput(log, requests[f].filename, fileBytes[f], seconds);
+        }
+    }
+    return opened;
+}
+
+
+void SummedAreaTable::build(const GridStore& store, LayerReader valueAt)
+{
+    tableWidth = store.width();
+    tableHeight = store.height();
+    std::vector<uint32_t>().swap(narrowSums);
+    std::vector<long long>().swap(sums);
+
+    // Every entry is at most the layer total when no value is negative
+    std::vector<long long> rowTotals(static_cast<size_t>(tableHeight));
+    std::vector<char> rowNegative(static_cast<size_t>(tableHeight));
+    parallelFor(static_cast<size_t>(tableHeight), [&](size_t y) {
+        GridStore::RowView row = store.row(static_cast<int>(y));
+        long long total = 0;
+        bool negative = false;
+        for (int x = 0; x < tableWidth; x++)
+        {
+            long long value = static_cast<long long>((row.*valueAt)(x));
+            total += value;
+            negative = negative || value < 0;
+        }
+        rowTotals[y] = total;
+        rowNegative[y] = negative;
+    });
+    long long layerTotal = 0;
+    for (long long total : rowTotals) layerTotal += total;
+    bool narrow = std::find(rowNegative.begin(), rowNegative.end(), 1) == rowNegative.end() && layerTotal <= static_cast<long long>(UINT32_MAX);
+    if (narrow)
+    {
+        accumulate(store, valueAt, narrowSums);
+    }
+    else
+    {
+        accumulate(store, valueAt, sums);
+    }
+}
+
+template <typename Sum>
+void SummedAreaTable::accumulate(const GridStore& store, LayerReader valueAt, std::vector<Sum>& table)
+{
+    size_t stride = static_cast<size_t>(tableWidth) + 1;
+    table.assign(stride * (static_cast<size_t>(tableHeight) + 1), 0);
+
+    // Pass 1: running sum along each row, rows are independent
+    parallelFor(static_cast<size_t>(tableHeight), [&](size_t y) {
+        GridStore::RowView row = store.row(static_cast<int>(y));
+        Sum* out = &table[(y + 1) * stride];
+        Sum running = 0;
+        for (int x = 0; x < tableWidth; x++)
+        {
+            running += static_cast<Sum>(static_cast<long long>((row.*valueAt)(x)));
+            out[x + 1] = running;
+        }
+    });
+
+    // Pass 2: accumulate rows downwards, split into independent column blocks
+    const size_t blockWidth = 4096;
+    size_t blockCount = (stride + blockWidth - 1) / blockWidth;
+    parallelFor(blockCount, [&](size_t block) {
+        size_t xFrom = block * blockWidth;
+        size_t xTo = std::min(stride, xFrom + blockWidth);
+        for (int y = 1; y <= tableHeight; y++)
+        {
+            Sum* out = &table[static_cast<size_t>(y) * stride];
+            const Sum* below = out - stride;
+            for (size_t x = xFrom; x < xTo; x++)
+            {
+                out[x] += below[x];
+            }
+        }
+    });
+}
+
+void notePeakGridMemory(const RegionContext& region)
+{
+    loadStats.peakGridBytes = std::max(loadStats.peakGridBytes, region.grid.memoryBytes() + region.cloudCoverSums.memoryBytes() + region.pressureSums.memoryBytes());
+}
+
+// Tables as large as the whole grid would defeat sparse and compact storage (8-16 bytes per cell
+// against 1-3); their sums come from the populated tiles or the byte layers instead
+bool gridUsesSummedAreaTables(const RegionContext& region)
+{
+    return !region.grid.isSparse() && !region.grid.isCompact();
+}
+
+void buildSummedAreaTables(RegionContext& region)
+{
+    if (!gridUsesSummedAreaTables(region))
+    {
+        region.cloudCoverSums.clear();
+        region.pressureSums.clear();
+        return;
+    }
+    region.cloudCoverSums.build(region.grid, &GridStore::RowView::cloud);
+    region.pressureSums.build(region.grid, &GridStore::RowView::pressure);
+}
+
+// Exact cloud and pressure sums over an inclusive 0-based rectangle: four table lookups on a dense
+// grid, a walk over the populated tiles on a sparse one and over the byte layers on a compact one
+void rectangleSums(int xFrom, int yFrom, int xTo, int yTo, long long& cloudTotal, long long& pressureTotal, RegionContext& region)
+{
+    if (!gridUsesSummedAreaTables(region))
+    {
+        region.grid.rectSums(xFrom, yFrom, xTo, yTo, cloudTotal, pressureTotal);
+        return;
+    }
+    if (region.cloudCoverSums.empty())
+    {
+        buildSummedAreaTables(region); // A snapshot load skips the tables until a query needs them
+    }
+    cloudTotal = region.cloudCoverSums.rectSum(xFrom, yFrom, xTo, yTo);
+    pressureTotal = region.pressureSums.rectSum(xFrom, yFrom, xTo, yTo);
+}
+
+// The cells averaged for a city: its bounding box plus a one-cell border, clipped to the grid
+void cityNeighborhood(const CityData& data, int& xFrom, int& yFrom, int& xTo, int& yTo, const RegionContext& region)
+{
+    xFrom = std::max(data.lowerLeftCoord.first - 1, region.gridXmin) - region.gridXmin;
+    xTo = std::min(data.topRightCoord.first + 1, region.gridXmax) - region.gridXmin;
+    yFrom = std::max(data.lowerLeftCoord.second - 1, region.gridYmin) - region.gridYmin;
+    yTo = std::min(data.topRightCoord.second + 1, region.gridYmax) - region.gridYmin;
+}
+
+// Grow a city's cell words by one cell in all eight directions, clipped to the grid. Each word is
+// spread sideways with shifts (bits crossing a word edge carry into the neighbouring word) and
+// ORed into the rows above and below; the pieces are then sorted and merged word by word.
+std::vector<NeighborhoodWord> dilateCityCells(const std::vector<NeighborhoodWord>& cells, int width, int height)
+{
+    int wordsAcross = (width + 63) / 64;
+    std::vector<NeighborhoodWord> pieces;
+    pieces.reserve(cells.size() * 5);
+    for (const NeighborhoodWord& cell : cells)
+    {
+        uint64_t spread = cell.bits | (cell.bits << 1) | (cell.bits >> 1);
+        for (int y = std::max(cell.y - 1, 0); y <= std::min(cell.y + 1, height - 1); y++)
+        {
+            pieces.push_back({y, cell.word, spread});
+            if ((cell.bits & 1) != 0 && cell.word > 0)
+            {
+                pieces.push_back({y, cell.word - 1, uint64_t(1) << 63});
+            }
+            if ((cell.bits >> 63) != 0 && cell.word + 1 < wordsAcross)
+            {
+                pieces.push_back({y, cell.word + 1, 1});
+            }
+        }
+    }
+    std::sort(pieces.begin(), pieces.end(), [](const NeighborhoodWord& a, const NeighborhoodWord& b) {
+        return (a.y != b.y) ? a.y < b.y : a.word < b.word;
+    });
+
+    std::vector<NeighborhoodWord> mask;
+    for (const NeighborhoodWord& piece : pieces)
+    {
+        if (!mask.empty() && mask.back().y == piece.y && mask.back().word == piece.word)
+        {
+            mask.back().bits |= piece.bits;
+        }
+        else
+        {
+            mask.push_back(piece);
+        }
+    }
+    int lastWordBits = width - (wordsAcross - 1) * 64;
+    for (NeighborhoodWord& word : mask)
+    {
+        if (word.word == wordsAcross - 1 && lastWordBits < 64)
+        {
+            word.bits &= (uint64_t(1) << lastWordBits) - 1; // Nothing right of the grid
+        }
+    }
+    return mask;
+}
+
+// Exact mode: give every city the mask of cells it averages. One pass over the city layer (in row
+// bands on the worker threads) collects each city's own cells as words; each city is then dilated
+// on its own, so the work follows the cities' footprints rather than their bounding boxes.
+void buildExactNeighborhoods(RegionContext& region)
+{
+    const GridStore& grid = region.grid;
+    typedef std::unordered_map<int, std::vector<NeighborhoodWord>> CellWords;
+    size_t bandCount = std::min<size_t>(static_cast<size_t>(workerThreadCount()) * 4, static_cast<size_t>(std::max(grid.height(), 1)));
+    std::vector<CellWords> bands(bandCount);
+    parallelFor(bandCount, [&](size_t band) {
+        int yFrom = static_cast<int>(grid.height() * band / bandCount);
+        int yTo = static_cast<int>(grid.height() * (band + 1) / bandCount);
+        for (int y = yFrom; y < yTo; y++)
+        {
+            GridStore::RowView row = grid.row(y);
+            for (int x = 0; x < grid.width(); x++)
+            {
+                int cityId = row.cityId(x);
+                if (cityId < 0)
+                {
+                    continue;
+                }
+                std::vector<NeighborhoodWord>& words = bands[band][cityId];
+                if (words.empty() || words.back().y != y || words.back().word != x / 64)
+                {
+                    words.push_back({y, x / 64, 0});
+                }
+                words.back().bits |= uint64_t(1) << (x % 64);
+            }
+        }
+    });
+
+    std::vector<std::pair<const int, CityData>*> cities;
+    cities.reserve(region.cityDataMap.size());
+    for (auto& cityData : region.cityDataMap)
+    {
+        cities.push_back(&cityData);
+    }
+    parallelForStealing(cities.size(), 16, [&](size_t c) {
+        std::vector<NeighborhoodWord> cells; // Bands are in row order, so the words stay sorted
+        for (const CellWords& band : bands)
+        {
+            auto found = band.find(cities[c]->first);
+            if (found != band.end())
+            {
+                cells.insert(cells.end(), found->second.begin(), found->second.end());
+            }
+        }
+        cities[c]->second.neighborhoodMask = dilateCityCells(cells, grid.width(), grid.height());
+    });
+}
+
+// Call visit(y, xFrom, xTo) for each horizontal run of cells a city averages (0-based offsets, in
+// row order): the rows of its neighborhood rectangle, or in exact mode the runs of its mask
+template <typename Visitor>
+void forEachNeighborhoodRun(const CityData& data, const RegionContext& region, Visitor visit)
+{
+    if (neighborhoodMode == NeighborhoodMode::BoundingBox)
+    {
+        int xFrom, yFrom, xTo, yTo;
+        cityNeighborhood(data, xFrom, yFrom, xTo, yTo, region);
+        for (int y = yFrom; xFrom <= xTo && y <= yTo; y++)
+        {
+            visit(y, xFrom, xTo);
+        }
+        return;
+    }
+
+    int runY = -1, runFrom = 0, runTo = 0;
+    for (const NeighborhoodWord& word : data.neighborhoodMask)
+    {
+        uint64_t bits = word.bits;
+        while (bits != 0)
+        {
+            int start = __builtin_ctzll(bits);
+            uint64_t gap = ~(bits >> start);
+            int length = (gap == 0) ? 64 - start : __builtin_ctzll(gap);
+            int from = word.word * 64 + start;
+            if (word.y == runY && from == runTo + 1)
+            {
+                runTo = from + length - 1; // Continues a run from the previous word
+            }
+            else
+            {
+                if (runY >= 0) visit(runY, runFrom, runTo);
+                runY = word.y;
+                runFrom = from;
+                runTo = from + length - 1;
+            }
+            bits = (start + length >= 64) ? 0 : bits & (~uint64_t(0) << (start + length));
+        }
+    }
+    if (runY >= 0)
+    {
+        visit(runY, runFrom, runTo);
+    }
+}
+
+// Exact mode: whether a cell is in a city's mask
+bool neighborhoodMaskContains(const CityData& data, int x, int y)
+{
+    auto found = std::lower_bound(data.neighborhoodMask.begin(), data.neighborhoodMask.end(), std::make_pair(y, x / 64),
+                                  [](const NeighborhoodWord& word, const std::pair<int, int>& key) {
+                                      return (word.y != key.first) ? word.y < key.first : word.word < key.second;
+                                  });
+    return found != data.neighborhoodMask.end() && found->y == y && found->word == x / 64 && ((found->bits >> (x % 64)) & 1) != 0;
+}
+
+// Average cloud cover and pressure over an inclusive rectangle of grid coordinates (not offsets).
+// The rectangle is clipped to the grid; returns false when nothing of it lies inside.
+bool regionAverage(int x0, int y0, int x1, int y1, float& avgCloudCover, float& avgAtmosphericPressure, RegionContext& region)
+{
+    int xFrom = std::max(std::min(x0, x1), region.gridXmin) - region.gridXmin;
+    int xTo = std::min(std::max(x0, x1), region.gridXmax) - region.gridXmin;
+    int yFrom = std::max(std::min(y0, y1), region.gridYmin) - region.gridYmin;
+    int yTo = std::min(std::max(y0, y1), region.gridYmax) - region.gridYmin;
+    if (xFrom > xTo || yFrom > yTo || region.grid.empty())
+    {
+        return false;
+    }
+
+    long long totalCloud, totalPressure;
+    rectangleSums(xFrom, yFrom, xTo, yTo, totalCloud, totalPressure, region);
+    float totalCells = static_cast<float>(static_cast<long long>(xTo - xFrom + 1) * (yTo - yFrom + 1));
+    avgCloudCover = static_cast<float>(totalCloud) / totalCells;
+    avgAtmosphericPressure = static_cast<float>(totalPressure) / totalCells;
+    return true;
+}
+
+// Calculate the average atmospheric pressure and cloud cover from the exact totals
+void updateCityAverages(CityData& data)
+{
+    data.avgAtmosphericPressure = static_cast<float>(data.totalAtmosphericPressure) / static_cast<float>(data.neighborhoodCells);
+    data.avgCloudCover = static_cast<float>(data.totalCloudCover) / static_cast<float>(data.neighborhoodCells);
+}
+
+// Fill in avgCloudCover / avgAtmosphericPressure for every city from the summed-area tables
+// (or the sparse tiles).
+// The exact integer sums equal the old float accumulation whenever that was exact (totals below 2^24).
+// Cities are independent, so they are split across the worker threads and updated in place.
+void computeCityAverages(RegionContext& region)
+{
+    if (gridUsesSummedAreaTables(region) && region.cloudCoverSums.empty())
+    {
+        buildSummedAreaTables(region); // Build once here, the workers only read the tables
+    }
+    bool exact = (neighborhoodMode == NeighborhoodMode::Exact);
+    if (exact)
+    {
+        buildExactNeighborhoods(region);
+    }
+
+    std::vector<CityData*> cities;
+    cities.reserve(region.cityDataMap.size());
+    for (auto& cityData : region.cityDataMap)
+    {
+        cities.push_back(&cityData.second);
+    }
+
+    PhaseTimer timer(loadStats.averagesSeconds);
+    if (statsEnabled)
+    {
+        loadStats.citiesAggregated += cities.size();
+    }
+    parallelForStealing(cities.size(), 256, [&](size_t i) {
+        CityData& data = *cities[i];
+
+        int xFrom, yFrom, xTo, yTo;
+        cityNeighborhood(data, xFrom, yFrom, xTo, yTo, region);
+
+        // An empty neighborhood keeps the old 0 / 0 result (NaN) rather than reading outside the table
+        long long totalPressure = 0, totalCloud = 0, totalCells = 0;
+        if (exact)
+        {
+            forEachNeighborhoodRun(data, region, [&](int y, int runFrom, int runTo) {
+                long long runCloud, runPressure;
+                rectangleSums(runFrom, y, runTo, y, runCloud, runPressure, region);
+                totalCloud += runCloud;
+                totalPressure += runPressure;
+                totalCells += runTo - runFrom + 1;
+            });
+        }
+        else if (xFrom <= xTo && yFrom <= yTo)
+        {
+            rectangleSums(xFrom, yFrom, xTo, yTo, totalCloud, totalPressure, region);
+            totalCells = static_cast<long long>(xTo - xFrom + 1) * (yTo - yFrom + 1);
+        }
+
+        data.totalAtmosphericPressure = totalPressure;
+        data.totalCloudCover = totalCloud;
+        data.neighborhoodCells = totalCells;
+        updateCityAverages(data);
+    });
+}
+
+bool inFile;
+
+// Lookup tables for the integral 0-100 values every valid input produces
+std::array<char, 101> makeLmhSymbolTable()
+{
+    std::array<char, 101> table{};
+    for (int value = 0; value <= 100; value++)
+    {
+        table[value] = convertToLMHSymbol(static_cast<float>(value));
+    }
+    return table;
+}
+
+std::array<char, 101> makeIndexDigitTable()
+{
+    std::array<char, 101> table{};
+    for (int value = 0; value <= 100; value++)
+    {
+        table[value] = static_cast<char>('0' + static_cast<int>(std::max(0.f, static_cast<float>(value) - 1) / 10.f));
+    }
+    return table;
+}
+
+const std::array<char, 101> lmhSymbolTable = makeLmhSymbolTable();
+const std::array<char, 101> indexDigitTable = makeIndexDigitTable();
+
+// Table slot for a layer value, or -1 when it is outside 0-100 or not a whole number
+inline int tableSlot(float value)
+{
+    int whole = static_cast<int>(value);
+    return (whole >= 0 && whole <= 100 && static_cast<float>(whole) == value) ? whole : -1;
+}
+
+// ---- Bulk classification kernels ----
+// Whole-layer versions of convertToLMHSymbol, the indMapPrintCell index digit and rainchance, one
+// output byte per cell. On x86-64 an AVX2 version (compare and blend, 8 cells at a time) is chosen
+// at run time when the CPU supports it; the scalar loops are the reference and the fallback.
+
+bool simdKernelsEnabled = true; // --no-simd forces the scalar kernels
+
+// Index digit '0'-'9' exactly as indMapPrintCell computes it, or 0 when the index needs more than
+// one digit (only for invalid values above 100; the renderer prints those the slow way)
+inline uint8_t indexDigitCode(float value)
+{
+    float index = std::max(0.f, value - 1) / 10.f;
+    return (index < 10.f) ? static_cast<uint8_t>('0' + static_cast<int>(index)) : 0;
+}
+
+void classifyLmhScalar(const float* values, size_t count, uint8_t* out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = static_cast<uint8_t>(convertToLMHSymbol(values[i]));
+    }
+}
+
+void indexDigitsScalar(const float* values, size_t count, uint8_t* out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = indexDigitCode(values[i]);
+    }
+}
+
+#ifdef WIPS_AVX2_KERNELS
+// Narrow eight 32-bit lanes holding byte values to eight bytes
+__attribute__((target("avx2"))) inline void storeLaneBytes(__m256i lanes, uint8_t* out)
+{
+    __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(words, words));
+}
+
+__attribute__((target("avx2"))) void classifyLmhAvx2(const float* values, size_t count, uint8_t* out)
+{
+    const __m256 lowLimit = _mm256_set1_ps(35.f), mediumLimit = _mm256_set1_ps(65.f);
+    const __m256 low = _mm256_castsi256_ps(_mm256_set1_epi32('L'));
+    const __m256 medium = _mm256_castsi256_ps(_mm256_set1_epi32('M'));
+    const __m256 high = _mm256_castsi256_ps(_mm256_set1_epi32('H'));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 value = _mm256_loadu_ps(values + i);
+        // Ordered compares are false for NaN, which therefore stays 'H' as in convertToLMHSymbol
+        __m256 symbol = _mm256_blendv_ps(high, medium, _mm256_cmp_ps(value, mediumLimit, _CMP_LT_OQ));
+        symbol = _mm256_blendv_ps(symbol, low, _mm256_cmp_ps(value, lowLimit, _CMP_LT_OQ));
+        storeLaneBytes(_mm256_castps_si256(symbol), out + i);
+    }
+    classifyLmhScalar(values + i, count - i, out + i);
+}
+
+__attribute__((target("avx2"))) void indexDigitsAvx2(const float* values, size_t count, uint8_t* out)
+{
+    const __m256 one = _mm256_set1_ps(1.f), ten = _mm256_set1_ps(10.f), zero = _mm256_setzero_ps();
+    const __m256i digitZero = _mm256_set1_epi32('0');
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        // max_ps returns its second operand for NaN, matching std::max(0.f, NaN) == 0
+        __m256 index = _mm256_div_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(values + i), one), zero), ten);
+        __m256i fits = _mm256_castps_si256(_mm256_cmp_ps(index, ten, _CMP_LT_OQ));
+        __m256i digit = _mm256_add_epi32(_mm256_cvttps_epi32(index), digitZero);
+        storeLaneBytes(_mm256_and_si256(digit, fits), out + i);
+    }
+    indexDigitsScalar(values + i, count - i, out + i);
+}
+
+bool cpuHasAvx2()
+{
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    return hasAvx2;
+}
+#endif
+
+// L/M/H code of every value
+void classifyLmh(const float* values, size_t count, uint8_t* out)
+{
+#ifdef WIPS_AVX2_KERNELS
+    if (simdKernelsEnabled && cpuHasAvx2())
+    {
+        classifyLmhAvx2(values, count, out);
+        return;
+    }
+#endif
+    classifyLmhScalar(values, count, out);
+}
+
+// Index digit code of every value (see indexDigitCode)
+void indexDigits(const float* values, size_t count, uint8_t* out)
+{
+#ifdef WIPS_AVX2_KERNELS
+    if (simdKernelsEnabled && cpuHasAvx2())
+    {
+        indexDigitsAvx2(values, count, out);
+        return;
+    }
+#endif
+    indexDigitsScalar(values, count, out);
+}
+
+// Rain probability of every cell from its cloud cover and pressure L/M/H codes, through a 3x3 table
+// built from rainchance (a table lookup per byte, which the compiler vectorizes well enough)
+void rainChances(const uint8_t* cloudLmh, const uint8_t* pressureLmh, size_t count, uint8_t* out)
+{
+    static const std::array<uint8_t, 256> symbolSlot = []() {
+        std::array<uint8_t, 256> slots{};
+        slots['M'] = 1;
+        slots['H'] = 2;
+        return slots;
+    }();
+    static const std::array<uint8_t, 9> chance = []() {
+        const char symbols[] = {'L', 'M', 'H'};
+        std::array<uint8_t, 9> table{};
+        for (int ap = 0; ap < 3; ap++)
+            for (int acc = 0; acc < 3; acc++)
+                table[ap * 3 + acc] = static_cast<uint8_t>(rainchance(symbols[acc], symbols[ap]));
+        return table;
+    }();
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = chance[symbolSlot[pressureLmh[i]] * 3 + symbolSlot[cloudLmh[i]]];
+    }
+}
+
+
+void invalidateClassifiedLayers(RegionContext& region)
+{
+    ClassifiedLayers& layers = region.classifiedLayers;
+    std::lock_guard<std::mutex> guard(layers.lock);
+    for (std::atomic<const uint8_t*>& ready : layers.ready)
+    {
+        ready.store(nullptr, std::memory_order_relaxed);
+    }
+    for (std::vector<uint8_t>* layer : {&layers.cloudLmh, &layers.pressureLmh, &layers.cloudIndex, &layers.pressureIndex, &layers.rainChance})
+    {
+        std::vector<uint8_t>().swap(*layer);
+    }
+    std::lock_guard<std::mutex> pyramidGuard(region.mapPyramid.lock);
+    region.mapPyramid.built.store(false, std::memory_order_relaxed);
+    region.mapPyramid.baseLevel = 0;
+    std::vector<std::vector<PyramidCell>>().swap(region.mapPyramid.levels);
+}
+
+// Compact grid versions: a byte holds the value itself, so each kernel is a 256-entry table
+void classifyLmhBytes(const uint8_t* values, size_t count, uint8_t* out)
+{
+    static const std::array<uint8_t, 256> symbols = []() {
+        std::array<uint8_t, 256> table{};
+        for (int value = 0; value < 256; value++) table[value] = static_cast<uint8_t>(convertToLMHSymbol(static_cast<float>(value)));
+        return table;
+    }();
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = symbols[values[i]];
+    }
+}
+
+void indexDigitsBytes(const uint8_t* values, size_t count, uint8_t* out)
+{
+    static const std::array<uint8_t, 256> digits = []() {
+        std::array<uint8_t, 256> table{};
+        for (int value = 0; value < 256; value++) table[value] = indexDigitCode(static_cast<float>(value));
+        return table;
+    }();
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = digits[values[i]];
+    }
+}
+
+// Run a kernel over a whole layer in parallel slices
+template <typename Value, typename Kernel>
+void classifyLayer(const Value* values, size_t cells, std::vector<uint8_t>& out, Kernel kernel)
+{
+    const size_t sliceCells = 1u << 20;
+    out.resize(cells);
+    parallelFor((out.size() + sliceCells - 1) / sliceCells, [&](size_t slice) {
+        size_t first = slice * sliceCells;
+        kernel(values + first, std::min(sliceCells, out.size() - first), out.data() + first);
+    });
+}
+
+// L/M/H symbols (or index digits) of the cloud cover (layer 1) or pressure (layer 2) layer. The
+// escaped cells of a compact layer went through the table as the escape byte and are redone here.
+void classifyValueLayer(const GridStore& store, int layer, bool lmh, std::vector<uint8_t>& out)
+{
+    if (store.isCompact())
+    {
+        classifyLayer((layer == 1) ? store.compactCloudLayer() : store.compactPressureLayer(), store.cells(), out, lmh ? classifyLmhBytes : indexDigitsBytes);
+        store.forEachWideValue(layer, [&](size_t cell, int value) {
+            out[cell] = lmh ? static_cast<uint8_t>(convertToLMHSymbol(static_cast<float>(value))) : indexDigitCode(static_cast<float>(value));
+        });
+        return;
+    }
+    classifyLayer((layer == 1) ? store.cloudLayer() : store.pressureLayer(), store.cells(), out, lmh ? classifyLmh : indexDigits);
+}
+
+// The layer printMap option 2-6 draws from, or null when the grid is sparse or empty
+const uint8_t* classifiedLayer(int option, RegionContext& region = mainRegion)
+{
+    const GridStore& grid = region.grid;
+    if (grid.empty() || grid.isSparse() || option < 2 || option > 6)
+    {
+        return nullptr;
+    }
+    ClassifiedLayers& layers = region.classifiedLayers;
+    if (const uint8_t* built = layers.ready[option].load(std::memory_order_acquire))
+    {
+        return built;
+    }
+    std::lock_guard<std::mutex> guard(layers.lock);
+    bool needCloudLmh = (option == 3 || option == 6), needPressureLmh = (option == 5 || option == 6);
+    if (needCloudLmh && layers.cloudLmh.empty()) classifyValueLayer(grid, 1, true, layers.cloudLmh);
+    if (needPressureLmh && layers.pressureLmh.empty()) classifyValueLayer(grid, 2, true, layers.pressureLmh);
+    const uint8_t* built;
+    switch (option)
+    {
+        case 2:
+            if (layers.cloudIndex.empty()) classifyValueLayer(grid, 1, false, layers.cloudIndex);
+            built = layers.cloudIndex.data();
+            break;
+        case 3:
+            built = layers.cloudLmh.data();
+            break;
+        case 4:
+            if (layers.pressureIndex.empty()) classifyValueLayer(grid, 2, false, layers.pressureIndex);
+            built = layers.pressureIndex.data();
+            break;
+        case 5:
+            built = layers.pressureLmh.data();
+            break;
+        default:
+            if (layers.rainChance.empty())
+            {
+                layers.rainChance.resize(grid.cells());
+                rainChances(layers.cloudLmh.data(), layers.pressureLmh.data(), grid.cells(), layers.rainChance.data());
+            }
+            built = layers.rainChance.data();
+            break;
+    }
+    layers.ready[option].store(built, std::memory_order_release);
+    return built;
+}
+
+void appendNumber(string& buffer, long long number)
+{
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), number);
+    (void)ec;
+    buffer.append(digits, end);
+}
+
+// Render a map (printMap option 1-5) into out. Every row is formatted into one reusable buffer
+// with the same bytes the per-cell GridCellInfo helpers produce, and the buffer is handed to
+// the stream in large writes.
+void renderMap(ostream& out, int option, const uint8_t* layerCodes, RegionContext& region)
+{
+    const GridStore& grid = region.grid;
+    const size_t flushThreshold = 1u << 20;
+    int x_range = (region.gridXmax - region.gridXmin) + 1;
+    size_t leftCell = region.leftPadding + 1; // Spaces before the cell content
+    size_t rightCell = region.rightPadding + 1; // Spaces after the cell content
+
+    string buffer;
+    buffer.reserve(flushThreshold + static_cast<size_t>(x_range) * (leftCell + rightCell + 12) + 64);
+    auto flushIfFull = [&]() {
+        if (buffer.size() >= flushThreshold)
+        {
+            out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+            buffer.clear();
+        }
+    };
+
+    // Border row of '#' cells (top and bottom)
+    auto appendBorder = [&]() {
+        buffer.append(std::max<size_t>(region.numberOfDigits, 1), ' ');
+        for (int i = 0; i < x_range + 2; i++) {
+            buffer.append(leftCell, ' ');
+            buffer += "# ";
+        }
+        buffer += '\n';
+    };
+
+    appendBorder();
+
+    // Grid content, one contiguous row at a time from the top of the map
+    // Precomputed symbols: a named layer's, or those classified from a dense grid
+    const uint8_t* codes = (option == layerMapOption) ? layerCodes : classifiedLayer(option, region);
+    size_t codeStride = (grid.layout() == GridLayout::RowMajor) ? 1 : static_cast<size_t>(region.gridYmax - region.gridYmin + 1);
+    size_t cellWidth = leftCell + 1 + rightCell;
+    grid.forEachRowTopDown([&](int y, const GridStore::RowView& row) {
+        appendNumber(buffer, y);
+        buffer += " # "; // Row label (y-axis)
+        if (codes != nullptr) {
+            // Every cell is one character wide, so the row is laid out blank and the symbols dropped in
+            const uint8_t* rowCodes = codes + grid.index(0, y);
+            size_t start = buffer.size();
+            buffer.resize(start + static_cast<size_t>(x_range) * cellWidth, ' ');
+            char* cell = &buffer[start + leftCell];
+            bool overflow = false;
+            for (int x = 0; x < x_range; x++, cell += cellWidth) {
+                uint8_t code = rowCodes[x * codeStride];
+                overflow |= (code == 0 && option != 6);
+                *cell = (option == 6) ? static_cast<char>('0' + code / 10) : static_cast<char>(code);
+            }
+            if (!overflow) {
+                buffer += " #\n"; // Right border
+                flushIfFull();
+                return;
+            }
+            buffer.resize(start); // An invalid value needs a wider cell; take the general path
+        }
+        for (int x = 0; x < x_range; x++) {
+            if (option < 1 || option > 6) {
+                break; // Also a named layer without data
+            }
+            buffer.append(leftCell, ' ');
+            switch (option) {
+                case 1: { //"Display City Map"
+                    int cityId = row.cityId(x);
+                    if (cityId >= 0) {
+                        appendNumber(buffer, cityId);
+                    } else {
+                        buffer += ' ';
+                    }
+                    break;
+                }
+                case 2: //"Display Cloud Coverage Map (Cloudiness Index)"
+                case 4: { //"Display atmospheric pressure map (Pressure Index)"
+                    float value = (option == 2) ? row.cloud(x) : row.pressure(x);
+                    int slot = tableSlot(value);
+                    if (slot >= 0) {
+                        buffer += indexDigitTable[slot];
+                    } else {
+                        appendNumber(buffer, static_cast<int>(std::max(0.f, value - 1) / 10.f));
+                    }
+                    break;
+                }
+                case 3: //"Display Cloud Coverage Map (LMH Symbol)"
+                case 5: { //"Display atmospheric pressure map (LMH symbol)"
+                    float value = (option == 3) ? row.cloud(x) : row.pressure(x);
+                    int slot = tableSlot(value);
+                    buffer += (slot >= 0) ? lmhSymbolTable[slot] : convertToLMHSymbol(value);
+                    break;
+                }
+                case 6: { //"Display Probability of Rain Map (Rain Index)"
+                    int chance = rainchance(convertToLMHSymbol(row.cloud(x)), convertToLMHSymbol(row.pressure(x)));
+                    buffer += static_cast<char>('0' + chance / 10);
+                    break;
+                }
+            }
+            buffer.append(rightCell, ' ');
+        }
+        buffer += " #\n"; // Right border
+        flushIfFull();
+    });
+
+    appendBorder();
+
+    // X-axis labels
+    buffer.append(4 * leftCell, ' ');
+    for (int x = 0; x < x_range; x++) {
+        buffer.append(leftCell, ' ');
+        appendNumber(buffer, x);
+        buffer += ' ';
+    }
+    buffer += '\n';
+
+    out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+}
+
+void printMap(int option) {
+    renderMap(cout, option);
+}
+
+// ---- Viewport rendering ----
+
+// Summary of the grid cells in [x0, x1] x [y0, y1]. The block must lie within one sparse tile,
+// which every aligned block of up to tileSize cells does.
+PyramidCell summarizeBlock(const GridStore& grid, int x0, int y0, int x1, int y1)
+{
+    PyramidCell cell;
+    if (!grid.tilePopulated(x0, y0))
+    {
+        return cell;
+    }
+    long long cloudTotal = 0, pressureTotal = 0;
+    cell.cloudMax = cell.pressureMax = std::numeric_limits<float>::lowest();
+    std::vector<std::pair<int, uint32_t>> cityCounts; // A block holds only a few cities
+    grid.forEachInRect(x0, y0, x1, y1, [&](int cityId, float cloud, float pressure) {
+        cloudTotal += static_cast<long long>(cloud);
+        pressureTotal += static_cast<long long>(pressure);
+        cell.cloudMax = std::max(cell.cloudMax, cloud);
+        cell.pressureMax = std::max(cell.pressureMax, pressure);
+        if (cityId < 0)
+        {
+            return;
+        }
+        auto found = std::find_if(cityCounts.begin(), cityCounts.end(), [&](const std::pair<int, uint32_t>& count) { return count.first == cityId; });
+        if (found == cityCounts.end()) cityCounts.push_back({cityId, 1});
+        else found->second++;
+    });
+    float cells = static_cast<float>(static_cast<long long>(x1 - x0 + 1) * (y1 - y0 + 1));
+    cell.cloudMean = static_cast<float>(cloudTotal) / cells;
+    cell.pressureMean = static_cast<float>(pressureTotal) / cells;
+    for (const auto& count : cityCounts)
+    {
+        if (count.second > cell.cityCells || (count.second == cell.cityCells && count.first < cell.cityId))
+        {
+            cell.cityId = count.first;
+            cell.cityCells = count.second;
+        }
+    }
+    return cell;
+}
+
+// Size of pyramid level L along an axis of length extent
+inline int pyramidExtent(int extent, int level)
+{
+    return static_cast<int>((static_cast<long long>(extent) + (1LL << level) - 1) >> level);
+}
+
+// Build the pyramid if needed. Blocks up to tileSize cells across are summarized exactly from the
+// grid; a sparse grid stores only the tile level of those, where a missing tile costs nothing, and
+// summarizes its finer levels while drawing. Above the tile level the means are weighted by the
+// cells each child covers and the city of a block is the child city with the most cells (the
+// children's majorities, so an approximation). Every backend therefore draws the same symbols.
+const MapPyramid& ensureMapPyramid(RegionContext& region = mainRegion)
+{
+    const GridStore& grid = region.grid;
+    MapPyramid& mapPyramid = region.mapPyramid;
+    if (mapPyramid.built.load(std::memory_order_acquire))
+    {
+        return mapPyramid;
+    }
+    std::lock_guard<std::mutex> guard(mapPyramid.lock);
+    if (mapPyramid.baseLevel > 0 || grid.empty())
+    {
+        return mapPyramid;
+    }
+
+    int width = grid.width(), height = grid.height();
+    const int tileLevel = __builtin_ctz(GridStore::tileSize);
+    int topLevel = 1;
+    while (pyramidExtent(width, topLevel) > 1 || pyramidExtent(height, topLevel) > 1)
+    {
+        topLevel++;
+    }
+    int baseLevel = grid.isSparse() ? std::min(tileLevel, topLevel) : 1;
+
+    std::vector<std::vector<PyramidCell>> levels(topLevel - baseLevel + 1);
+    for (int level = baseLevel; level <= std::min(tileLevel, topLevel); level++)
+    {
+        std::vector<PyramidCell>& cells = levels[level - baseLevel];
+        int levelWidth = pyramidExtent(width, level), levelHeight = pyramidExtent(height, level);
+        cells.resize(static_cast<size_t>(levelWidth) * levelHeight);
+        parallelFor(static_cast<size_t>(levelHeight), [&](size_t by) {
+            int y0 = static_cast<int>(by) << level, y1 = std::min(height, y0 + (1 << level)) - 1;
+            for (int bx = 0; bx < levelWidth; bx++)
+            {
+                int x0 = bx << level, x1 = std::min(width, x0 + (1 << level)) - 1;
+                cells[by * levelWidth + bx] = summarizeBlock(grid, x0, y0, x1, y1);
+            }
+        });
+    }
+
+    for (int level = tileLevel + 1; level <= topLevel; level++)
+    {
+        const std::vector<PyramidCell>& below = levels[level - 1 - baseLevel];
+        std::vector<PyramidCell>& cells = levels[level - baseLevel];
+        int belowWidth = pyramidExtent(width, level - 1), belowHeight = pyramidExtent(height, level - 1);
+        int levelWidth = pyramidExtent(width, level), levelHeight = pyramidExtent(height, level);
+        cells.resize(static_cast<size_t>(levelWidth) * levelHeight);
+        parallelFor(static_cast<size_t>(levelHeight), [&](size_t by) {
+            for (int bx = 0; bx < levelWidth; bx++)
+            {
+                PyramidCell& cell = cells[by * levelWidth + bx];
+                double weight = 0, cloudTotal = 0, pressureTotal = 0;
+                cell.cloudMax = cell.pressureMax = std::numeric_limits<float>::lowest();
+                std::pair<int, uint32_t> cityCounts[4];
+                int cities = 0;
+                for (int cy = static_cast<int>(by) * 2; cy < std::min(belowHeight, static_cast<int>(by) * 2 + 2); cy++)
+                {
+                    for (int cx = bx * 2; cx < std::min(belowWidth, bx * 2 + 2); cx++)
+                    {
+                        const PyramidCell& child = below[static_cast<size_t>(cy) * belowWidth + cx];
+                        // Cells the child covers: full blocks except along the right and top edges
+                        double childCells = static_cast<double>(std::min(1 << (level - 1), width - (cx << (level - 1)))) *
+                                            std::min(1 << (level - 1), height - (cy << (level - 1)));
+                        weight += childCells;
+                        cloudTotal += child.cloudMean * childCells;
+                        pressureTotal += child.pressureMean * childCells;
+                        cell.cloudMax = std::max(cell.cloudMax, child.cloudMax);
+                        cell.pressureMax = std::max(cell.pressureMax, child.pressureMax);
+                        if (child.cityId < 0)
+                        {
+                            continue;
+                        }
+                        int c = 0;
+                        while (c < cities && cityCounts[c].first != child.cityId) c++;
+                        if (c == cities) cityCounts[cities++] = {child.cityId, 0};
+                        cityCounts[c].second += child.cityCells;
+                    }
+                }
+                cell.cloudMean = static_cast<float>(cloudTotal / weight);
+                cell.pressureMean = static_cast<float>(pressureTotal / weight);
+                for (int c = 0; c < cities; c++)
+                {
+                    if (cityCounts[c].second > cell.cityCells || (cityCounts[c].second == cell.cityCells && cityCounts[c].first < cell.cityId))
+                    {
+                        cell.cityId = cityCounts[c].first;
+                        cell.cityCells = cityCounts[c].second;
+                    }
+                }
+            }
+        });
+    }
+
+    mapPyramid.levels = std::move(levels);
+    mapPyramid.baseLevel = baseLevel;
+    mapPyramid.built.store(true, std::memory_order_release);
+    return mapPyramid;
+}
+
+// A rectangle of the map to draw and how far to zoom out
+struct MapViewport
+{
+    int x0 = INT_MIN, y0 = INT_MIN, x1 = INT_MAX, y1 = INT_MAX; // Inclusive, grid coordinates; clipped to the grid
+    int zoomLevel = -1; // One symbol per 2^zoomLevel x 2^zoomLevel cells; -1 fits the view into maxSymbols
+    int maxSymbols = 100; // Columns and rows the automatic zoom stays within
+    bool useMax = false; // Value maps show each block's maximum instead of its mean
+};
+
+// Draw part of a map (printMap option 1-6) from the pyramid level its zoom selects, so the cost
+// follows the symbols on screen rather than the grid. Unlike printMap, rows and columns are labelled
+// with real grid coordinates (the lower left cell of each block) and the cell width fits the widest
+// label or symbol. Returns false when the viewport misses the grid.
+bool renderViewport(ostream& out, int option, const MapViewport& view, RegionContext& region = mainRegion)
+{
+    const GridStore& grid = region.grid;
+    int gridXmin = region.gridXmin, gridXmax = region.gridXmax, gridYmin = region.gridYmin, gridYmax = region.gridYmax;
+    if (grid.empty() || option < 1 || option > 6)
+    {
+        return false;
+    }
+    int x0 = std::max(view.x0, gridXmin) - gridXmin, x1 = std::min(view.x1, gridXmax) - gridXmin;
+    int y0 = std::max(view.y0, gridYmin) - gridYmin, y1 = std::min(view.y1, gridYmax) - gridYmin;
+    if (x0 > x1 || y0 > y1)
+    {
+        return false;
+    }
+
+    const MapPyramid& pyramid = ensureMapPyramid(region);
+    int topLevel = pyramid.baseLevel + static_cast<int>(pyramid.levels.size()) - 1;
+    int level = std::min(view.zoomLevel, topLevel);
+    if (view.zoomLevel < 0)
+    {
+        level = 0;
+        while (level < topLevel && (((x1 >> level) - (x0 >> level) + 1) > view.maxSymbols || ((y1 >> level) - (y0 >> level) + 1) > view.maxSymbols))
+        {
+            level++;
+        }
+    }
+    int bx0 = x0 >> level, bx1 = x1 >> level, by0 = y0 >> level, by1 = y1 >> level;
+    int levelWidth = pyramidExtent(grid.width(), level);
+    const PyramidCell& whole = pyramid.levels.back()[0];
+
+    // Symbol of a block, and the widest symbol any block can have
+    auto symbolOf = [&](const PyramidCell& cell, string& symbol) {
+        float cloud = view.useMax ? cell.cloudMax : cell.cloudMean;
+        float pressure = view.useMax ? cell.pressureMax : cell.pressureMean;
+        symbol.clear();
+        switch (option)
+        {
+            case 1: if (cell.cityId >= 0) appendNumber(symbol, cell.cityId); else symbol = " "; break;
+            case 2: appendNumber(symbol, static_cast<int>(std::max(0.f, cloud - 1) / 10.f)); break;
+            case 4: appendNumber(symbol, static_cast<int>(std::max(0.f, pressure - 1) / 10.f)); break;
+            case 3: symbol = convertToLMHSymbol(cloud); break;
+            case 5: symbol = convertToLMHSymbol(pressure); break;
+            default: symbol = static_cast<char>('0' + rainchance(convertToLMHSymbol(cloud), convertToLMHSymbol(pressure)) / 10); break;
+        }
+    };
+    size_t symbolWidth = 1;
+    if (option == 1 && !region.cityDataMap.empty())
+    {
+        symbolWidth = std::max(to_string(region.cityDataMap.begin()->first).size(), to_string(region.cityDataMap.rbegin()->first).size());
+    }
+    else if (option == 2 || option == 4)
+    {
+        symbolWidth = to_string(static_cast<int>(std::max(0.f, ((option == 2) ? whole.cloudMax : whole.pressureMax) - 1) / 10.f)).size();
+    }
+    size_t cellWidth = std::max({symbolWidth, to_string(gridXmin + (bx0 << level)).size(), to_string(gridXmin + (bx1 << level)).size()});
+    size_t labelWidth = std::max(to_string(gridYmin + (by0 << level)).size(), to_string(gridYmin + (by1 << level)).size());
+
+    string buffer;
+    auto appendCentered = [&](const string& text) {
+        size_t left = (cellWidth - std::min(cellWidth, text.size())) / 2;
+        buffer += ' ';
+        buffer.append(left, ' ');
+        buffer += text;
+        buffer.append(cellWidth - std::min(cellWidth, text.size()) - left + 1, ' ');
+    };
+    auto appendBorder = [&]() {
+        buffer.append(labelWidth + 1, ' ');
+        buffer.append(static_cast<size_t>(bx1 - bx0 + 1) * (cellWidth + 2) + 2, '#');
+        buffer += '\n';
+    };
+
+    buffer += "Viewport x " + to_string(gridXmin + x0) + "-" + to_string(gridXmin + x1) + ", y " + to_string(gridYmin + y0) + "-" +
+              to_string(gridYmin + y1) + ", one symbol per " + to_string(1 << level) + "x" + to_string(1 << level) + " cells" +
+              ((level > 0 && option != 1) ? (view.useMax ? " (max)" : " (mean)") : "") + '\n';
+    appendBorder();
+    string symbol;
+    for (int by = by1; by >= by0; by--)
+    {
+        string label = to_string(gridYmin + (by << level));
+        buffer.append(labelWidth - label.size(), ' ');
+        buffer += label;
+        buffer += " #";
+        GridStore::RowView row = grid.row(by); // Only read at level 0
+        for (int bx = bx0; bx <= bx1; bx++)
+        {
+            PyramidCell cell;
+            if (level == 0)
+            {
+                cell.cityId = row.cityId(bx);
+                cell.cloudMean = cell.cloudMax = row.cloud(bx);
+                cell.pressureMean = cell.pressureMax = row.pressure(bx);
+            }
+            else if (level < pyramid.baseLevel)
+            {
+                int cellX = bx << level, cellY = by << level; // Finer than a sparse grid's stored levels
+                cell = summarizeBlock(grid, cellX, cellY, std::min(grid.width(), cellX + (1 << level)) - 1, std::min(grid.height(), cellY + (1 << level)) - 1);
+            }
+            else
+            {
+                cell = pyramid.levels[level - pyramid.baseLevel][static_cast<size_t>(by) * levelWidth + bx];
+            }
+            symbolOf(cell, symbol);
+            appendCentered(symbol);
+        }
+        buffer += "#\n";
+        if (buffer.size() >= (1u << 20))
+        {
+            out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+            buffer.clear();
+        }
+    }
+    appendBorder();
+    buffer.append(labelWidth + 2, ' ');
+    for (int bx = bx0; bx <= bx1; bx++)
+    {
+        appendCentered(to_string(gridXmin + (bx << level)));
+    }
+    buffer += '\n';
+    out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+    return true;
+}
+
+// ---- Image export ----
+// Binary PGM (one gray byte per cell) and PPM (three color bytes) images of the grid layers, top
+// row first like printMap. Rows are converted a band at a time into one fixed-size buffer per image
+// and written out, so no image is ever held whole and every requested image comes from a single
+// pass over the grid.
+
+enum class ImageLayer { Cloud, Pressure, CloudLmh, PressureLmh, Rain, City };
+
+struct ImageExport
+{
+    ImageLayer layer;
+    string filename;
+};
+
+const struct
+{
+    const char* name;
+    ImageLayer layer;
+} imageLayerNames[] = {
+    {"cloud", ImageLayer::Cloud},
+    {"pressure", ImageLayer::Pressure},
+    {"cloud-lmh", ImageLayer::CloudLmh},
+    {"pressure-lmh", ImageLayer::PressureLmh},
+    {"rain", ImageLayer::Rain},
+    {"city", ImageLayer::City},
+};
+
+// "layer=file", e.g. "cloud=cloud.pgm"
+bool parseImageExport(const string& spec, ImageExport& image)
+{
+    size_t equal = spec.find('=');
+    if (equal == string::npos || equal + 1 == spec.size())
+    {
+        return false;
+    }
+    for (const auto& entry : imageLayerNames)
+    {
+        if (spec.compare(0, equal, entry.name) == 0 && equal == strlen(entry.name))
+        {
+            image.layer = entry.layer;
+            image.filename = spec.substr(equal + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Value layers and rain chances are 0-100 scaled to 0-255; anything outside clamps to black or white
+inline uint8_t grayLevel(float value)
+{
+    static const std::array<uint8_t, 101> levels = []() {
+        std::array<uint8_t, 101> table{};
+        for (int value = 0; value <= 100; value++) table[value] = static_cast<uint8_t>((value * 255 + 50) / 100);
+        return table;
+    }();
+    int slot = tableSlot(value);
+    if (slot >= 0) return levels[slot];
+    return (value > 100.f) ? 255 : (value > 0.f) ? levels[static_cast<int>(value)] : 0;
+}
+
+// L, M and H as green, yellow and red
+inline const uint8_t* lmhColor(char symbol)
+{
+    static const uint8_t colors[3][3] = {{40, 170, 60}, {235, 200, 40}, {215, 45, 35}};
+    return colors[(symbol == 'L') ? 0 : (symbol == 'M') ? 1 : 2];
+}
+
+// A fixed hash of the city ID to a fairly bright color, so a city keeps its color between runs;
+// cells outside cities stay black
+inline void cityColor(int cityId, uint8_t* pixel)
+{
+    if (cityId < 0)
+    {
+        pixel[0] = pixel[1] = pixel[2] = 0;
+        return;
+    }
+    uint32_t hash = static_cast<uint32_t>(cityId) * 2654435761u;
+    pixel[0] = static_cast<uint8_t>(64 + (hash >> 24) % 192);
+    pixel[1] = static_cast<uint8_t>(64 + ((hash >> 16) & 0xFF) % 192);
+    pixel[2] = static_cast<uint8_t>(64 + ((hash >> 8) & 0xFF) % 192);
+}
+
+bool isColorImage(ImageLayer layer)
+{
+    return layer == ImageLayer::CloudLmh || layer == ImageLayer::PressureLmh || layer == ImageLayer::City;
+}
+
+// Pixels of one map row of an image
+void convertImageRow(ImageLayer layer, const GridStore::RowView& row, int width, uint8_t* out)
+{
+    switch (layer)
+    {
+        case ImageLayer::Cloud:
+            for (int x = 0; x < width; x++) out[x] = grayLevel(row.cloud(x));
+            break;
+        case ImageLayer::Pressure:
+            for (int x = 0; x < width; x++) out[x] = grayLevel(row.pressure(x));
+            break;
+        case ImageLayer::Rain:
+            for (int x = 0; x < width; x++) out[x] = grayLevel(static_cast<float>(rainchance(convertToLMHSymbol(row.cloud(x)), convertToLMHSymbol(row.pressure(x)))));
+            break;
+        case ImageLayer::CloudLmh:
+        case ImageLayer::PressureLmh:
+            for (int x = 0; x < width; x++, out += 3)
+            {
+                memcpy(out, lmhColor(convertToLMHSymbol((layer == ImageLayer::CloudLmh) ? row.cloud(x) : row.pressure(x))), 3);
+            }
+            break;
+        case ImageLayer::City:
+            for (int x = 0; x < width; x++, out += 3) cityColor(row.cityId(x), out);
+            break;
+    }
+}
+
+// Write every requested image in one top-down pass over the grid. A band of rows is converted in
+// parallel into each image's buffer (about imageBufferBytes, at least one row) and then appended to
+// the files, so memory stays fixed whatever the grid size.
+bool exportImages(const std::vector<ImageExport>& images, ostream& log, const RegionContext& region = mainRegion)
+{
+    const size_t imageBufferBytes = 4u << 20;
+    const GridStore& grid = region.grid;
+    if (grid.empty() || images.empty())
+    {
+        return images.empty();
+    }
+    auto startTime = std::chrono::steady_clock::now();
+    int width = grid.width(), height = grid.height();
+
+    std::vector<std::unique_ptr<ofstream>> files;
+    for (const ImageExport& image : images)
+    {
+        files.emplace_back(new ofstream(image.filename, ios::binary));
+        *files.back() << (isColorImage(image.layer) ? "P6" : "P5") << '\n' << width << ' ' << height << "\n255\n";
+        if (!*files.back())
+        {
+            cerr << "Error: Unable to write image " << image.filename << '\n';
+            return false;
+        }
+    }
+
+    size_t bandRows = std::max<size_t>(1, imageBufferBytes / (static_cast<size_t>(width) * 3));
+    std::vector<std::vector<uint8_t>> buffers(images.size());
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        buffers[i].resize(std::min(bandRows, static_cast<size_t>(height)) * width * (isColorImage(images[i].layer) ? 3 : 1));
+    }
+
+    for (size_t bandStart = 0; bandStart < static_cast<size_t>(height); bandStart += bandRows)
+    {
+        size_t rows = std::min(bandRows, static_cast<size_t>(height) - bandStart);
+        parallelFor(rows, [&](size_t r) {
+            GridStore::RowView row = grid.row(height - 1 - static_cast<int>(bandStart + r));
+            for (size_t i = 0; i < images.size(); i++)
+            {
+                size_t rowBytes = static_cast<size_t>(width) * (isColorImage(images[i].layer) ? 3 : 1);
+                convertImageRow(images[i].layer, row, width, buffers[i].data() + r * rowBytes);
+            }
+        });
+        for (size_t i = 0; i < images.size(); i++)
+        {
+            size_t rowBytes = static_cast<size_t>(width) * (isColorImage(images[i].layer) ? 3 : 1);
+            files[i]->write(reinterpret_cast<const char*>(buffers[i].data()), static_cast<streamsize>(rows * rowBytes));
+        }
+    }
+
+    // The images are written together, so only the whole pass has a rate
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    size_t totalBytes = 0;
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        files[i]->close();
+        if (!*files[i])
+        {
+            cerr << "Error: Unable to write image " << images[i].filename << '\n';
+            return false;
+        }
+        size_t bytes = static_cast<size_t>(width) * height * (isColorImage(images[i].layer) ? 3 : 1);
+        totalBytes += bytes;
+        reportThroughput(log, images[i].filename, bytes, (images.size() == 1) ? elapsed.count() : -1.0, "Writing");
+    }
+    if (images.size() > 1)
+    {
+        reportThroughput(log, std::to_string(images.size()) + " images", totalBytes, elapsed.count(), "Writing");
+    }
+    return true;
+}
+
+// A further data layer named in the config, e.g. humidity. Each one has its own valid range and
+// LMH thresholds; values outside the range are reported and not stored.
+struct LayerSpec
+{
+    string name;
+    string filePath;
+    int minValue = 0;
+    int maxValue = 100;
+    int lowBelow = 35; // Values below this are L
+    int highFrom = 65; // Values from this on are H
+};
+
+// Data files named by a configuration file, in the order they are listed
+struct ConfigFile
+{
+    string citylocFilePath, cloudcoverageFilePath, pressureFilePath;
+    bool citylocFound = false, cloudcoverFound = false, pressureFound = false;
+    std::vector<string> laterStepFiles; // Cloud cover, pressure, cloud cover, ... for timesteps 1, 2, ...; empty where none is named
+    std::vector<LayerSpec> layers; // Named layers beyond city, cloud and pressure
+};
+
+// Parse "<min>-<max>" where either number may be negative, e.g. "-40-50"
+bool parseValueRange(const string& text, int& low, int& high)
+{
+    size_t dashPosition = text.find('-', 1);
+    return dashPosition != string::npos && parseIntField(std::string_view(text).substr(0, dashPosition), low) &&
+           parseIntField(std::string_view(text).substr(dashPosition + 1), high) && low <= high;
+}
+
+// A "Layer_<name>=<file>", "Layer_<name>_Range=<min>-<max>" or "Layer_<name>_LMH=<low>-<high>" line.
+// The names city, cloud and pressure assign the core files, which otherwise come from the first
+// three .txt lines in order; any other name adds a layer.
+void parseLayerLine(const string& line, ConfigFile& config)
+{
+    size_t equalPosition = line.find('=');
+    if (equalPosition == string::npos) {
+        return;
+    }
+    string key = line.substr(6, equalPosition - 6); // After "Layer_"
+    string value = line.substr(equalPosition + 1);
+    if (!value.empty() && value.back() == '\r') {
+        value.pop_back();
+    }
+
+    string attribute;
+    for (const char* suffix : {"_Range", "_LMH"}) {
+        size_t suffixLength = strlen(suffix);
+        if (key.size() > suffixLength && key.compare(key.size() - suffixLength, suffixLength, suffix) == 0) {
+            attribute = suffix;
+            key.resize(key.size() - suffixLength);
+        }
+    }
+    if (key.empty()) {
+        return;
+    }
+
+    if (attribute.empty() && key == "city") {
+        config.citylocFilePath = value;
+        config.citylocFound = true;
+        return;
+    }
+    if (attribute.empty() && key == "cloud") {
+        config.cloudcoverageFilePath = value;
+        config.cloudcoverFound = true;
+        return;
+    }
+    if (attribute.empty() && key == "pressure") {
+        config.pressureFilePath = value;
+        config.pressureFound = true;
+        return;
+    }
+    if (key == "city" || key == "cloud" || key == "pressure") {
+        cerr << "Error: The range and thresholds of the " << key << " layer are fixed.\n";
+        return;
+    }
+
+    auto spec = std::find_if(config.layers.begin(), config.layers.end(), [&](const LayerSpec& layer) { return layer.name == key; });
+    if (spec == config.layers.end()) {
+        config.layers.push_back(LayerSpec());
+        spec = config.layers.end() - 1;
+        spec->name = key;
+    }
+    if (attribute.empty()) {
+        spec->filePath = value;
+    } else if (attribute == "_Range") {
+        int low, high;
+        if (!parseValueRange(value, low, high) || low < INT16_MIN || high > INT16_MAX) {
+            cerr << "Error: Invalid range for layer " << key << " (expected <min>-<max> within " << INT16_MIN << " to " << INT16_MAX << ").\n";
+            return;
+        }
+        spec->minValue = low;
+        spec->maxValue = high;
+    } else if (!parseValueRange(value, spec->lowBelow, spec->highFrom)) {
+        cerr << "Error: Invalid LMH thresholds for layer " << key << " (expected <low>-<high>).\n";
+    }
+}
+
+// Name the file of a later timestep: slot 2 * (step - 1) holds its cloud cover, the next one its pressure
+void setLaterStepFile(ConfigFile& config, size_t slot, const string& filePath)
+{
+    if (config.laterStepFiles.size() <= slot) {
+        config.laterStepFiles.resize(slot + 1);
+    }
+    config.laterStepFiles[slot] = filePath;
+}
+
+// A "Cloud_<n>=<file>" or "Pressure_<n>=<file>" line naming the files of timestep n (1 is the
+// first after the core files). False if the line is not one, so it is read as a file name.
+bool parseTimestepLine(const string& line, ConfigFile& config)
+{
+    size_t equalPosition = line.find('=');
+    size_t underscorePosition = line.find('_');
+    if (equalPosition == string::npos || underscorePosition > equalPosition) {
+        return false;
+    }
+    string kind = line.substr(0, underscorePosition);
+    if (kind != "Cloud" && kind != "Pressure") {
+        return false;
+    }
+    std::string_view stepText = std::string_view(line).substr(underscorePosition + 1, equalPosition - underscorePosition - 1);
+    int step = 0;
+    auto [end, ec] = std::from_chars(stepText.data(), stepText.data() + stepText.size(), step);
+    string value = line.substr(equalPosition + 1);
+    if (!value.empty() && value.back() == '\r') {
+        value.pop_back();
+    }
+    if (ec != std::errc() || end != stepText.data() + stepText.size() || step < 1) {
+        cerr << "Error: Invalid timestep in " << line.substr(0, equalPosition) << " (expected " << kind << "_<n> with n from 1).\n";
+        return true;
+    }
+    setLaterStepFile(config, static_cast<size_t>(step - 1) * 2 + (kind == "Pressure" ? 1 : 0), value);
+    return true;
+}
+
+// Read a configuration file: sets the grid ranges and collects the data file names
+bool parseConfigFile(const string& fileName, ConfigFile& config, RegionContext& region = mainRegion)
+{
+    ifstream inFile(fileName); // Read file based on input
+
+    // Check if file cannot be opened
+    if (!inFile.is_open()) {
+        return false;
+    }
+
+    string line;
+
+    // Read the file line by line
+    while (getline(inFile, line)) {
+        if (line.compare(0, 2, "//") == 0) {
+            continue; // Comments may mention "txt" without naming a data file
+        }
+        if (line.compare(0, 6, "Layer_") == 0) {
+            parseLayerLine(line, config); // Named layers are not taken by the .txt rule below
+            continue;
+        }
+        if (parseTimestepLine(line, config)) {
+            continue;
+        }
+
+        // Parse grid ranges
+        size_t gridPosition = line.find("Grid");
+        if (gridPosition == 0) {
+            size_t equalPosition = line.find('=');
+            if (equalPosition != string::npos) {
+                string beforeEqual = line.substr(0, equalPosition);
+                string afterEqual = line.substr(equalPosition + 1);
+
+                size_t dashPosition = afterEqual.find('-');
+                if (dashPosition != string::npos) {
+                    string beforeDash = afterEqual.substr(0, dashPosition);
+                    string afterDash = afterEqual.substr(dashPosition + 1);
+
+                    // Convert string to int to determine range
+                    int min = stoi(beforeDash);
+                    int max = stoi(afterDash);
+
+                    // Setting grid range for x and y
+                    if (beforeEqual == "GridX_IdxRange") {
+                        region.gridXmin = min;
+                        region.gridXmax = max;
+                    } else if (beforeEqual == "GridY_IdxRange") {
+                        region.gridYmin = min;
+                        region.gridYmax = max;
+                    }
+                }
+            }
+        }
+
+        // Check if the line contains "txt" (or names a compressed file)
+        if (line.find("txt") != string::npos || compressionOf(line) != Compression::None) {
+            if (!config.citylocFound) {
+                config.citylocFilePath = line;
+                config.citylocFound = true;
+            } else if (!config.cloudcoverFound) {
+                config.cloudcoverageFilePath = line;
+                config.cloudcoverFound = true;
+            } else if (!config.pressureFound) {
+                config.pressureFilePath = line;
+                config.pressureFound = true;
+            } else if (line.find_first_of(" \t") == string::npos) {
+                // Further forecast timesteps, one file name per line, fill the slots no key named
+                auto slot = std::find(config.laterStepFiles.begin(), config.laterStepFiles.end(), string());
+                setLaterStepFile(config, static_cast<size_t>(slot - config.laterStepFiles.begin()), line);
+            }
+        }
+    }
+
+    return true;
+}
+
+// The data files to load for a configuration, reporting the ones it does not name
+std::vector<IngestRequest> dataFileRequests(const ConfigFile& config, ostream& log)
+{
+    std::vector<IngestRequest> requests;
+    if (!config.citylocFound) {
+        log << "City Location File Not Found" << '\n';
+    } else {
+        requests.push_back({config.citylocFilePath, CityFile});
+    }
+
+    if (!config.cloudcoverFound) {
+        log << "Cloud Cover File Not Found" << '\n';
+    } else {
+        requests.push_back({config.cloudcoverageFilePath, CloudFile});
+    }
+
+    if (!config.pressureFound) {
+        log << "Pressure File Not Found" << '\n';
+    } else {
+        requests.push_back({config.pressureFilePath, PressureFile});
+    }
+    return requests;
+}
+
+// Lines of a data file for chooseGridBackend, false if it cannot be read. Files are sampled
+// rather than read in full: a plain file's line length is measured on a few slices spread over
+// it and scaled to its size; a compressed file's on its first megabyte, scaled to the size it
+// declares. Only a file that declares no size (a zstd stream written through a pipe) is
+// decompressed just to count.
+bool countDataLines(const string& filename, size_t& lines)
+{
+    if (compressionOf(filename) == Compression::None)
+    {
+        const size_t sliceBytes = 256 * 1024;
+        const int sliceCount = 4;
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat fileInfo;
+        if (fd < 0 || fstat(fd, &fileInfo) != 0)
+        {
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        size_t size = static_cast<size_t>(fileInfo.st_size);
+        std::vector<char> slice(sliceBytes);
+        size_t sampledBytes = 0, sampledLines = 0;
+        for (int s = 0; s < sliceCount && sampledBytes < size; s++)
+        {
+            // Small files are read whole in the first slices; larger ones at evenly spaced offsets
+            off_t offset = (size <= sliceBytes * sliceCount) ? static_cast<off_t>(sampledBytes)
+                                                             : static_cast<off_t>((size - sliceBytes) / (sliceCount - 1) * s);
+            ssize_t length = pread(fd, slice.data(), slice.size(), offset);
+            if (length <= 0)
+            {
+                break;
+            }
+            sampledBytes += static_cast<size_t>(length);
+            sampledLines += static_cast<size_t>(std::count(slice.begin(), slice.begin() + length, '\n'));
+        }
+        ::close(fd);
+        lines = (sampledBytes >= size) ? sampledLines + 1 : static_cast<size_t>(static_cast<double>(size) * sampledLines / static_cast<double>(sampledBytes)) + 1;
+        return true;
+    }
+
+    CompressedReader reader;
+    if (!reader.open(filename))
+    {
+        return false;
+    }
+    std::vector<char> sample(1u << 20);
+    ssize_t length = reader.read(sample.data(), sample.size());
+    size_t sampleLines = (length > 0) ? static_cast<size_t>(std::count(sample.begin(), sample.begin() + length, '\n')) : 0;
+    if (length > 0 && static_cast<size_t>(length) < sample.size())
+    {
+        lines = sampleLines + 1; // The whole file fitted in the sample
+    }
+    else if (reader.declaredSize() > 0 && sampleLines > 0)
+    {
+        lines = static_cast<size_t>(static_cast<double>(reader.declaredSize()) * sampleLines / static_cast<double>(length)) + 1;
+    }
+    else
+    {
+        lines = sampleLines + 1;
+        while ((length = reader.read(sample.data(), sample.size())) > 0)
+        {
+            lines += static_cast<size_t>(std::count(sample.begin(), sample.begin() + length, '\n'));
+        }
+    }
+    return true;
+}
+
+// Decide between dense and sparse grid storage. Every data line writes at most one cell, so the
+// (estimated) line counts bound how much of the grid can be populated: the city cells plus the larger of the
+// two value layers (cloud and pressure usually cover the same cells).
+GridBackend chooseGridBackend(const std::vector<IngestRequest>& requests, size_t cellCount, ostream& log)
+{
+    if (gridBackend != GridBackend::Auto)
+    {
+        return gridBackend;
+    }
+
+    size_t cityLines = 0, valueLines = 0;
+    for (const IngestRequest& request : requests)
+    {
+        size_t lines;
+        if (!countDataLines(request.filename, lines))
+        {
+            continue;
+        }
+        if (request.fileDataType == 0) cityLines += lines;
+        else valueLines = std::max(valueLines, lines);
+    }
+
+    double fillRatio = (cellCount > 0) ? static_cast<double>(cityLines + valueLines) / static_cast<double>(cellCount) : 1.0;
+    if (fillRatio >= sparseFillThreshold)
+    {
+        return GridBackend::Dense;
+    }
+    ios::fmtflags savedFlags = log.flags();
+    streamsize savedPrecision = log.precision();
+    log << "Grid storage: sparse tiles (at most " << fixed << setprecision(1) << fillRatio * 100.0 << "% of cells populated)\n";
+    log.flags(savedFlags);
+    log.precision(savedPrecision);
+    return GridBackend::Sparse;
+}
+
+// Print padding and grid allocation for the ranges parseConfigFile just set
+void setupGrid(const std::vector<IngestRequest>& requests, ostream& log, RegionContext& region)
+{
+    // Calculate padding and other setup
+    region.numberOfDigits = countNumberOfDigits(region.gridXmax); // Calculate number of digits for city ID
+    int totalPadding = region.numberOfDigits - 1;
+    region.leftPadding = totalPadding / 2;
+    region.rightPadding = totalPadding - region.leftPadding;
+
+    int rowSize = (region.gridXmax - region.gridXmin) + 1;
+    int colSize = (region.gridYmax - region.gridYmin) + 1;
+
+    // Allocate memory for the grid
+    allocateMemory(colSize, rowSize, chooseGridBackend(requests, static_cast<size_t>(rowSize) * static_cast<size_t>(colSize), log), region);
+}
+
+// Load timesteps 1.. of a multi-timestep config into forecastCube and compute every city's
+// series. Timestep 0 is copied from the grid option 1 just loaded. The later files are parsed
+// concurrently, one task per file, each file in line order so the last line for a cell wins.
+// City lines in these files are ignored: all timesteps share the layout of the city file.
+bool loadForecastSteps(const ConfigFile& config, ostream& log, const RegionContext& region = mainRegion)
+{
+    const GridStore& grid = region.grid;
+    size_t laterSteps = (config.laterStepFiles.size() + 1) / 2;
+    forecastCube.allocate(grid.width(), grid.height(), laterSteps + 1);
+    int width = grid.width();
+
+    // Timestep 0 from the grid
+    for (int y = 0; y < grid.height(); y++)
+    {
+        GridStore::RowView row = grid.row(y);
+        uint8_t* cloud = forecastCube.layer(0, 0) + static_cast<size_t>(y) * width;
+        uint8_t* pressure = forecastCube.layer(0, 1) + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; x++)
+        {
+            cloud[x] = ForecastCube::compact(static_cast<int>(row.cloud(x)));
+            pressure[x] = ForecastCube::compact(static_cast<int>(row.pressure(x)));
+        }
+    }
+
+    size_t fileCount = laterSteps * 2;
+    std::vector<string> diagnostics(fileCount);
+    std::vector<bool> opened(fileCount, false);
+    std::vector<string> readErrors(fileCount);
+    parallelFor(fileCount, [&](size_t f) {
+        if (f >= config.laterStepFiles.size() || config.laterStepFiles[f].empty())
+        {
+            return; // Not named, reported below
+        }
+        uint8_t* layer = forecastCube.layer(1 + f / 2, static_cast<int>(f % 2));
+        opened[f] = forEachInputLine(config.laterStepFiles[f], readErrors[f], [&](std::string_view line) {
+            ParsedLine parsed = parseDataLine(line, region);
+            appendDiagnostics(parsed, diagnostics[f]);
+            if (parsed.kind == ParsedLine::Value)
+            {
+                layer[static_cast<size_t>(parsed.yPos) * width + parsed.xPos] = ForecastCube::compact(parsed.value);
+            }
+        });
+    });
+
+    bool complete = true;
+    for (size_t f = 0; f < fileCount; f++)
+    {
+        cerr << diagnostics[f] << readErrors[f]; // A corrupt file counts as missing
+        if (f >= config.laterStepFiles.size() || config.laterStepFiles[f].empty())
+        {
+            complete = false; // The layer reads as 0, like a file that cannot be opened
+            log << "Timestep " << 1 + f / 2 << (f % 2 == 0 ? " Cloud" : " Pressure") << " File Not Found" << '\n';
+        }
+        else if (!opened[f])
+        {
+            complete = false;
+            log << "Unable to open " << (f % 2 == 0 ? "cloud" : "pressure") << " file for timestep " << 1 + f / 2 << '\n';
+        }
+    }
+    cerr << flush;
+
+    // Per-city series: step 0 is the grid average already computed, later steps are summed from the cube
+    size_t steps = forecastCube.timesteps();
+    std::vector<const CityData*> cities;
+    for (const auto& cityData : region.cityDataMap)
+    {
+        forecastCube.cityIds.push_back(cityData.first);
+        cities.push_back(&cityData.second);
+    }
+    forecastCube.cloudSeries.assign(cities.size() * steps, 0.f);
+    forecastCube.pressureSeries.assign(cities.size() * steps, 0.f);
+
+    parallelForStealing(cities.size(), 64, [&](size_t c) {
+        const CityData& data = *cities[c];
+        float* cloudSeries = &forecastCube.cloudSeries[c * steps];
+        float* pressureSeries = &forecastCube.pressureSeries[c * steps];
+        cloudSeries[0] = data.avgCloudCover;
+        pressureSeries[0] = data.avgAtmosphericPressure;
+
+        for (size_t step = 1; step < steps; step++)
+        {
+            long long cloudTotal = 0, pressureTotal = 0;
+            const uint8_t* cloud = forecastCube.layer(step, 0);
+            const uint8_t* pressure = forecastCube.layer(step, 1);
+            forEachNeighborhoodRun(data, region, [&](int y, int xFrom, int xTo) {
+                size_t rowStart = static_cast<size_t>(y) * width;
+                for (int x = xFrom; x <= xTo; x++)
+                {
+                    cloudTotal += cloud[rowStart + x];
+                    pressureTotal += pressure[rowStart + x];
+                }
+            });
+            cloudSeries[step] = static_cast<float>(cloudTotal) / static_cast<float>(data.neighborhoodCells);
+            pressureSeries[step] = static_cast<float>(pressureTotal) / static_cast<float>(data.neighborhoodCells);
+        }
+    });
+
+    log << "Forecast timesteps loaded: " << steps << '\n';
+    return complete;
+}
+
+// ---- Named data layers ----
+// Layers beyond city, cloud and pressure (humidity, temperature, wind, ...) are only registered
+// when the config is read. A layer's file is parsed the first time a map, summary or query needs
+// it, so a run only pays for the layers it uses.
+
+struct DataLayer
+{
+    LayerSpec spec;
+    std::atomic<bool> loaded{false}; // Set once values and averages are written, so a set flag is read without the lock
+    bool read = false; // Its file was read, so the cities have averages of it
+    std::vector<int16_t> values; // One column per layer, in grid storage order (GridStore::index)
+    std::vector<uint8_t> lmhCodes; // Map symbols, built on first use
+    std::vector<uint8_t> indexCodes;
+    std::atomic<const uint8_t*> lmhReady{nullptr}, indexReady{nullptr}; // The codes once built, read without the lock
+};
+
+std::deque<DataLayer> dataLayers; // Layers of the loaded configuration (a deque, as DataLayer cannot move)
+std::mutex dataLayersLock; // Server requests may need the same layer at once
+
+// Index of the layer with this name, or -1
+int findDataLayer(std::string_view name)
+{
+    for (size_t l = 0; l < dataLayers.size(); l++)
+    {
+        if (dataLayers[l].spec.name == name)
+        {
+            return static_cast<int>(l);
+        }
+    }
+    return -1;
+}
+
+char layerLMHSymbol(const LayerSpec& spec, float value)
+{
+    return (value < spec.lowBelow) ? 'L' : (value < spec.highFrom) ? 'M' : 'H';
+}
+
+// Index digit 0-9: the valid range split into ten equal bands
+int layerIndexDigit(const LayerSpec& spec, int value)
+{
+    long long span = static_cast<long long>(spec.maxValue) - spec.minValue + 1;
+    return static_cast<int>((static_cast<long long>(value) - spec.minValue) * 10 / span);
+}
+
+// Named layers are read once, laid out as mainRegion's grid. A region reloaded by the server can
+// share them only while its grid ranges are unchanged.
+bool sharesNamedLayers(const RegionContext& region)
+{
+    return &region == &mainRegion || (region.gridXmin == mainRegion.gridXmin && region.gridXmax == mainRegion.gridXmax
+                                      && region.gridYmin == mainRegion.gridYmin && region.gridYmax == mainRegion.gridYmax);
+}
+
+// Average a layer over the neighborhood of every city in region, the same cells as the cloud
+// cover and pressure averages. layout is the grid whose storage order the layer's values follow;
+// region must share the named layers (see sharesNamedLayers).
+void averageDataLayer(const DataLayer& layer, size_t layerIndex, const GridStore& layout, RegionContext& region)
+{
+    std::vector<CityData*> cities;
+    cities.reserve(region.cityDataMap.size());
+    for (auto& cityData : region.cityDataMap)
+    {
+        cities.push_back(&cityData.second);
+    }
+    parallelForStealing(cities.size(), 64, [&](size_t c) {
+        CityData& data = *cities[c];
+        long long total = 0;
+        forEachNeighborhoodRun(data, region, [&](int y, int xFrom, int xTo) {
+            for (int x = xFrom; x <= xTo; x++)
+            {
+                total += layer.values[layout.index(x, y)];
+            }
+        });
+        data.layerAverages.resize(dataLayers.size(), std::numeric_limits<float>::quiet_NaN());
+        data.layerAverages[layerIndex] = static_cast<float>(total) / static_cast<float>(data.neighborhoodCells);
+    });
+}
+
+// Parse the layer's file and average it over every city's neighborhood. Chunks are parsed in
+// parallel a window at a time and each window is applied in file order before the next one is
+// parsed, so the last line for a cell wins as in the core layers and the pending writes stay
+// bounded by the window rather than the file. The caller holds dataLayersLock. Named layers
+// belong to mainRegion.
+bool loadDataLayer(DataLayer& layer, size_t layerIndex, ostream& log, RegionContext& region = mainRegion)
+{
+    const GridStore& grid = region.grid;
+    const LayerSpec& spec = layer.spec;
+    layer.values.assign(grid.cells(), static_cast<int16_t>(spec.minValue));
+
+    string invalidValue = "Error: Invalid " + spec.name + " value.\n";
+    auto parseLayerLine = [&](std::string_view line, string& diagnostics, auto write) {
+        ParsedLine parsed = parseDataLine(line, region);
+        if (parsed.kind == ParsedLine::OutOfBounds)
+        {
+            appendDiagnostics(parsed, diagnostics);
+        }
+        else if (parsed.kind == ParsedLine::Value && (parsed.value < spec.minValue || parsed.value > spec.maxValue))
+        {
+            diagnostics += invalidValue;
+        }
+        else if (parsed.kind == ParsedLine::Value)
+        {
+            write(grid.index(parsed.xPos, parsed.yPos), static_cast<int16_t>(parsed.value));
+        }
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+    MappedFile file;
+    bool opened = false;
+    if (spec.filePath.empty())
+    {
+        log << "Layer " << spec.name << " File Not Found" << '\n';
+    }
+    else if (compressionOf(spec.filePath) != Compression::None)
+    {
+        // Decompressed a block at a time on this thread, each line written straight into the layer
+        string diagnostics, readError;
+        opened = forEachInputLine(spec.filePath, readError, [&](std::string_view line) {
+            parseLayerLine(line, diagnostics, [&](size_t cell, int16_t value) { layer.values[cell] = value; });
+        });
+        cerr << diagnostics << readError << flush;
+        if (!opened)
+        {
+            layer.values.assign(grid.cells(), static_cast<int16_t>(spec.minValue)); // A corrupt file counts as missing
+        }
+    }
+    else if ((opened = file.open(spec.filePath)))
+    {
+        struct LayerWrite
+        {
+            size_t cell;
+            int16_t value;
+        };
+        std::vector<IngestChunk> chunks;
+        appendFileChunks(file, 0, chunks);
+        size_t windowChunks = static_cast<size_t>(workerThreadCount()) * 2;
+        std::vector<std::vector<LayerWrite>> writes(std::min(windowChunks, chunks.size())); // Reused by every window
+        for (size_t first = 0; first < chunks.size(); first += windowChunks)
+        {
+            size_t count = std::min(windowChunks, chunks.size() - first);
+            parallelFor(count, [&](size_t w) {
+                IngestChunk& chunk = chunks[first + w];
+                forEachLine(chunk.begin, chunk.end, [&](std::string_view line) {
+                    parseLayerLine(line, chunk.diagnostics, [&](size_t cell, int16_t value) { writes[w].push_back({cell, value}); });
+                });
+            });
+            for (size_t w = 0; w < count; w++)
+            {
+                cerr << chunks[first + w].diagnostics;
+                string().swap(chunks[first + w].diagnostics);
+                for (const LayerWrite& write : writes[w])
+                {
+                    layer.values[write.cell] = write.value;
+                }
+                writes[w].clear();
+            }
+        }
+        cerr << flush;
+    }
+
+    if (opened)
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        log << "Reading in " << spec.filePath << " ... done! (" << spec.name << ", "
+            << static_cast<long long>(elapsed.count() * 1000.0) << " ms)\n";
+    }
+    else if (!spec.filePath.empty())
+    {
+        log << "Unable to open " << spec.name << " file" << '\n';
+    }
+
+    if (!opened)
+    {
+        return false; // The summary leaves a layer without data out
+    }
+    layer.read = true;
+    averageDataLayer(layer, layerIndex, grid, region);
+    return true;
+}
+
+// Make sure a layer is loaded; false if its file could not be read. A missing file is reported
+// once, the layer then reads as its minimum.
+bool ensureDataLayer(size_t layerIndex, ostream& log)
+{
+    DataLayer& layer = dataLayers[layerIndex];
+    if (layer.loaded.load(std::memory_order_acquire))
+    {
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(dataLayersLock);
+    if (layer.loaded.load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+    bool read = loadDataLayer(layer, layerIndex, log);
+    layer.loaded.store(true, std::memory_order_release);
+    return read;
+}
+
+// Load every layer not loaded yet (the summary reports all of them)
+bool ensureAllDataLayers(ostream& log)
+{
+    bool complete = true;
+    for (size_t l = 0; l < dataLayers.size(); l++)
+    {
+        complete = ensureDataLayer(l, log) && complete;
+    }
+    return complete;
+}
+
+// Map symbols of a layer in grid storage order, for renderMap
+const uint8_t* dataLayerCodes(size_t layerIndex, bool lmh, ostream& log)
+{
+    DataLayer& layer = dataLayers[layerIndex];
+    std::atomic<const uint8_t*>& ready = lmh ? layer.lmhReady : layer.indexReady;
+    if (const uint8_t* built = ready.load(std::memory_order_acquire))
+    {
+        return built;
+    }
+    ensureDataLayer(layerIndex, log);
+    std::lock_guard<std::mutex> guard(dataLayersLock);
+    std::vector<uint8_t>& codes = lmh ? layer.lmhCodes : layer.indexCodes;
+    if (codes.empty() && !layer.values.empty())
+    {
+        codes.resize(layer.values.size());
+        const size_t sliceCells = 1u << 20;
+        parallelFor((codes.size() + sliceCells - 1) / sliceCells, [&](size_t slice) {
+            size_t last = std::min(codes.size(), (slice + 1) * sliceCells);
+            for (size_t cell = slice * sliceCells; cell < last; cell++)
+            {
+                int value = layer.values[cell];
+                codes[cell] = lmh ? static_cast<uint8_t>(layerLMHSymbol(layer.spec, value))
+                                  : static_cast<uint8_t>('0' + layerIndexDigit(layer.spec, value));
+            }
+        });
+        ready.store(codes.data(), std::memory_order_release);
+    }
+    return codes.data();
+}
+
+// Drop the layers of the previous configuration
+void resetDataLayers(const std::vector<LayerSpec>& specs)
+{
+    std::lock_guard<std::mutex> guard(dataLayersLock);
+    dataLayers.clear();
+    for (const LayerSpec& spec : specs)
+    {
+        dataLayers.emplace_back();
+        dataLayers.back().spec = spec;
+    }
+}
+
+// Read a configuration file and load everything it points to (menu option 1).
+// Progress messages go to log; validation errors still go to cerr.
+LoadStatus loadConfiguration(const string& fileName, ostream& log)
+{
+    RegionContext& region = mainRegion; // Named layers, timesteps and the city indexes belong to it
+    if (isSnapshotFile(fileName)) {
+        return loadSnapshot(fileName, log, false); // A saved snapshot restores everything without parsing
+    }
+
+    if (statsEnabled) {
+        loadStats = LoadStats(); // The figures describe the latest load only
+    }
+
+    ConfigFile config;
+    std::vector<IngestRequest> requests;
+    {
+        PhaseTimer timer(loadStats.configSeconds);
+        if (!parseConfigFile(fileName, config, region)) {
+            return LoadStatus::ConfigUnreadable;
+        }
+
+        region.cityDataMap.clear(); // Cities from a previously loaded configuration do not carry over
+        region.cityIndexesStale = true;
+        resetDataLayers(config.layers); // Named layers load on first use
+
+        // Display grid ranges
+        log << "Reading in GridX_IdRange: " << region.gridXmin << "-" << region.gridXmax << " ... done!" << '\n';
+        log << "Reading in GridY_IdRange: " << region.gridYmin << "-" << region.gridYmax << " ... done!" << '\n';
+
+        // Process the files, all three are loaded at the same time
+        requests = dataFileRequests(config, log);
+        setupGrid(requests, log, region);
+    }
+
+    bool complete = config.citylocFound && config.cloudcoverFound && config.pressureFound;
+    std::vector<bool> opened = ingestDataFiles(requests, log, region);
+    for (size_t f = 0; f < requests.size(); f++) {
+        if (!opened[f]) {
+            complete = false;
+            const char* fileKind[] = {"city", "cloud", "pressure"};
+            log << "Unable to open " << fileKind[requests[f].fileDataType] << " file" << '\n';
+        }
+    }
+
+    log << "\nAll records successfully stored. Going back to main menu ...\n" << '\n';
+
+    // Process the average atmospheric pressure and cloud cover for each city
+    {
+        PhaseTimer timer(loadStats.averagesSeconds);
+        buildSummedAreaTables(region);
+    }
+    computeCityAverages(region);
+    if (statsEnabled) {
+        notePeakGridMemory(region);
+    }
+
+    // Further cloud / pressure files in the config are later forecast timesteps
+    forecastCube.release();
+    if (!config.laterStepFiles.empty() && !loadForecastSteps(config, log, region)) {
+        complete = false;
+    }
+
+    return complete ? LoadStatus::Loaded : LoadStatus::DataIncomplete;
+}
+
+// loadConfiguration for one region of a --regions run: ranges, grid, cities and averages land in
+// region instead of the globals. Snapshots, named layers and later timesteps are not supported here.
+LoadStatus loadRegion(RegionContext& region, const string& fileName, ostream& log)
+{
+    ConfigFile config;
+    if (!parseConfigFile(fileName, config, region)) {
+        return LoadStatus::ConfigUnreadable;
+    }
+    if (!config.layers.empty() || !config.laterStepFiles.empty()) {
+        log << "Named layers and later timesteps are ignored when loading regions" << '\n';
+    }
+
+    log << "Reading in GridX_IdRange: " << region.gridXmin << "-" << region.gridXmax << " ... done!" << '\n';
+    log << "Reading in GridY_IdRange: " << region.gridYmin << "-" << region.gridYmax << " ... done!" << '\n';
+
+    std::vector<IngestRequest> requests = dataFileRequests(config, log);
+    setupGrid(requests, log, region);
+
+    bool complete = config.citylocFound && config.cloudcoverFound && config.pressureFound;
+    std::vector<bool> opened = ingestDataFiles(requests, log, region);
+    for (size_t f = 0; f < requests.size(); f++) {
+        if (!opened[f]) {
+            complete = false;
+            const char* fileKind[] = {"city", "cloud", "pressure"};
+            log << "Unable to open " << fileKind[requests[f].fileDataType] << " file" << '\n';
+        }
+    }
+
+    buildSummedAreaTables(region);
+    computeCityAverages(region);
+    return complete ? LoadStatus::Loaded : LoadStatus::DataIncomplete;
+}
+
+void CityAreaIndex::build(const RegionContext& region, CityArea area)
+{
+    const std::map<int, CityData>& cities = region.cityDataMap;
+    int width = region.gridXmax - region.gridXmin + 1, height = region.gridYmax - region.gridYmin + 1; // Also valid in streaming mode, which has no grid
+    gridWidth = width;
+    gridHeight = height;
+    cityEntries.clear();
+    for (const auto& cityData : cities)
+    {
+        Entry entry{cityData.first, 0, 0, 0, 0};
+        if (area == CityArea::Neighborhood)
+        {
+            cityNeighborhood(cityData.second, entry.xFrom, entry.yFrom, entry.xTo, entry.yTo, region);
+        }
+        else
+        {
+            entry.xFrom = std::max(cityData.second.lowerLeftCoord.first, 0);
+            entry.yFrom = std::max(cityData.second.lowerLeftCoord.second, 0);
+            entry.xTo = std::min(cityData.second.topRightCoord.first, width - 1);
+            entry.yTo = std::min(cityData.second.topRightCoord.second, height - 1);
+        }
+        cityEntries.push_back(entry); // Empty areas are kept so entry indices follow cityDataMap
+    }
+
+    double cellsPerBucket = static_cast<double>(width) * height / std::max<size_t>(cityEntries.size(), 1);
+    bucketSize = std::max(1, static_cast<int>(std::ceil(std::sqrt(cellsPerBucket))));
+    bucketsAcross = static_cast<size_t>((width + bucketSize - 1) / bucketSize);
+    size_t bucketsDown = static_cast<size_t>((height + bucketSize - 1) / bucketSize);
+
+    // Two passes over the entries: count per bucket, then fill (compressed rows)
+    bucketStart.assign(bucketsAcross * bucketsDown + 1, 0);
+    auto forEachBucket = [&](const Entry& entry, auto visit) {
+        if (entry.xFrom > entry.xTo || entry.yFrom > entry.yTo)
+        {
+            return;
+        }
+        for (int by = entry.yFrom / bucketSize; by <= entry.yTo / bucketSize; by++)
+        {
+            for (int bx = entry.xFrom / bucketSize; bx <= entry.xTo / bucketSize; bx++)
+            {
+                visit(static_cast<size_t>(by) * bucketsAcross + static_cast<size_t>(bx));
+            }
+        }
+    };
+    for (const Entry& entry : cityEntries)
+    {
+        forEachBucket(entry, [&](size_t bucket) { bucketStart[bucket + 1]++; });
+    }
+    for (size_t b = 1; b < bucketStart.size(); b++)
+    {
+        bucketStart[b] += bucketStart[b - 1];
+    }
+    bucketEntries.assign(bucketStart.back(), 0);
+    std::vector<size_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+    for (size_t e = 0; e < cityEntries.size(); e++)
+    {
+        forEachBucket(cityEntries[e], [&](size_t bucket) { bucketEntries[fill[bucket]++] = static_cast<uint32_t>(e); });
+    }
+}
+
+std::vector<std::pair<long long, size_t>> CityAreaIndex::nearest(int x, int y, size_t k) const
+{
+    std::vector<std::pair<long long, size_t>> best; // Kept sorted, at most k long
+    if (cityEntries.empty() || k == 0)
+    {
+        return best;
+    }
+    auto closer = [&](const std::pair<long long, size_t>& a, const std::pair<long long, size_t>& b) {
+        return a.first != b.first ? a.first < b.first : cityEntries[a.second].cityId < cityEntries[b.second].cityId;
+    };
+
+    size_t bucketsDown = (bucketStart.size() - 1) / bucketsAcross;
+    long long centreX = std::min(std::max(x, 0), gridWidth - 1) / bucketSize;
+    long long centreY = std::min(std::max(y, 0), gridHeight - 1) / bucketSize;
+    long long lastRing = std::max({centreX, centreY, static_cast<long long>(bucketsAcross) - 1 - centreX, static_cast<long long>(bucketsDown) - 1 - centreY});
+
+    for (long long ring = 0; ring <= lastRing; ring++)
+    {
+        for (long long by = centreY - ring; by <= centreY + ring; by++)
+        {
+            if (by < 0 || by >= static_cast<long long>(bucketsDown))
+            {
+                continue;
+            }
+            bool edgeRow = (by == centreY - ring || by == centreY + ring);
+            for (long long bx = centreX - ring; bx <= centreX + ring; bx += edgeRow ? 1 : 2 * std::max(ring, 1LL))
+            {
+                if (bx < 0 || bx >= static_cast<long long>(bucketsAcross))
+                {
+                    continue;
+                }
+                size_t bucket = static_cast<size_t>(by) * bucketsAcross + static_cast<size_t>(bx);
+                for (size_t i = bucketStart[bucket]; i < bucketStart[bucket + 1]; i++)
+                {
+                    std::pair<long long, size_t> candidate(squaredDistance(cityEntries[bucketEntries[i]], x, y), bucketEntries[i]);
+                    if (best.size() == k && !closer(candidate, best.back()))
+                    {
+                        continue;
+                    }
+                    if (std::any_of(best.begin(), best.end(), [&](const std::pair<long long, size_t>& found) { return found.second == candidate.second; }))
+                    {
+                        continue; // Already found through another bucket
+                    }
+                    best.insert(std::upper_bound(best.begin(), best.end(), candidate, closer), candidate);
+                    if (best.size() > k)
+                    {
+                        best.pop_back();
+                    }
+                }
+            }
+        }
+
+        // Every cell outside the searched square of buckets is at least this far away
+        long long gapX = std::min(x - (centreX - ring) * bucketSize, (centreX + ring + 1) * bucketSize - 1 - x) + 1;
+        long long gapY = std::min(y - (centreY - ring) * bucketSize, (centreY + ring + 1) * bucketSize - 1 - y) + 1;
+        long long gap = std::max(std::min(gapX, gapY), 0LL);
+        if (best.size() == k && gap * gap > best.back().first)
+        {
+            break;
+        }
+    }
+    return best;
+}
+
+// Rebuild both city indexes after cityDataMap changed
+void ensureCityIndexes(RegionContext& region = mainRegion)
+{
+    if (region.cityIndexesStale)
+    {
+        region.cityNeighborhoods.build(region, CityArea::Neighborhood);
+        region.cityBoxes.build(region, CityArea::BoundingBox);
+        region.cityIndexesStale = false;
+    }
+}
+
+// One query against the city index, in grid coordinates:
+// "point:X,Y" (cities whose bounding box contains the cell), "rect:X0,Y0,X1,Y1" (cities whose
+// bounding box intersects the rectangle) or "nearest:X,Y,K" (the K cities with the nearest bounding box)
+struct CityQuery
+{
+    enum Kind { Point, Rect, Nearest };
+    Kind kind = Point;
+    int numbers[4] = {0, 0, 0, 0};
+};
+
+bool parseCityQuery(std::string_view text, CityQuery& query)
+{
+    while (!text.empty() && (text.back() == '\r' || text.back() == ' ')) text.remove_suffix(1);
+    size_t colon = text.find(':');
+    if (colon == std::string_view::npos)
+    {
+        return false;
+    }
+    std::string_view kind = text.substr(0, colon);
+    size_t expected;
+    if (kind == "point") { query.kind = CityQuery::Point; expected = 2; }
+    else if (kind == "rect") { query.kind = CityQuery::Rect; expected = 4; }
+    else if (kind == "nearest") { query.kind = CityQuery::Nearest; expected = 3; }
+    else return false;
+
+    const char* cursor = text.data() + colon + 1;
+    const char* end = text.data() + text.size();
+    for (size_t n = 0; n < expected; n++)
+    {
+        while (cursor < end && *cursor == ' ') cursor++;
+        auto [next, ec] = std::from_chars(cursor, end, query.numbers[n]);
+        if (ec != std::errc())
+        {
+            return false;
+        }
+        cursor = next;
+        if (n + 1 < expected)
+        {
+            if (cursor == end || *cursor != ',') return false;
+            cursor++;
+        }
+    }
+    return cursor == end && (query.kind != CityQuery::Nearest || query.numbers[2] > 0);
+}
+
+// Append "<query>: id id ..." for one query; IDs ascending, nearest queries nearest first with the distance
+void answerCityQuery(std::string_view text, const CityQuery& query, string& out, const RegionContext& region = mainRegion)
+{
+    int gridXmin = region.gridXmin, gridYmin = region.gridYmin;
+    const CityAreaIndex& cityBoxes = region.cityBoxes; // Built by ensureCityIndexes
+    const std::vector<CityAreaIndex::Entry>& entries = cityBoxes.entries();
+    out.append(text.data(), text.size());
+    out += ':';
+
+    std::vector<int> ids;
+    if (query.kind == CityQuery::Nearest)
+    {
+        for (const auto& found : cityBoxes.nearest(query.numbers[0] - gridXmin, query.numbers[1] - gridYmin, static_cast<size_t>(query.numbers[2])))
+        {
+            char distance[32];
+            snprintf(distance, sizeof(distance), "(%.2f)", std::sqrt(static_cast<double>(found.first)));
+            out += ' ';
+            appendNumber(out, entries[found.second].cityId);
+            out += distance;
+        }
+        out += '\n';
+        return;
+    }
+
+    auto collect = [&](size_t entry) { ids.push_back(entries[entry].cityId); };
+    if (query.kind == CityQuery::Point)
+    {
+        cityBoxes.forEachContaining(query.numbers[0] - gridXmin, query.numbers[1] - gridYmin, collect);
+    }
+    else
+    {
+        cityBoxes.forEachIntersecting(std::min(query.numbers[0], query.numbers[2]) - gridXmin, std::min(query.numbers[1], query.numbers[3]) - gridYmin,
+                                      std::max(query.numbers[0], query.numbers[2]) - gridXmin, std::max(query.numbers[1], query.numbers[3]) - gridYmin, collect);
+    }
+    std::sort(ids.begin(), ids.end());
+    for (int id : ids)
+    {
+        out += ' ';
+        appendNumber(out, id);
+    }
+    out += '\n';
+}
+
+// Answer queries (one per line) in blocks on the worker pool, writing the answers in input order.
+// Returns false if any line was not a valid query; those lines are reported on cerr and skipped.
+bool answerCityQueries(const std::vector<std::string_view>& queries, ostream& out, RegionContext& region = mainRegion)
+{
+    ensureCityIndexes(region);
+    const size_t queriesPerBlock = 4096;
+    size_t blockCount = (queries.size() + queriesPerBlock - 1) / queriesPerBlock;
+    size_t blocksPerWindow = static_cast<size_t>(workerThreadCount()) * 4;
+    std::vector<string> blockText(blocksPerWindow), blockErrors(blocksPerWindow);
+    bool allValid = true;
+
+    for (size_t firstBlock = 0; firstBlock < blockCount; firstBlock += blocksPerWindow)
+    {
+        size_t windowBlocks = std::min(blocksPerWindow, blockCount - firstBlock);
+        parallelForStealing(windowBlocks, 1, [&](size_t b) {
+            blockText[b].clear();
+            blockErrors[b].clear();
+            size_t first = (firstBlock + b) * queriesPerBlock;
+            size_t last = std::min(first + queriesPerBlock, queries.size());
+            for (size_t q = first; q < last; q++)
+            {
+                CityQuery query;
+                if (queries[q].empty())
+                {
+                    continue;
+                }
+                if (!parseCityQuery(queries[q], query))
+                {
+                    blockErrors[b] += "Error: Invalid query '" + string(queries[q]) + "'.\n";
+                    continue;
+                }
+                answerCityQuery(queries[q], query, blockText[b], region);
+            }
+        });
+        for (size_t b = 0; b < windowBlocks; b++)
+        {
+            out << blockText[b];
+            cerr << blockErrors[b];
+            allValid = allValid && blockErrors[b].empty();
+        }
+    }
+    return allValid;
+}
+
+// Summary-only mode that never allocates the grid. The city file is read first to find every
+// city's neighborhood, then the cloud and pressure files are streamed once and each value is added
+// to the cities whose neighborhood contains its cell. Memory is O(number of cities); compressed
+// files are decompressed a block at a time as they are streamed.
+// Unlike the grid, the accumulators cannot see a cell being overwritten, so a cell listed twice in
+// one file is counted twice (the grid keeps only the last line); inputs are expected to list each
+// cell at most once per file.
+LoadStatus streamCitySummaries(const string& fileName, ostream& log, RegionContext& region)
+{
+    ConfigFile config;
+    if (!parseConfigFile(fileName, config, region))
+    {
+        return LoadStatus::ConfigUnreadable;
+    }
+    log << "Reading in GridX_IdRange: " << region.gridXmin << "-" << region.gridXmax << " ... done!" << '\n';
+    log << "Reading in GridY_IdRange: " << region.gridYmin << "-" << region.gridYmax << " ... done!" << '\n';
+
+    region.grid.release();
+    region.cityDataMap.clear();
+    region.cityIndexesStale = true;
+    if (&region == &mainRegion)
+    {
+        forecastCube.release(); // Timesteps and named layers belong to mainRegion
+        resetDataLayers({}); // Named layers need the grid, which streaming never builds
+    }
+    std::vector<IngestRequest> requests = dataFileRequests(config, log);
+    bool complete = config.citylocFound && config.cloudcoverFound && config.pressureFound;
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<MappedFile> files(requests.size());
+    std::vector<bool> compressed(requests.size(), false);
+    std::vector<char> opened(requests.size(), 0); // Not vector<bool>: the second pass sets entries concurrently
+    std::vector<size_t> fileBytes(requests.size(), 0);
+    std::vector<string> readErrors(requests.size());
+    const char* fileKind[] = {"city", "cloud", "pressure"};
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        compressed[f] = compressionOf(requests[f].filename) != Compression::None;
+        opened[f] = compressed[f] || files[f].open(requests[f].filename); // Compressed files are opened as they are streamed
+        fileBytes[f] = compressed[f] ? 0 : files[f].size();
+        if (!opened[f])
+        {
+            complete = false;
+            log << "Unable to open " << fileKind[requests[f].fileDataType] << " file" << '\n';
+        }
+    }
+    auto streamFile = [&](size_t f, auto visit) {
+        if (!compressed[f])
+        {
+            forEachLine(files[f].data(), files[f].data() + files[f].size(), visit);
+            return;
+        }
+        opened[f] = forEachInputLine(requests[f].filename, readErrors[f], [&](std::string_view line) {
+            fileBytes[f] += line.size() + 1;
+            visit(line);
+        });
+    };
+
+    // Pass 1: city layout only, in line order
+    string diagnostics;
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (requests[f].fileDataType != 0 || !opened[f])
+        {
+            continue;
+        }
+        streamFile(f, [&](std::string_view line) {
+            ParsedLine parsed = parseDataLine(line, region);
+            appendDiagnostics(parsed, diagnostics);
+            if (parsed.kind == ParsedLine::City)
+            {
+                applyCityLine({parsed.value, parsed.xPos, parsed.yPos, parsed.cityname}, region);
+            }
+        });
+        diagnostics += readErrors[f];
+    }
+    cerr << diagnostics << flush;
+    std::chrono::duration<double> cityPass = std::chrono::steady_clock::now() - startTime;
+
+    CityAreaIndex index;
+    index.build(region);
+    std::vector<std::atomic<long long>> cloudTotals(index.entries().size());
+    std::vector<std::atomic<long long>> pressureTotals(index.entries().size());
+
+    // Pass 2: one streaming pass over the value files, chunks of the mapped files in parallel and
+    // each compressed file as one task of its own
+    std::vector<IngestChunk> chunks;
+    std::vector<size_t> compressedFiles;
+    std::vector<string> fileDiagnostics(requests.size());
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (requests[f].fileDataType != 0 && opened[f])
+        {
+            if (compressed[f]) compressedFiles.push_back(f);
+            else appendFileChunks(files[f], f, chunks);
+        }
+    }
+    parallelFor(chunks.size() + compressedFiles.size(), [&](size_t task) {
+        size_t f = (task < chunks.size()) ? chunks[task].fileIndex : compressedFiles[task - chunks.size()];
+        string& taskDiagnostics = (task < chunks.size()) ? chunks[task].diagnostics : fileDiagnostics[f];
+        std::vector<std::atomic<long long>>& totals = (requests[f].fileDataType == 1) ? cloudTotals : pressureTotals;
+        auto addValue = [&](std::string_view line) {
+            ParsedLine parsed = parseDataLine(line, region);
+            appendDiagnostics(parsed, taskDiagnostics);
+            if (parsed.kind == ParsedLine::Value)
+            {
+                index.forEachContaining(parsed.xPos, parsed.yPos, [&](size_t entry) {
+                    totals[entry].fetch_add(parsed.value, std::memory_order_relaxed);
+                });
+            }
+        };
+        if (task < chunks.size())
+        {
+            forEachLine(chunks[task].begin, chunks[task].end, addValue);
+        }
+        else
+        {
+            streamFile(f, addValue);
+        }
+    });
+    for (size_t f = 0, c = 0; f < requests.size(); f++)
+    {
+        for (; c < chunks.size() && chunks[c].fileIndex == f; c++)
+        {
+            cerr << chunks[c].diagnostics;
+        }
+        cerr << fileDiagnostics[f] << (requests[f].fileDataType != 0 ? readErrors[f] : "");
+    }
+    cerr << flush;
+
+    // The city file is timed by the first pass; the value files are read together by the second
+    std::chrono::duration<double> valuePass = std::chrono::steady_clock::now() - startTime - cityPass;
+    for (size_t f = 0; f < requests.size(); f++)
+    {
+        if (opened[f])
+        {
+            reportThroughput(log, requests[f].filename, fileBytes[f], (requests[f].fileDataType == 0) ? cityPass.count() : valuePass.count());
+        }
+        else if (compressed[f])
+        {
+            complete = false; // Corrupt data counts as a missing file, like option 1
+            if (readErrors[f].empty())
+            {
+                log << "Unable to open " << fileKind[requests[f].fileDataType] << " file" << '\n';
+            }
+        }
+    }
+
+    // Same arithmetic as computeCityAverages: exact sums over the neighborhood area
+    size_t entry = 0;
+    for (auto& cityData : region.cityDataMap)
+    {
+        const CityAreaIndex::Entry& area = index.entries()[entry];
+        long long totalCells = 0;
+        long long totalCloud = 0, totalPressure = 0;
+        if (area.xFrom <= area.xTo && area.yFrom <= area.yTo)
+        {
+            totalCells = static_cast<long long>(area.xTo - area.xFrom + 1) * (area.yTo - area.yFrom + 1);
+            totalCloud = cloudTotals[entry].load();
+            totalPressure = pressureTotals[entry].load();
+        }
+        cityData.second.totalCloudCover = totalCloud;
+        cityData.second.totalAtmosphericPressure = totalPressure;
+        cityData.second.neighborhoodCells = totalCells;
+        updateCityAverages(cityData.second);
+        entry++;
+    }
+
+    return complete ? LoadStatus::Loaded : LoadStatus::DataIncomplete;
+}
+
+// Apply a file of "[x, y]-value" revisions to one layer of the live grid. Each changed cell adjusts
+// the exact totals of the cities whose neighborhood contains it, and only those cities get new
+// averages, so the cost follows the size of the delta rather than the grid.
+bool applyDeltaFile(const string& fileName, int fileDataType, DeltaResult& result, RegionContext& region)
+{
+    if (region.grid.empty() || (fileDataType != 1 && fileDataType != 2))
+    {
+        return false;
+    }
+
+    ensureCityIndexes(region);
+    const std::vector<CityAreaIndex::Entry>& entries = region.cityNeighborhoods.entries();
+    std::vector<const CityData*> entryCities; // Exact mode: the masks, in entry (cityDataMap) order
+    if (neighborhoodMode == NeighborhoodMode::Exact)
+    {
+        for (const auto& cityData : region.cityDataMap)
+        {
+            entryCities.push_back(&cityData.second);
+        }
+    }
+    std::vector<long long> cityChange(entries.size(), 0);
+    std::vector<char> dirty(entries.size(), 0);
+    std::vector<size_t> dirtyEntries;
+
+    string diagnostics, readError;
+    bool read = forEachInputLine(fileName, readError, [&](std::string_view line) {
+        ParsedLine parsed = parseDataLine(line, region);
+        appendDiagnostics(parsed, diagnostics);
+        if (parsed.kind != ParsedLine::Value)
+        {
+            return;
+        }
+        result.linesApplied++;
+
+        float previous = (fileDataType == 1) ? region.grid.cloudAt(parsed.xPos, parsed.yPos) : region.grid.pressureAt(parsed.xPos, parsed.yPos);
+        long long change = static_cast<long long>(parsed.value) - static_cast<long long>(previous);
+        if (change == 0)
+        {
+            return;
+        }
+        result.cellsChanged++;
+        if (fileDataType == 1) region.grid.setCloud(parsed.xPos, parsed.yPos, static_cast<float>(parsed.value));
+        else region.grid.setPressure(parsed.xPos, parsed.yPos, static_cast<float>(parsed.value));
+        if (&region == &mainRegion && forecastCube.timesteps() > 0)
+        {
+            // The grid is timestep 0 of a multi-timestep forecast
+            forecastCube.layer(0, fileDataType - 1)[static_cast<size_t>(parsed.yPos) * forecastCube.width() + parsed.xPos] = ForecastCube::compact(parsed.value);
+        }
+
+        region.cityNeighborhoods.forEachContaining(parsed.xPos, parsed.yPos, [&](size_t entry) {
+            if (!entryCities.empty() && !neighborhoodMaskContains(*entryCities[entry], parsed.xPos, parsed.yPos))
+            {
+                return; // Inside the rectangle but not next to any of the city's cells
+            }
+            if (!dirty[entry])
+            {
+                dirty[entry] = 1;
+                dirtyEntries.push_back(entry);
+            }
+            cityChange[entry] += change;
+        });
+    });
+    cerr << diagnostics << readError << flush; // Revisions read before corrupt data still count, so the totals match the grid
+
+    for (size_t entry : dirtyEntries)
+    {
+        if (cityChange[entry] == 0)
+        {
+            continue; // The revisions to this city cancelled out
+        }
+        CityData& data = region.cityDataMap[entries[entry].cityId];
+        if (fileDataType == 1) data.totalCloudCover += cityChange[entry];
+        else data.totalAtmosphericPressure += cityChange[entry];
+        updateCityAverages(data);
+        result.citiesRecomputed++;
+        if (&region == &mainRegion && forecastCube.timesteps() > 0)
+        {
+            // Index entries and cube series both follow cityDataMap order
+            size_t seriesIndex = entry * forecastCube.timesteps();
+            forecastCube.cloudSeries[seriesIndex] = data.avgCloudCover;
+            forecastCube.pressureSeries[seriesIndex] = data.avgAtmosphericPressure;
+        }
+    }
+
+    if (result.cellsChanged > 0)
+    {
+        // Region queries rebuild the tables the next time they need them
+        region.cloudCoverSums.clear();
+        region.pressureSums.clear();
+        invalidateClassifiedLayers(region);
+    }
+    return read;
+}
+
+// Binary snapshot of everything option 1 produces. The file is mapped copy-on-write and the grid
+// layers are used in place, so loading costs one mmap plus rebuilding cityDataMap. All sections
+// start 8-byte aligned and use the host byte order.
+const char snapshotMagic[8] = {'W', 'I', 'P', 'S', 'S', 'N', 'A', 'P'};
+const uint32_t snapshotVersion = 3; // 2: city records carry the exact neighborhood totals, 3: and the neighborhood mode
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    int32_t gridXmin, gridXmax, gridYmin, gridYmax;
+    uint32_t numberOfDigits, numberOfDigitsYaxis, leftPadding, rightPadding; // RegionContext map padding
+    uint32_t layout; // GridLayout of the stored layers
+    uint32_t bytesPerCell;
+    uint32_t neighborhoodMode; // NeighborhoodMode the city totals were computed with
+    uint32_t reserved;
+    uint64_t cellCount;
+    uint64_t layerOffset; // cityIds, cloudCover, atmosphericPressure back to back
+    uint64_t layerBytes;
+    uint64_t cityCount;
+    uint64_t cityTableOffset; // cityCount SnapshotCity records, ordered by city ID
+    uint64_t nameOffset; // Pool of city names referenced by the city records
+    uint64_t nameBytes;
+    uint64_t layerChecksum; // Over the layer block
+    uint64_t metadataChecksum; // Over the city table and name pool
+    uint64_t headerChecksum; // Over this header with headerChecksum set to 0
+};
+
+struct SnapshotCity
+{
+    int32_t cityId;
+    int32_t lowerLeftX, lowerLeftY;
+    int32_t topRightX, topRightY;
+    float avgAtmosphericPressure;
+    float avgCloudCover;
+    uint32_t nameLength;
+    uint64_t nameOffset; // Relative to SnapshotHeader::nameOffset
+    int64_t totalAtmosphericPressure;
+    int64_t totalCloudCover;
+    int64_t neighborhoodCells;
+};
+
+// FNV-1a over 64-bit words, then the remaining bytes. Data may be fed in pieces of any size.
+class SnapshotHasher
+{
+public:
+    void update(const unsigned char* data, size_t length)
+    {
+        while (length > 0 && pendingBytes > 0)
+        {
+            pending[pendingBytes++] = *data++;
+            length--;
+            if (pendingBytes == 8)
+            {
+                mixWord(pending);
+                pendingBytes = 0;
+            }
+        }
+        for (; length >= 8; data += 8, length -= 8)
+        {
+            mixWord(data);
+        }
+        memcpy(pending, data, length);
+        pendingBytes = length;
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t result = hash;
+        for (size_t i = 0; i < pendingBytes; i++)
+        {
+            result = (result ^ pending[i]) * 1099511628211ull;
+        }
+        return result;
+    }
+
+private:
+    void mixWord(const unsigned char* bytes)
+    {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    unsigned char pending[8] = {};
+    size_t pendingBytes = 0;
+};
+
+uint64_t snapshotChecksum(const unsigned char* data, size_t length)
+{
+    SnapshotHasher hasher;
+    hasher.update(data, length);
+    return hasher.digest();
+}
+
+uint64_t alignSnapshotOffset(uint64_t offset)
+{
+    return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+uint64_t headerChecksumOf(SnapshotHeader header)
+{
+    header.headerChecksum = 0;
+    return snapshotChecksum(reinterpret_cast<const unsigned char*>(&header), sizeof(header));
+}
+
+bool isSnapshotFile(const string& fileName)
+{
+    ifstream file(fileName, ios::binary);
+    char magic[sizeof(snapshotMagic)] = {};
+    return file.read(magic, sizeof(magic)) && memcmp(magic, snapshotMagic, sizeof(magic)) == 0;
+}
+
+bool saveSnapshot(const string& fileName, const RegionContext& region)
+{
+    const GridStore& grid = region.grid;
+    // City table and name pool are built first so their checksum can go into the header
+    std::vector<SnapshotCity> cities;
+    string names;
+    cities.reserve(region.cityDataMap.size());
+    for (const auto& cityData : region.cityDataMap)
+    {
+        const CityData& data = cityData.second;
+        cities.push_back(SnapshotCity{cityData.first,
+                                      data.lowerLeftCoord.first, data.lowerLeftCoord.second,
+                                      data.topRightCoord.first, data.topRightCoord.second,
+                                      data.avgAtmosphericPressure, data.avgCloudCover,
+                                      static_cast<uint32_t>(data.cityname.size()), names.size(),
+                                      data.totalAtmosphericPressure, data.totalCloudCover, data.neighborhoodCells});
+        names += data.cityname;
+    }
+    size_t cityTableBytes = cities.size() * sizeof(SnapshotCity);
+
+    SnapshotHeader header{};
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.gridXmin = region.gridXmin;
+    header.gridXmax = region.gridXmax;
+    header.gridYmin = region.gridYmin;
+    header.gridYmax = region.gridYmax;
+    header.numberOfDigits = region.numberOfDigits;
+    header.numberOfDigitsYaxis = region.numberOfDigitsYaxis;
+    header.leftPadding = region.leftPadding;
+    header.rightPadding = region.rightPadding;
+    bool layersInOneBlock = (grid.layerBlock() != nullptr); // Only the dense backend keeps the snapshot format in memory
+    header.layout = static_cast<uint32_t>(layersInOneBlock ? grid.layout() : GridLayout::RowMajor);
+    header.bytesPerCell = static_cast<uint32_t>(sizeof(int) + 2 * sizeof(float));
+    header.neighborhoodMode = static_cast<uint32_t>(neighborhoodMode);
+    header.cellCount = static_cast<uint64_t>(grid.width()) * static_cast<uint64_t>(grid.height());
+    header.layerOffset = alignSnapshotOffset(sizeof(SnapshotHeader));
+    header.layerBytes = grid.denseBytes(); // Sparse and compact grids are written out densely
+    header.cityCount = cities.size();
+    header.cityTableOffset = alignSnapshotOffset(header.layerOffset + header.layerBytes);
+    header.nameOffset = header.cityTableOffset + cityTableBytes; // Records are 8-byte sized
+    header.nameBytes = names.size();
+
+    string metadata(reinterpret_cast<const char*>(cities.data()), cityTableBytes);
+    metadata += names;
+    header.metadataChecksum = snapshotChecksum(reinterpret_cast<const unsigned char*>(metadata.data()), metadata.size());
+
+    ofstream file(fileName, ios::binary | ios::trunc);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    // The header is written again at the end, once the layer checksum is known
+    const char padding[8] = {};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(padding, static_cast<streamsize>(header.layerOffset - sizeof(header)));
+
+    SnapshotHasher layerHasher;
+    auto writeLayerBytes = [&](const void* data, size_t bytes) {
+        layerHasher.update(static_cast<const unsigned char*>(data), bytes);
+        file.write(static_cast<const char*>(data), static_cast<streamsize>(bytes));
+    };
+    if (layersInOneBlock)
+    {
+        writeLayerBytes(grid.layerBlock(), header.layerBytes);
+    }
+    else
+    {
+        // Stream each layer row by row (bottom row first, as a dense row-major grid stores it)
+        std::vector<int> cityRow(static_cast<size_t>(grid.width()));
+        std::vector<float> valueRow(static_cast<size_t>(grid.width()));
+        for (int layer = 0; layer < 3; layer++)
+        {
+            for (int y = 0; y < grid.height(); y++)
+            {
+                GridStore::RowView row = grid.row(y);
+                for (int x = 0; x < grid.width(); x++)
+                {
+                    if (layer == 0) cityRow[x] = row.cityId(x);
+                    else valueRow[x] = (layer == 1) ? row.cloud(x) : row.pressure(x);
+                }
+                if (layer == 0) writeLayerBytes(cityRow.data(), cityRow.size() * sizeof(int));
+                else writeLayerBytes(valueRow.data(), valueRow.size() * sizeof(float));
+            }
+        }
+    }
+    header.layerChecksum = layerHasher.digest();
+
+    file.write(padding, static_cast<streamsize>(header.cityTableOffset - (header.layerOffset + header.layerBytes)));
+    file.write(metadata.data(), static_cast<streamsize>(metadata.size()));
+
+    header.headerChecksum = headerChecksumOf(header);
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    return static_cast<bool>(file.flush());
+}
+
+// Restore a snapshot written by saveSnapshot. The layer checksum is only checked on request,
+// because it has to read every page of the grid; header and city metadata are always checked.
+LoadStatus loadSnapshot(const string& fileName, ostream& log, bool verifyLayers, RegionContext& region)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    std::unique_ptr<MappedFile> file(new MappedFile);
+    if (!file->open(fileName, true))
+    {
+        return LoadStatus::ConfigUnreadable;
+    }
+
+    SnapshotHeader header;
+    bool valid = file->size() >= sizeof(SnapshotHeader);
+    if (valid)
+    {
+        memcpy(&header, file->data(), sizeof(header));
+        valid = memcmp(header.magic, snapshotMagic, sizeof(header.magic)) == 0 &&
+                header.version == snapshotVersion && header.headerSize == sizeof(SnapshotHeader) &&
+                header.headerChecksum == headerChecksumOf(header) &&
+                header.bytesPerCell == sizeof(int) + 2 * sizeof(float) &&
+                header.gridXmax >= header.gridXmin && header.gridYmax >= header.gridYmin &&
+                header.cellCount == static_cast<uint64_t>(header.gridXmax - header.gridXmin + 1) * static_cast<uint64_t>(header.gridYmax - header.gridYmin + 1) &&
+                header.layerBytes == header.cellCount * header.bytesPerCell &&
+                header.layerOffset % 8 == 0 && header.layerOffset + header.layerBytes <= file->size() &&
+                header.cityTableOffset % 8 == 0 &&
+                header.nameOffset == header.cityTableOffset + header.cityCount * sizeof(SnapshotCity) &&
+                header.nameOffset + header.nameBytes <= file->size();
+    }
+    if (valid)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(file->data());
+        valid = snapshotChecksum(bytes + header.cityTableOffset, header.nameOffset + header.nameBytes - header.cityTableOffset) == header.metadataChecksum &&
+                (!verifyLayers || snapshotChecksum(bytes + header.layerOffset, header.layerBytes) == header.layerChecksum);
+    }
+    if (!valid)
+    {
+        cerr << "Error: " << fileName << " is not a valid snapshot (version " << snapshotVersion << ")." << endl;
+        return LoadStatus::ConfigUnreadable;
+    }
+
+    region.gridXmin = header.gridXmin;
+    region.gridXmax = header.gridXmax;
+    region.gridYmin = header.gridYmin;
+    region.gridYmax = header.gridYmax;
+    region.numberOfDigits = header.numberOfDigits;
+    region.numberOfDigitsYaxis = header.numberOfDigitsYaxis;
+    region.leftPadding = header.leftPadding;
+    region.rightPadding = header.rightPadding;
+
+    region.cityDataMap.clear();
+    region.cityIndexesStale = true;
+    if (&region == &mainRegion)
+    {
+        forecastCube.release(); // A snapshot holds the core layers only
+        resetDataLayers({});
+    }
+    const SnapshotCity* cities = reinterpret_cast<const SnapshotCity*>(file->data() + header.cityTableOffset);
+    const char* names = file->data() + header.nameOffset;
+    for (uint64_t c = 0; c < header.cityCount; c++)
+    {
+        const SnapshotCity& city = cities[c];
+        CityData& data = region.cityDataMap.emplace_hint(region.cityDataMap.end(), city.cityId, CityData())->second;
+        data.lowerLeftCoord = std::make_pair(city.lowerLeftX, city.lowerLeftY);
+        data.topRightCoord = std::make_pair(city.topRightX, city.topRightY);
+        data.avgAtmosphericPressure = city.avgAtmosphericPressure;
+        data.avgCloudCover = city.avgCloudCover;
+        data.totalAtmosphericPressure = city.totalAtmosphericPressure;
+        data.totalCloudCover = city.totalCloudCover;
+        data.neighborhoodCells = city.neighborhoodCells;
+        if (city.nameOffset + city.nameLength <= header.nameBytes)
+        {
+            data.cityname.assign(names + city.nameOffset, city.nameLength);
+        }
+    }
+
+    // The layers stay in the mapping; the summed-area tables are rebuilt only if a region query needs them
+    region.cloudCoverSums.clear();
+    region.pressureSums.clear();
+    invalidateClassifiedLayers(region);
+    region.grid.adopt(std::move(file), header.layerOffset, region.gridXmax - region.gridXmin + 1, region.gridYmax - region.gridYmin + 1,
+                      static_cast<GridLayout>(header.layout));
+    if (header.neighborhoodMode != static_cast<uint32_t>(neighborhoodMode))
+    {
+        log << "Recomputing city averages for the selected neighborhood mode\n";
+        computeCityAverages(region); // The stored totals cover other cells
+    }
+    else if (neighborhoodMode == NeighborhoodMode::Exact)
+    {
+        buildExactNeighborhoods(region); // Updates need the masks, the totals are already right
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - startTime;
+    log << "Reading in snapshot " << fileName << " ... done! (" << header.cityCount << " cities, "
+        << static_cast<long long>(elapsed.count()) << " ms)\n";
+    return LoadStatus::Loaded;
+}
+
+// Map modes selectable from the command line, numbered like printMap's option
+struct RenderMode
+{
+    const char* name;
+    int printMapOption;
+    const char* title;
+};
+
+const RenderMode renderModes[] = {
+    {"city", 1, "Display City Map"},
+    {"cloud-idx", 2, "Display Cloud Coverage Map (Cloudiness Index)"},
+    {"cloud-lmh", 3, "Display Cloud Coverage Map (LMH Symbol)"},
+    {"pressure-idx", 4, "Display atmospheric pressure map (Pressure Index)"},
+    {"pressure-lmh", 5, "Display atmospheric pressure map (LMH symbol)"},
+    {"rain", 6, "Display probability of rain map (Rain Index)"},
+};
+
+// A map selected by name: one of renderModes, or "<layer>-idx" / "<layer>-lmh" for a named layer
+struct MapSelection
+{
+    int printMapOption = 0; // 0 when the name is unknown
+    int layerIndex = -1;
+    bool lmh = false;
+    string title;
+};
+
+bool isLayerMapName(std::string_view name)
+{
+    return name.size() > 4 && (name.substr(name.size() - 4) == "-idx" || name.substr(name.size() - 4) == "-lmh");
+}
+
+MapSelection selectMap(std::string_view name)
+{
+    MapSelection map;
+    for (const RenderMode& mode : renderModes)
+    {
+        if (name == mode.name)
+        {
+            map.printMapOption = mode.printMapOption;
+            map.title = mode.title;
+            return map;
+        }
+    }
+    if (isLayerMapName(name))
+    {
+        map.layerIndex = findDataLayer(name.substr(0, name.size() - 4));
+        if (map.layerIndex >= 0)
+        {
+            map.printMapOption = layerMapOption;
+            map.lmh = (name.substr(name.size() - 4) == "-lmh");
+            map.title = "Display " + dataLayers[map.layerIndex].spec.name + " map" + (map.lmh ? " (LMH symbol)" : " (Index)");
+        }
+    }
+    return map;
+}
+
+// Render a selected map, loading its layer first if need be. Named layers always belong to mainRegion.
+void renderSelectedMap(ostream& out, const MapSelection& map, ostream& log, RegionContext& region = mainRegion)
+{
+    if (map.layerIndex >= 0)
+    {
+        renderMap(out, layerMapOption, dataLayerCodes(static_cast<size_t>(map.layerIndex), map.lmh, log));
+        return;
+    }
+    renderMap(out, map.printMapOption, nullptr, region);
+}
+
+// ---- Benchmark mode: generate a synthetic workload, then time each stage of the pipeline ----
+
+struct BenchmarkOptions
+{
+    int width = 1000; // Grid size in cells
+    int height = 1000;
+    int cities = 1000;
+    string cityShape = "mixed"; // square, wide, tall or mixed
+    int citySize = 4; // Largest side of a city, in cells
+    double fill = 1.0; // Fraction of cells listed in the cloud and pressure files
+    int runs = 5; // Timed runs, after one untimed warm-up run
+    unsigned seed = 251;
+    string directory; // Where the generated files go; empty uses a temporary directory
+};
+
+// Quote-safe copy of a string for a JSON string literal
+string jsonEscape(const string& text)
+{
+    string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\') escaped += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) continue; // Control characters never appear in file names we accept
+        escaped += c;
+    }
+    return escaped;
+}
+
+// Stream buffer that throws away its output and only counts it, so rendering is timed without a terminal
+class CountingBuffer : public std::streambuf
+{
+public:
+    size_t count() const { return written; }
+
+protected:
+    int overflow(int c) override
+    {
+        written += (c != EOF) ? 1 : 0;
+        return (c == EOF) ? 0 : c;
+    }
+    std::streamsize xsputn(const char*, std::streamsize length) override
+    {
+        written += static_cast<size_t>(length);
+        return length;
+    }
+
+private:
+    size_t written = 0;
+};
+
+// Write the config and the three data files of a synthetic workload, returns the config path
+string generateWorkload(const BenchmarkOptions& options, const string& directory)
+{
+    std::mt19937 random(options.seed);
+    auto uniform = [&](int low, int high) { return std::uniform_int_distribution<int>(low, high)(random); };
+    string buffer;
+    auto flushTo = [&](ofstream& out, bool force) {
+        if (force || buffer.size() >= (1u << 22))
+        {
+            out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
+    };
+
+    string cityPath = directory + "/bench_city.txt";
+    ofstream cityFile(cityPath, ios::binary);
+    for (int id = 1; id <= options.cities; id++)
+    {
+        int cityWidth = 1, cityHeight = 1;
+        string shape = options.cityShape;
+        if (shape == "mixed")
+        {
+            const char* shapes[] = {"square", "wide", "tall"};
+            shape = shapes[uniform(0, 2)];
+        }
+        int side = uniform(1, std::max(options.citySize, 1));
+        if (shape == "square") cityWidth = cityHeight = side;
+        else if (shape == "wide") cityWidth = side;
+        else cityHeight = side;
+        cityWidth = std::min(cityWidth, options.width);
+        cityHeight = std::min(cityHeight, options.height);
+
+        int x0 = uniform(0, options.width - cityWidth), y0 = uniform(0, options.height - cityHeight);
+        for (int y = y0; y < y0 + cityHeight; y++)
+        {
+            for (int x = x0; x < x0 + cityWidth; x++)
+            {
+                buffer += "[" + to_string(x) + ", " + to_string(y) + "]-" + to_string(id) + "-City" + to_string(id) + "\n";
+            }
+        }
+        flushTo(cityFile, false);
+    }
+    flushTo(cityFile, true);
+
+    std::bernoulli_distribution listed(options.fill);
+    const char* layerNames[] = {"/bench_cloud.txt", "/bench_pressure.txt"};
+    for (const char* layerName : layerNames)
+    {
+        ofstream layerFile(directory + layerName, ios::binary);
+        for (int y = 0; y < options.height; y++)
+        {
+            for (int x = 0; x < options.width; x++)
+            {
+                if (listed(random))
+                {
+                    buffer += "[" + to_string(x) + ", " + to_string(y) + "]-" + to_string(uniform(0, 99)) + "\n";
+                }
+            }
+            flushTo(layerFile, false);
+        }
+        flushTo(layerFile, true);
+    }
+
+    string configPath = directory + "/bench_config.txt";
+    ofstream configFile(configPath);
+    configFile << "// Synthetic benchmark workload, seed " << options.seed << "\n"
+               << "GridX_IdxRange=0-" << options.width - 1 << "\n"
+               << "GridY_IdxRange=0-" << options.height - 1 << "\n"
+               << cityPath << "\n" << directory << layerNames[0] << "\n" << directory << layerNames[1] << "\n";
+    return configFile ? configPath : string();
+}
+
+// Timings of one stage over every run, plus the work each run did (bytes and items, for throughput)
+struct StageTimings
+{
+    StageTimings(string name) : name(std::move(name)) {}
+
+    string name;
+    std::vector<double> seconds;
+    size_t bytes = 0;
+    size_t items = 0;
+};
+
+// Nearest-rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double rank)
+{
+    size_t index = static_cast<size_t>(std::ceil(rank / 100.0 * sorted.size()));
+    return sorted[std::min(std::max<size_t>(index, 1), sorted.size()) - 1];
+}
+
+void writeBenchmarkJson(ostream& out, const BenchmarkOptions& options, const std::vector<StageTimings>& stages, const RegionContext& region = mainRegion)
+{
+    const GridStore& grid = region.grid;
+    out << fixed << setprecision(3);
+    out << "{\n  \"workload\": {\"width\": " << options.width << ", \"height\": " << options.height
+        << ", \"cities\": " << options.cities << ", \"city_shape\": \"" << options.cityShape << "\", \"city_size\": " << options.citySize
+        << ", \"fill\": " << options.fill << ", \"seed\": " << options.seed << ", \"runs\": " << options.runs
+        << ", \"threads\": " << workerThreadCount() << ", \"grid\": \"" << (grid.isSparse() ? "sparse" : grid.isCompact() ? "compact" : "dense") << "\"},\n";
+    out << "  \"stages\": [\n";
+    for (size_t s = 0; s < stages.size(); s++)
+    {
+        const StageTimings& stage = stages[s];
+        std::vector<double> sorted = stage.seconds;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = 0;
+        for (double seconds : sorted) mean += seconds;
+        mean /= static_cast<double>(sorted.size());
+        double median = std::max(percentile(sorted, 50), 1e-9);
+
+        out << "    {\"stage\": \"" << stage.name << "\", \"bytes\": " << stage.bytes << ", \"items\": " << stage.items
+            << ", \"min_ms\": " << sorted.front() * 1e3 << ", \"p50_ms\": " << percentile(sorted, 50) * 1e3
+            << ", \"p90_ms\": " << percentile(sorted, 90) * 1e3 << ", \"p99_ms\": " << percentile(sorted, 99) * 1e3
+            << ", \"max_ms\": " << sorted.back() * 1e3 << ", \"mean_ms\": " << mean * 1e3
+            << ", \"mb_per_s\": " << static_cast<double>(stage.bytes) / median / 1e6
+            << ", \"items_per_s\": " << static_cast<double>(stage.items) / median << "}"
+            << (s + 1 < stages.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// Generate the workload, run the whole pipeline options.runs times and print the timings as JSON.
+// The three data files are ingested one at a time here so each file type gets its own figure.
+int runBenchmark(const BenchmarkOptions& options, RegionContext& region = mainRegion)
+{
+    string directory = options.directory;
+    bool temporary = directory.empty();
+    if (temporary)
+    {
+        char pattern[] = "/tmp/wips-bench-XXXXXX";
+        if (mkdtemp(pattern) == nullptr)
+        {
+            cerr << "Error: Unable to create a directory for the benchmark files.\n";
+            return ExitOutputFailed;
+        }
+        directory = pattern;
+    }
+
+    string configPath = generateWorkload(options, directory);
+    if (configPath.empty())
+    {
+        cerr << "Error: Unable to write the benchmark files to " << directory << '\n';
+        return ExitOutputFailed;
+    }
+
+    std::vector<StageTimings> stages = {{"config"}, {"ingest-city"}, {"ingest-cloud"}, {"ingest-pressure"}, {"averages"}};
+    for (const RenderMode& mode : renderModes)
+    {
+        stages.push_back({string("render-") + mode.name});
+    }
+    stages.push_back({"summary"});
+
+    ostream nullLog(nullptr);
+    for (int run = 0; run <= options.runs; run++) // Run 0 warms up the page cache and is not recorded
+    {
+        size_t stage = 0;
+        auto timed = [&](auto work) {
+            auto started = std::chrono::steady_clock::now();
+            work();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+            if (run > 0)
+            {
+                stages[stage].seconds.push_back(elapsed.count());
+            }
+            stage++;
+        };
+
+        ConfigFile config;
+        std::vector<IngestRequest> requests;
+        timed([&]() {
+            region.grid.release();
+            region.cityDataMap.clear();
+            region.cityIndexesStale = true;
+            parseConfigFile(configPath, config, region);
+            requests = dataFileRequests(config, nullLog);
+            setupGrid(requests, nullLog, region);
+        });
+        for (const IngestRequest& request : requests)
+        {
+            timed([&]() { ingestDataFiles({request}, nullLog, region); });
+        }
+        timed([&]() {
+            buildSummedAreaTables(region);
+            computeCityAverages(region);
+        });
+        for (const RenderMode& mode : renderModes)
+        {
+            CountingBuffer counter;
+            ostream out(&counter);
+            timed([&]() { renderMap(out, mode.printMapOption, nullptr, region); });
+            stages[stage - 1].bytes = counter.count();
+            stages[stage - 1].items = static_cast<size_t>(region.grid.width()) * static_cast<size_t>(region.grid.height());
+        }
+        CountingBuffer counter;
+        ostream out(&counter);
+        timed([&]() { writeSummary(out, region); });
+        stages[stage - 1].bytes = counter.count();
+        stages[stage - 1].items = region.cityDataMap.size();
+    }
+
+    // Input sizes for the loading stages
+    struct stat info;
+    if (stat(configPath.c_str(), &info) == 0) stages[0].bytes = static_cast<size_t>(info.st_size);
+    const char* files[] = {"/bench_city.txt", "/bench_cloud.txt", "/bench_pressure.txt"};
+    for (int f = 0; f < 3; f++)
+    {
+        string path = directory + files[f];
+        if (stat(path.c_str(), &info) == 0) stages[1 + f].bytes = static_cast<size_t>(info.st_size);
+        MappedFile file;
+        if (file.open(path)) stages[1 + f].items = static_cast<size_t>(std::count(file.data(), file.data() + file.size(), '\n'));
+    }
+    stages[0].items = 1;
+    stages[4].items = region.cityDataMap.size();
+
+    writeBenchmarkJson(cout, options, stages, region);
+
+    if (temporary)
+    {
+        for (const char* file : files)
+        {
+            unlink((directory + file).c_str());
+        }
+        unlink(configPath.c_str());
+        rmdir(directory.c_str());
+    }
+    cout.flush();
+    return cout ? ExitOk : ExitOutputFailed;
+}
+
+// Statistics of the latest load as JSON (--stats and menu option 10)
+void writeStatsJson(ostream& out)
+{
+    const char* fileKind[] = {"city", "cloud", "pressure"};
+    ios::fmtflags savedFlags = out.flags();
+    streamsize savedPrecision = out.precision();
+    out << fixed << setprecision(6);
+    out << "{\n  \"phases\": {\"config_s\": " << loadStats.configSeconds << ", \"ingest_s\": " << loadStats.ingestSeconds
+        << ", \"diagnostics_s\": " << loadStats.diagnosticsSeconds << ", \"averages_s\": " << loadStats.averagesSeconds << "},\n";
+    out << "  \"files\": [\n";
+    for (size_t f = 0; f < loadStats.files.size(); f++)
+    {
+        const FileLoadStats& file = loadStats.files[f];
+        out << "    {\"file\": \"" << jsonEscape(file.filename) << "\", \"kind\": \"" << fileKind[file.fileDataType]
+            << "\", \"bytes\": " << file.bytes << ", \"lines\": " << file.lines << ", \"out_of_bounds\": " << file.outOfBounds
+            << ", \"invalid_values\": " << file.invalidValues << ", \"parse_s\": " << file.parseSeconds << "}"
+            << (f + 1 < loadStats.files.size() ? ",\n" : "\n");
+    }
+    out << "  ],\n  \"peak_grid_bytes\": " << loadStats.peakGridBytes << ",\n  \"cities_aggregated\": " << loadStats.citiesAggregated
+        << ",\n  \"threads\": " << workerThreadCount() << "\n}\n";
+    out.flags(savedFlags);
+    out.precision(savedPrecision);
+}
+
+// ---- Server mode: keep the loaded state resident and answer requests over a Unix domain socket ----
+//
+// One request per line; every request gets "OK <bytes>\n" followed by exactly that many bytes of
+// answer, or a single "ERR <message>\n" line. Requests may be pipelined on one connection.
+//   SUMMARY <cityId>             the city's weather forecast summary report
+//   CELL <x> <y>                 "<cityId> <cloud cover> <pressure>\n" (cityId -1 outside cities)
+//   REGION <x0> <y0> <x1> <y1>   "<average cloud cover> <average pressure>\n" over the rectangle
+//   MAP <name>                   a rendered map: city, cloud-idx, cloud-lmh, pressure-idx, pressure-lmh,
+//                                rain, or <layer>-idx / <layer>-lmh for a named config layer
+//   VIEW <name> <x0> <y0> <x1> <y1> [<n>]  a viewport of a core map, n x n cells per symbol
+//                                (rounded up to a power of two; default: fit within 100 columns)
+//   VALUE <layer> <x> <y>        "<value>\n", the cell's value in a named config layer
+//   QUERY <query>                a city index query, as for --query
+//   QUIT                         close the connection
+//   SHUTDOWN                     stop the server
+// The named layers are read before serving and the classified layers and the pyramid are published
+// through atomics once built, so requests for what is already built take no lock and only read the
+// loaded state. With --watch a reload builds a new version beside it and swaps it in (see
+// publishServedVersion). Named layers are not reloaded: layer maps and VALUE keep answering from their files as first read, and are
+// refused once a reload changes the grid ranges.
+
+std::atomic<bool> serverStopping{false};
+int serverListener = -1;
+const size_t serverMaxRequestBytes = 4096;
+const int serverSendTimeoutSeconds = 10; // A client that reads none of a response for this long is dropped
+
+// A reloaded configuration: its own region, with the city indexes QUERY needs. Named layers are not
+// reloaded: the cities' averages of them are recomputed for the new region, and VALUE and the
+// layer maps keep reading the layers as first loaded, until the grid ranges change.
+struct ServedVersion
+{
+    RegionContext region;
+    unsigned generation = 0; // Reloads so far
+};
+
+// Epoch based reclamation of replaced versions. A server thread copies serverEpoch into its slot
+// before it loads servedVersion and clears the slot when its requests are answered; a version
+// swapped out at epoch E is freed once no slot holds a nonzero epoch below E. Readers never wait.
+struct alignas(64) ReaderEpoch
+{
+    std::atomic<uint64_t> epoch{0}; // 0 while the thread is between requests
+};
+
+std::atomic<ServedVersion*> servedVersion{nullptr}; // Null until the first reload: mainRegion is served
+std::atomic<uint64_t> serverEpoch{1};
+std::vector<ReaderEpoch> readerEpochs; // One per server thread, sized before they start
+
+void stopServer(int)
+{
+    serverStopping = true;
+    shutdown(serverListener, SHUT_RDWR); // Wakes the poll loop
+}
+
+// Read exactly count space separated integers
+bool readInts(std::string_view text, int* values, size_t count)
+{
+    const char* cursor = text.data();
+    const char* end = cursor + text.size();
+    for (size_t n = 0; n < count; n++)
+    {
+        while (cursor < end && *cursor == ' ') cursor++;
+        auto [next, ec] = std::from_chars(cursor, end, values[n]);
+        if (ec != std::errc())
+        {
+            return false;
+        }
+        cursor = next;
+    }
+    while (cursor < end && *cursor == ' ') cursor++;
+    return cursor == end;
+}
+
+string okResponse(const string& answer)
+{
+    return "OK " + to_string(answer.size()) + "\n" + answer;
+}
+
+// Answer one request from region, the version the connection pinned for it
+string handleServerRequest(std::string_view request, bool& closeConnection, RegionContext& region)
+{
+    const GridStore& grid = region.grid;
+    int gridXmin = region.gridXmin, gridYmin = region.gridYmin;
+    size_t space = request.find(' ');
+    std::string_view command = request.substr(0, space);
+    std::string_view arguments = (space == std::string_view::npos) ? std::string_view() : request.substr(space + 1);
+    int numbers[4];
+
+    if (command == "SUMMARY")
+    {
+        auto city = readInts(arguments, numbers, 1) ? region.cityDataMap.find(numbers[0]) : region.cityDataMap.end();
+        if (city == region.cityDataMap.end())
+        {
+            return "ERR unknown city\n";
+        }
+        ostringstream answer;
+        ostream nullLog(nullptr);
+        ensureAllDataLayers(nullLog); // The report covers every named layer
+        writeCitySummary(answer, city->first, city->second);
+        return okResponse(answer.str());
+    }
+    if (command == "CELL")
+    {
+        if (!readInts(arguments, numbers, 2))
+        {
+            return "ERR usage: CELL <x> <y>\n";
+        }
+        int x = numbers[0] - gridXmin, y = numbers[1] - gridYmin;
+        if (grid.empty() || x < 0 || y < 0 || x >= grid.width() || y >= grid.height())
+        {
+            return "ERR out of bounds\n";
+        }
+        string answer;
+        appendNumber(answer, grid.cityIdAt(x, y));
+        answer += ' ';
+        appendNumber(answer, static_cast<long long>(grid.cloudAt(x, y)));
+        answer += ' ';
+        appendNumber(answer, static_cast<long long>(grid.pressureAt(x, y)));
+        answer += '\n';
+        return okResponse(answer);
+    }
+    if (command == "REGION")
+    {
+        float avgCloudCover, avgAtmosphericPressure;
+        if (!readInts(arguments, numbers, 4))
+        {
+            return "ERR usage: REGION <x0> <y0> <x1> <y1>\n";
+        }
+        if (!regionAverage(numbers[0], numbers[1], numbers[2], numbers[3], avgCloudCover, avgAtmosphericPressure, region))
+        {
+            return "ERR region outside the grid\n";
+        }
+        char answer[64];
+        snprintf(answer, sizeof(answer), "%.2f %.2f\n", avgCloudCover, avgAtmosphericPressure);
+        return okResponse(answer);
+    }
+    if (command == "MAP")
+    {
+        MapSelection map = selectMap(arguments);
+        if (map.printMapOption == 0 || grid.empty())
+        {
+            return "ERR unknown map\n";
+        }
+        if (map.layerIndex >= 0 && !sharesNamedLayers(region))
+        {
+            return "ERR named layers are not reloaded and the grid ranges changed\n";
+        }
+        ostringstream answer;
+        ostream nullLog(nullptr);
+        renderSelectedMap(answer, map, nullLog, region);
+        return okResponse(answer.str());
+    }
+    if (command == "VIEW")
+    {
+        size_t space = arguments.find(' ');
+        MapSelection map = selectMap(arguments.substr(0, space));
+        MapViewport view;
+        int viewNumbers[5]; // Rectangle, then the optional zoom
+        std::string_view bounds = (space == std::string_view::npos) ? std::string_view() : arguments.substr(space + 1);
+        bool zoomGiven = readInts(bounds, viewNumbers, 5);
+        if (map.layerIndex >= 0 || map.printMapOption == 0 || (!zoomGiven && !readInts(bounds, viewNumbers, 4)))
+        {
+            return "ERR usage: VIEW <name> <x0> <y0> <x1> <y1> [<cells per symbol>]\n";
+        }
+        view.x0 = viewNumbers[0];
+        view.y0 = viewNumbers[1];
+        view.x1 = viewNumbers[2];
+        view.y1 = viewNumbers[3];
+        if (zoomGiven)
+        {
+            view.zoomLevel = 0;
+            while ((1LL << view.zoomLevel) < std::max(viewNumbers[4], 1)) view.zoomLevel++;
+        }
+        ostringstream answer;
+        if (!renderViewport(answer, map.printMapOption, view, region))
+        {
+            return "ERR viewport outside the grid\n";
+        }
+        return okResponse(answer.str());
+    }
+    if (command == "VALUE")
+    {
+        size_t space = arguments.find(' ');
+        int layerIndex = findDataLayer(arguments.substr(0, space));
+        if (layerIndex < 0 || space == std::string_view::npos)
+        {
+            return "ERR usage: VALUE <layer> <x> <y>\n";
+        }
+        if (!readInts(arguments.substr(space + 1), numbers, 2))
+        {
+            return "ERR usage: VALUE <layer> <x> <y>\n";
+        }
+        if (!sharesNamedLayers(region))
+        {
+            return "ERR named layers are not reloaded and the grid ranges changed\n";
+        }
+        int x = numbers[0] - mainRegion.gridXmin, y = numbers[1] - mainRegion.gridYmin;
+        if (mainRegion.grid.empty() || x < 0 || y < 0 || x >= mainRegion.grid.width() || y >= mainRegion.grid.height())
+        {
+            return "ERR out of bounds\n";
+        }
+        ostream nullLog(nullptr);
+        ensureDataLayer(static_cast<size_t>(layerIndex), nullLog);
+        string answer;
+        appendNumber(answer, dataLayers[layerIndex].values[mainRegion.grid.index(x, y)]);
+        answer += '\n';
+        return okResponse(answer);
+    }
+    if (command == "QUERY")
+    {
+        CityQuery query;
+        if (!parseCityQuery(arguments, query))
+        {
+            return "ERR invalid query\n";
+        }
+        string answer;
+        answerCityQuery(arguments, query, answer, region);
+        return okResponse(answer);
+    }
+    if (command == "QUIT")
+    {
+        closeConnection = true;
+        return okResponse("");
+    }
+    if (command == "SHUTDOWN")
+    {
+        closeConnection = true;
+        stopServer(0);
+        return okResponse("");
+    }
+    return "ERR unknown request\n";
+}
+
+// Send all of data, giving up on a client that takes none of it for serverSendTimeoutSeconds or
+// when the server stops (each send waits at most a second, see runServer)
+bool sendAll(int socketFd, const string& data)
+{
+    size_t sent = 0;
+    int stalledSeconds = 0;
+    while (sent < data.size())
+    {
+        ssize_t written = send(socketFd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !serverStopping && ++stalledSeconds < serverSendTimeoutSeconds)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        sent += static_cast<size_t>(written);
+        stalledSeconds = 0;
+    }
+    return true;
+}
+
+// A client connection and the start of its next request, received so far
+struct ServerConnection
+{
+    int socket = -1;
+    string pending;
+};
+
+// Connections with a request to read, from the poll loop to the worker threads, and connections
+// the workers have answered, back to the poll loop. A connection is in at most one of the two, or
+// with one worker, so its requests are answered in order.
+class ServerQueue
+{
+public:
+    ServerQueue() : wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    ~ServerQueue() { if (wakeup >= 0) close(wakeup); }
+
+    int wakeupFd() const { return wakeup; }
+
+    void pushReadable(ServerConnection* connection)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        readable.push_back(connection);
+        notEmpty.notify_one();
+    }
+
+    // Next connection to read, or null once the queue is closed
+    ServerConnection* popReadable()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait(guard, [&]() { return !readable.empty() || closed; });
+        if (closed)
+        {
+            return nullptr;
+        }
+        ServerConnection* connection = readable.front();
+        readable.pop_front();
+        return connection;
+    }
+
+    // Hand an answered connection back to the poll loop and wake it
+    void pushIdle(ServerConnection* connection)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            idle.push_back(connection);
+        }
+        uint64_t one = 1;
+        ssize_t written = write(wakeup, &one, sizeof(one));
+        (void)written; // The counter only overflows after 2^64 wakeups
+    }
+
+    void takeIdle(std::vector<ServerConnection*>& into)
+    {
+        uint64_t count;
+        ssize_t length = read(wakeup, &count, sizeof(count));
+        (void)length; // Nothing to read when another wakeup already drained it
+        std::lock_guard<std::mutex> guard(lock);
+        into.insert(into.end(), idle.begin(), idle.end());
+        idle.clear();
+    }
+
+    // Stop the workers; the connections still queued are returned for closing
+    void stop(std::vector<ServerConnection*>& remaining)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        remaining.insert(remaining.end(), readable.begin(), readable.end());
+        remaining.insert(remaining.end(), idle.begin(), idle.end());
+        readable.clear();
+        idle.clear();
+        notEmpty.notify_all();
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable notEmpty;
+    std::deque<ServerConnection*> readable;
+    std::vector<ServerConnection*> idle;
+    bool closed = false;
+    int wakeup;
+};
+
+// Read what the client has sent and answer every complete request in it. Returns false when the
+// connection is to be closed.
+bool serveRequests(ServerConnection& connection, ReaderEpoch& reader)
+{
+    char received[4096];
+    ssize_t length = recv(connection.socket, received, sizeof(received), MSG_DONTWAIT);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return true; // More of the request is still on its way
+    }
+    if (length <= 0)
+    {
+        return false;
+    }
+    string& pending = connection.pending;
+    pending.append(received, static_cast<size_t>(length));
+
+    // Every request received together is answered from the same version
+    reader.epoch.store(serverEpoch.load());
+    ServedVersion* version = servedVersion.load();
+    RegionContext& region = version ? version->region : mainRegion;
+    string responses;
+    bool closeConnection = false;
+    size_t lineStart = 0, newline;
+    while (!closeConnection && (newline = pending.find('\n', lineStart)) != string::npos)
+    {
+        std::string_view request(pending.data() + lineStart, newline - lineStart);
+        if (!request.empty() && request.back() == '\r')
+        {
+            request.remove_suffix(1);
+        }
+        responses += handleServerRequest(request, closeConnection, region);
+        lineStart = newline + 1;
+    }
+    reader.epoch.store(0);
+    pending.erase(0, lineStart);
+    if (pending.size() > serverMaxRequestBytes)
+    {
+        responses += "ERR request too long\n";
+        closeConnection = true;
+    }
+    return sendAll(connection.socket, responses) && !closeConnection && !serverStopping;
+}
+
+// Make fresh the served version. Requests that already pinned the old one finish on it; once every
+// server thread has moved past them the old version is freed here, on the reloading thread.
+void publishServedVersion(ServedVersion* fresh)
+{
+    ServedVersion* old = servedVersion.exchange(fresh);
+    uint64_t retired = serverEpoch.fetch_add(1) + 1; // Threads that read this epoch or later see fresh
+    for (ReaderEpoch& reader : readerEpochs)
+    {
+        uint64_t epoch;
+        while ((epoch = reader.epoch.load()) != 0 && epoch < retired)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    delete old;
+}
+
+// Load the configuration again into a new version and publish it. Caches the current version has
+// built (map symbol layers, pyramid) are built for the new one first, so no request pays for them.
+// A load that fails or misses a data file keeps the current version.
+bool reloadServedVersion(const string& configFile, ostream& log)
+{
+    auto started = std::chrono::steady_clock::now();
+    ServedVersion* current = servedVersion.load(); // Only this thread replaces it, so it stays valid here
+    RegionContext& currentRegion = current ? current->region : mainRegion;
+    std::unique_ptr<ServedVersion> fresh(new ServedVersion);
+    fresh->generation = current ? current->generation + 1 : 1;
+    ostream nullLog(nullptr);
+    if (loadRegion(fresh->region, configFile, nullLog) != LoadStatus::Loaded)
+    {
+        log << "Reload of " << configFile << " failed, still serving the previous data" << '\n' << flush;
+        return false;
+    }
+
+    RegionContext& region = fresh->region;
+    if (sharesNamedLayers(region))
+    {
+        // runServer read every named layer before serving, so their values are no longer written
+        // and are averaged here without dataLayersLock; the averages go out with the new version
+        for (size_t l = 0; l < dataLayers.size(); l++)
+        {
+            if (dataLayers[l].read) averageDataLayer(dataLayers[l], l, mainRegion.grid, region); // The cities and their cells may have changed
+        }
+    }
+    else
+    {
+        log << "The grid ranges changed, named layers are no longer served" << '\n';
+    }
+    ensureCityIndexes(region);
+
+    for (int option = 2; option <= 6; option++)
+    {
+        if (currentRegion.classifiedLayers.ready[option].load(std::memory_order_acquire)) classifiedLayer(option, region);
+    }
+    if (currentRegion.mapPyramid.built.load(std::memory_order_acquire))
+    {
+        ensureMapPyramid(region);
+    }
+
+    unsigned generation = fresh->generation;
+    publishServedVersion(fresh.release());
+    char seconds[32];
+    snprintf(seconds, sizeof(seconds), "%.3f", std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+    log << "Reloaded " << configFile << " (version " << generation << ") in " << seconds << "s" << '\n' << flush;
+    return true;
+}
+
+// --watch: wait for the configuration's city, cloud or pressure file to be rewritten, in place or
+// by renaming a new file over it, and reload. The directories are watched rather than the files
+// so a replaced file is still seen; events are collected until none arrive for reloadQuietMs, so
+// several files written one after another cause a single reload.
+void watchDataFiles(const string& configFile, ostream& log)
+{
+    const int reloadQuietMs = 200;
+    ConfigFile config;
+    RegionContext scratch; // Only the file names are wanted
+    int watcher = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher < 0 || !parseConfigFile(configFile, config, scratch))
+    {
+        cerr << "Error: Unable to watch the data files of " << configFile << '\n';
+        if (watcher >= 0) close(watcher);
+        return;
+    }
+
+    std::vector<std::pair<int, string>> watched; // Directory watch and file name
+    for (const string& path : {config.citylocFilePath, config.cloudcoverageFilePath, config.pressureFilePath})
+    {
+        if (path.empty())
+        {
+            continue;
+        }
+        size_t slash = path.find_last_of('/');
+        string directory = (slash == string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        int watch = inotify_add_watch(watcher, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (watch < 0)
+        {
+            cerr << "Error: Unable to watch " << directory << ": " << strerror(errno) << '\n';
+            continue;
+        }
+        watched.push_back({watch, path.substr(slash == string::npos ? 0 : slash + 1)});
+    }
+    log << "Watching the data files of " << configFile << '\n' << flush;
+
+    alignas(inotify_event) char events[4096];
+    bool changed = false;
+    while (!serverStopping)
+    {
+        pollfd poller{watcher, POLLIN, 0};
+        int ready = poll(&poller, 1, changed ? reloadQuietMs : 1000); // Wake up once a second to notice a shutdown
+        if (ready > 0)
+        {
+            ssize_t length;
+            while ((length = read(watcher, events, sizeof(events))) > 0)
+            {
+                for (char* cursor = events; cursor < events + length;)
+                {
+                    const inotify_event* event = reinterpret_cast<const inotify_event*>(cursor);
+                    for (const auto& file : watched)
+                    {
+                        changed |= (event->len > 0 && event->wd == file.first && file.second == event->name);
+                    }
+                    cursor += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+        else if (ready == 0 && changed)
+        {
+            changed = false;
+            reloadServedVersion(configFile, log);
+        }
+    }
+    close(watcher);
+}
+
+// Listen on socketPath until SHUTDOWN, SIGINT or SIGTERM. This thread polls the listener and the
+// open connections and hands each connection with a request to read to a pool of worker threads,
+// so idle clients hold no thread and any number of connections can stay open.
+// With a non-empty watchConfig the data files it names are watched and reloaded while serving.
+int runServer(const string& socketPath, ostream& log, const string& watchConfig = "")
+{
+    // Build everything the requests read lazily now, while nothing else is running
+    if (gridUsesSummedAreaTables() && !mainRegion.grid.empty() && mainRegion.cloudCoverSums.empty())
+    {
+        buildSummedAreaTables();
+    }
+    ensureCityIndexes();
+    ensureAllDataLayers(log); // Requests then never write city averages, and reloads average the layers over their own cities
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Error: Socket path too long: " << socketPath << '\n';
+        return ExitUsage;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    struct stat info;
+    if (lstat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        unlink(socketPath.c_str()); // Left behind by an earlier server
+    }
+    serverListener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverListener < 0 || bind(serverListener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(serverListener, 64) != 0)
+    {
+        cerr << "Error: Unable to listen on " << socketPath << ": " << strerror(errno) << '\n';
+        if (serverListener >= 0) close(serverListener);
+        return ExitOutputFailed;
+    }
+
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    log << "Serving on " << socketPath << '\n' << flush;
+
+    ServerQueue queue;
+    auto workerLoop = [&](ReaderEpoch& reader) {
+        while (ServerConnection* connection = queue.popReadable())
+        {
+            if (serveRequests(*connection, reader))
+            {
+                queue.pushIdle(connection);
+            }
+            else
+            {
+                close(connection->socket);
+                delete connection;
+            }
+        }
+    };
+    unsigned threadCount = std::max(4u, workerThreadCount());
+    std::vector<ReaderEpoch>(threadCount).swap(readerEpochs);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back(workerLoop, std::ref(readerEpochs[t]));
+    }
+    std::thread watchThread;
+    if (!watchConfig.empty())
+    {
+        watchThread = std::thread(watchDataFiles, watchConfig, std::ref(log));
+    }
+
+    // Poll the listener and every connection waiting for its next request; a connection with
+    // something to read leaves the poll set for a worker until its requests are answered
+    std::vector<ServerConnection*> waiting;
+    std::vector<pollfd> pollers;
+    while (!serverStopping)
+    {
+        pollers.assign({{serverListener, POLLIN, 0}, {queue.wakeupFd(), POLLIN, 0}});
+        for (ServerConnection* connection : waiting)
+        {
+            pollers.push_back({connection->socket, POLLIN, 0});
+        }
+        if (poll(pollers.data(), pollers.size(), 1000) <= 0) // Wake up once a second to notice a shutdown
+        {
+            continue;
+        }
+
+        size_t kept = 0;
+        for (size_t c = 0; c < waiting.size(); c++)
+        {
+            if (pollers[c + 2].revents != 0)
+            {
+                queue.pushReadable(waiting[c]);
+            }
+            else
+            {
+                waiting[kept++] = waiting[c];
+            }
+        }
+        waiting.resize(kept);
+        if (pollers[1].revents != 0)
+        {
+            queue.takeIdle(waiting);
+        }
+        if (pollers[0].revents != 0 && !serverStopping)
+        {
+            int client = accept4(serverListener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                timeval pollInterval{1, 0}; // A client that stops reading holds a worker for serverSendTimeoutSeconds at most
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &pollInterval, sizeof(pollInterval));
+                waiting.push_back(new ServerConnection{client, string()});
+            }
+        }
+    }
+
+    queue.stop(waiting);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    queue.takeIdle(waiting); // Answered while the workers were finishing
+    for (ServerConnection* connection : waiting)
+    {
+        close(connection->socket);
+        delete connection;
+    }
+    if (watchThread.joinable())
+    {
+        watchThread.join();
+    }
+    delete servedVersion.exchange(nullptr);
+
+    close(serverListener);
+    serverListener = -1;
+    unlink(socketPath.c_str());
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    log << "Server stopped" << '\n';
+    return ExitOk;
+}
+
+// One configuration of a --regions run. Its progress, validation messages and summary are kept
+// as text so the regions can load in any order and still print in list order.
+struct RegionJob
+{
+    RegionJob(string configPath) : configPath(std::move(configPath)) {}
+
+    string configPath;
+    size_t inputBytes = 0; // Config plus the data files it names, for scheduling
+    LoadStatus status = LoadStatus::Loaded;
+    string log;
+    string errors;
+    string summary;
+};
+
+size_t regionInputBytes(const string& configPath)
+{
+    ConfigFile config;
+    RegionContext scratch; // Only the file names are wanted, the ranges are parsed again on load
+    struct stat info;
+    size_t bytes = (stat(configPath.c_str(), &info) == 0) ? static_cast<size_t>(info.st_size) : 0;
+    if (!parseConfigFile(configPath, config, scratch)) {
+        return bytes;
+    }
+    for (const string& path : {config.citylocFilePath, config.cloudcoverageFilePath, config.pressureFilePath}) {
+        if (!path.empty() && stat(path.c_str(), &info) == 0) {
+            bytes += static_cast<size_t>(info.st_size);
+        }
+    }
+    return bytes;
+}
+
+// Load, aggregate and summarize one region, then drop its grid so only the text stays in memory
+void runRegionJob(RegionJob& job)
+{
+    RegionContext region;
+    ostringstream log, errors, summary;
+    region.errors = &errors;
+    job.status = loadRegion(region, job.configPath, log);
+    if (job.status != LoadStatus::ConfigUnreadable) {
+        writeSummary(summary, region);
+    }
+    job.log = log.str();
+    job.errors = errors.str();
+    job.summary = summary.str();
+}
+
+// Batch driver for many configurations in one process. Regions are taken largest input first
+// (longest processing time first): a region with at least a worker's share of all the input runs
+// alone with every thread on its own loops, the smaller ones then run side by side, one region
+// per worker with its inner loops inline, so neither a few big grids nor many tiny ones leave
+// threads idle. Output is written in list order, to stdout or to DIR/<config>.summary.txt.
+int runRegions(const string& listFile, const string& outputDir, bool quiet)
+{
+    ifstream list(listFile);
+    if (!list.is_open()) {
+        cerr << "Error: Unable to open file! " << listFile << '\n';
+        return ExitConfigUnreadable;
+    }
+    std::vector<RegionJob> jobs;
+    string line;
+    while (getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] != '#') {
+            jobs.push_back(RegionJob{line});
+        }
+    }
+
+    size_t totalBytes = 0;
+    for (RegionJob& job : jobs) {
+        job.inputBytes = regionInputBytes(job.configPath);
+        totalBytes += job.inputBytes;
+    }
+    std::vector<RegionJob*> order;
+    for (RegionJob& job : jobs) {
+        order.push_back(&job);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const RegionJob* a, const RegionJob* b) { return a->inputBytes > b->inputBytes; });
+
+    size_t workers = workerThreadCount();
+    size_t largeRegions = 0;
+    while (largeRegions < order.size() && order[largeRegions]->inputBytes * workers >= totalBytes && workers > 1) {
+        runRegionJob(*order[largeRegions++]);
+    }
+    parallelForStealing(order.size() - largeRegions, 1, [&](size_t r) {
+        bool wasNested = nestedWorker;
+        nestedWorker = true;
+        runRegionJob(*order[largeRegions + r]);
+        nestedWorker = wasNested;
+    });
+
+    int exitStatus = ExitOk; // An unreadable config outranks a missing data file
+    for (const RegionJob& job : jobs) {
+        cerr << job.errors;
+        if (job.status == LoadStatus::ConfigUnreadable) {
+            cerr << "Error: Unable to open file! " << job.configPath << '\n';
+            exitStatus = ExitConfigUnreadable;
+            continue;
+        }
+        if (job.status == LoadStatus::DataIncomplete && exitStatus == ExitOk) {
+            exitStatus = ExitDataIncomplete;
+        }
+
+        cout << "=== Region " << job.configPath << " ===" << '\n';
+        if (!quiet) {
+            cout << job.log;
+        }
+        if (outputDir.empty()) {
+            cout << job.summary;
+            continue;
+        }
+        size_t slash = job.configPath.find_last_of('/');
+        string outputPath = outputDir + "/" + job.configPath.substr(slash == string::npos ? 0 : slash + 1) + ".summary.txt";
+        ofstream output(outputPath);
+        output << job.summary;
+        if (!output) {
+            cerr << "Error: Unable to write summary to " << outputPath << '\n';
+            return ExitOutputFailed;
+        }
+        cout << "Summary written to " << outputPath << '\n';
+    }
+    cout.flush();
+    return cout ? exitStatus : ExitOutputFailed;
+}
+
+void printUsage(ostream& out, const char* program)
+{
+    out << "Usage: " << program << " --config FILE [options]\n"
+        << "       " << program << "                      (interactive menu)\n\n"
+        << "  --config FILE     configuration file to read and process (option 1)\n"
+        << "  --regions LIST    instead of --config: load and summarize every configuration listed in LIST\n"
+        << "                    (one path per line) in one process, sharing the worker threads\n"
+        << "  --region-out DIR  with --regions: write each summary to DIR/<config name>.summary.txt\n"
+        << "  --render LIST     comma separated maps: city, cloud-idx, cloud-lmh, pressure-idx, pressure-lmh, rain,\n"
+        << "                    or <layer>-idx, <layer>-lmh for a layer the config names (Layer_<name>=<file>)\n"
+        << "  --viewport X0,Y0,X1,Y1 render only this rectangle (grid coordinates) of each --render map, zoomed\n"
+        << "                    out through a level of detail pyramid and labelled with grid coordinates\n"
+        << "  --zoom N          with the viewport: N x N cells per symbol (rounded up to a power of two)\n"
+        << "  --map-width N     with the viewport: zoom out until at most N columns and rows remain (default 100)\n"
+        << "  --aggregate MODE  with the viewport: mean (default) or max of the cells behind each symbol\n"
+        << "  --export LIST     write images, comma separated LAYER=FILE: cloud, pressure or rain as PGM (0-100 in\n"
+        << "                    gray), cloud-lmh or pressure-lmh as PPM (L green, M yellow, H red), city as PPM\n"
+        << "                    (one color per city ID); all images are written in one pass over the grid\n"
+        << "  --summary         print the weather forecast summary report\n"
+        << "  --timeline        print each city's forecast across the timesteps listed in the config\n"
+        << "                    (Cloud_<n>=FILE and Pressure_<n>=FILE lines for timestep n = 1, 2, ...)\n"
+        << "  --query Q         answer a city query (repeatable): point:X,Y, rect:X0,Y0,X1,Y1 or nearest:X,Y,K,\n"
+        << "                    matched against city bounding boxes\n"
+        << "  --query-file F    answer every query in F, one per line\n"
+        << "  --serve SOCKET    after loading (every named layer included), answer SUMMARY, CELL, REGION, MAP, VIEW,\n"
+        << "                    VALUE and QUERY requests on a Unix socket, one per line. Each answer is \"OK <bytes>\"\n"
+        << "                    and a newline followed by that many bytes, or one \"ERR <message>\" line\n"
+        << "  --watch           with --serve: reload whenever the city, cloud or pressure file is rewritten; requests\n"
+        << "                    keep being answered from the previous data until the new data is swapped in\n"
+        << "  --streaming       with --summary only: stream the data files without holding the grid in memory\n"
+        << "  --layout MODE     grid memory layout: row (default) or column\n"
+        << "  --grid MODE       grid storage: auto (default), dense, sparse or compact (1-byte values, city bitmap)\n"
+        << "  --neighborhood M  cells averaged per city: bbox (default, bounding box plus a one-cell border)\n"
+        << "                    or exact (the city's own cells and their eight neighbours)\n"
+        << "  --threads N       worker threads for loading (default: one per hardware thread)\n"
+        << "  --no-simd         use the scalar map classification kernels even when the CPU has AVX2\n"
+        << "  --save-snapshot F write the loaded state to binary snapshot F (--config also accepts a snapshot)\n"
+        << "  --verify-snapshot also verify the grid checksum when --config is a snapshot\n"
+        << "  --delta-cloud F   apply cloud cover revisions from F after loading (repeatable, applied in order)\n"
+        << "  --delta-pressure F apply pressure revisions from F after loading (repeatable, applied in order)\n"
+        << "  --quiet           do not print loading progress\n"
+        << "  --stats FILE      record per-phase load statistics and write them as JSON to FILE on exit (- for stdout)\n"
+        << "  --bench           generate a synthetic workload and print per-stage timings as JSON (no --config):\n"
+        << "    --bench-size WxH, --bench-cities N, --bench-shape square|wide|tall|mixed, --bench-city-size N,\n"
+        << "    --bench-fill F (0-1), --bench-runs N, --bench-seed N, --bench-dir DIR (default: temporary)\n"
+        << "  --help            show this message\n\n"
+        << "Exit status: 0 ok, 1 bad arguments, 2 config unreadable, 3 data file missing, 4 output failed\n";
+}
+
+// Split "a,b,c" into its non-empty items
+std::vector<string> splitList(const string& list)
+{
+    std::vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Non-interactive mode: load the config, render the requested maps and/or the summary, no prompts
+int runBatch(int argc, char *argv[])
+{
+    string configFile;
+    std::vector<string> renders;
+    std::vector<ImageExport> imageExports;
+    MapViewport viewport;
+    bool viewportRendering = false; // Any of --viewport, --zoom, --map-width, --aggregate
+    std::vector<std::pair<string, int>> deltaFiles; // File and data type, applied in command line order
+    string snapshotFile;
+    bool summary = false;
+    bool timeline = false;
+    std::vector<string> queries;
+    string queryFile;
+    string serveSocket;
+    bool watch = false;
+    bool quiet = false;
+    bool verifySnapshot = false;
+    bool streaming = false;
+    bool benchmark = false;
+    string statsFile;
+    string regionList;
+    string regionOutputDir;
+    BenchmarkOptions benchOptions;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string argument = argv[i];
+        bool hasValue = (i + 1 < argc);
+
+        if (argument == "--help" || argument == "-h")
+        {
+            printUsage(cout, argv[0]);
+            return ExitOk;
+        }
+        else if (argument == "--config" && hasValue)
+        {
+            configFile = argv[++i];
+        }
+        else if (argument == "--regions" && hasValue)
+        {
+            regionList = argv[++i];
+        }
+        else if (argument == "--region-out" && hasValue)
+        {
+            regionOutputDir = argv[++i];
+        }
+        else if (argument == "--render" && hasValue)
+        {
+            for (const string& name : splitList(argv[++i]))
+            {
+                if (selectMap(name).printMapOption == 0 && !isLayerMapName(name))
+                {
+                    cerr << "Error: Unknown map '" << name << "'.\n";
+                    return ExitUsage;
+                }
+                renders.push_back(name); // Layer maps are checked once the config has named its layers
+            }
+        }
+        else if (argument == "--viewport" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &viewport.x0, &viewport.y0, &viewport.x1, &viewport.y1) != 4)
+            {
+                cerr << "Error: --viewport needs X0,Y0,X1,Y1.\n";
+                return ExitUsage;
+            }
+            viewportRendering = true;
+        }
+        else if (argument == "--zoom" && hasValue)
+        {
+            int cellsPerSymbol = atoi(argv[++i]);
+            if (cellsPerSymbol <= 0)
+            {
+                cerr << "Error: --zoom needs a positive number of cells per symbol.\n";
+                return ExitUsage;
+            }
+            viewport.zoomLevel = 0;
+            while ((1LL << viewport.zoomLevel) < cellsPerSymbol) viewport.zoomLevel++; // Rounded up to a power of two
+            viewportRendering = true;
+        }
+        else if (argument == "--map-width" && hasValue)
+        {
+            viewport.maxSymbols = atoi(argv[++i]);
+            if (viewport.maxSymbols <= 0)
+            {
+                cerr << "Error: --map-width needs a positive number.\n";
+                return ExitUsage;
+            }
+            viewportRendering = true;
+        }
+        else if (argument == "--aggregate" && hasValue)
+        {
+            string aggregate = argv[++i];
+            if (aggregate == "mean") viewport.useMax = false;
+            else if (aggregate == "max") viewport.useMax = true;
+            else
+            {
+                cerr << "Error: Unknown aggregate '" << aggregate << "'.\n";
+                return ExitUsage;
+            }
+            viewportRendering = true;
+        }
+        else if (argument == "--export" && hasValue)
+        {
+            for (const string& spec : splitList(argv[++i]))
+            {
+                ImageExport image;
+                if (!parseImageExport(spec, image))
+                {
+                    cerr << "Error: --export needs LAYER=FILE with a layer of cloud, pressure, cloud-lmh, pressure-lmh, rain or city, not '" << spec << "'.\n";
+                    return ExitUsage;
+                }
+                imageExports.push_back(image);
+            }
+        }
+        else if (argument == "--summary")
+        {
+            summary = true;
+        }
+        else if (argument == "--timeline")
+        {
+            timeline = true;
+        }
+        else if (argument == "--query" && hasValue)
+        {
+            queries.push_back(argv[++i]);
+        }
+        else if (argument == "--query-file" && hasValue)
+        {
+            queryFile = argv[++i];
+        }
+        else if (argument == "--serve" && hasValue)
+        {
+            serveSocket = argv[++i];
+        }
+        else if (argument == "--watch")
+        {
+            watch = true;
+        }
+        else if (argument == "--layout" && hasValue)
+        {
+            string layout = argv[++i];
+            if (layout == "row") gridLayout = GridLayout::RowMajor;
+            else if (layout == "column") gridLayout = GridLayout::ColumnMajor;
+            else
+            {
+                cerr << "Error: Unknown layout '" << layout << "'.\n";
+                return ExitUsage;
+            }
+        }
+        else if (argument == "--grid" && hasValue)
+        {
+            string backend = argv[++i];
+            if (backend == "auto") gridBackend = GridBackend::Auto;
+            else if (backend == "dense") gridBackend = GridBackend::Dense;
+            else if (backend == "sparse") gridBackend = GridBackend::Sparse;
+            else if (backend == "compact") gridBackend = GridBackend::Compact;
+            else
+            {
+                cerr << "Error: Unknown grid storage '" << backend << "'.\n";
+                return ExitUsage;
+            }
+        }
+        else if (argument == "--neighborhood" && hasValue)
+        {
+            string mode = argv[++i];
+            if (mode == "bbox") neighborhoodMode = NeighborhoodMode::BoundingBox;
+            else if (mode == "exact") neighborhoodMode = NeighborhoodMode::Exact;
+            else
+            {
+                cerr << "Error: Unknown neighborhood '" << mode << "'.\n";
+                return ExitUsage;
+            }
+        }
+        else if (argument == "--threads" && hasValue)
+        {
+            int threads = atoi(argv[++i]);
+            if (threads <= 0)
+            {
+                cerr << "Error: --threads needs a positive number.\n";
+                return ExitUsage;
+            }
+            workerThreadLimit = static_cast<unsigned>(threads);
+        }
+        else if (argument == "--quiet")
+        {
+            quiet = true;
+        }
+        else if (argument == "--no-simd")
+        {
+            simdKernelsEnabled = false;
+        }
+        else if (argument == "--save-snapshot" && hasValue)
+        {
+            snapshotFile = argv[++i];
+        }
+        else if (argument == "--streaming")
+        {
+            streaming = true;
+        }
+        else if (argument == "--verify-snapshot")
+        {
+            verifySnapshot = true;
+        }
+        else if (argument == "--stats" && hasValue)
+        {
+            statsFile = argv[++i];
+            statsEnabled = true;
+        }
+        else if (argument == "--bench")
+        {
+            benchmark = true;
+        }
+        else if (argument == "--bench-size" && hasValue)
+        {
+            if (sscanf(argv[++i], "%dx%d", &benchOptions.width, &benchOptions.height) != 2 || benchOptions.width <= 0 || benchOptions.height <= 0)
+            {
+                cerr << "Error: --bench-size needs WIDTHxHEIGHT.\n";
+                return ExitUsage;
+            }
+        }
+        else if (argument == "--bench-cities" && hasValue)
+        {
+            benchOptions.cities = std::max(0, atoi(argv[++i]));
+        }
+        else if (argument == "--bench-shape" && hasValue)
+        {
+            benchOptions.cityShape = argv[++i];
+            if (benchOptions.cityShape != "square" && benchOptions.cityShape != "wide" && benchOptions.cityShape != "tall" && benchOptions.cityShape != "mixed")
+            {
+                cerr << "Error: Unknown city shape '" << benchOptions.cityShape << "'.\n";
+                return ExitUsage;
+            }
+        }
+        else if (argument == "--bench-city-size" && hasValue)
+        {
+            benchOptions.citySize = std::max(1, atoi(argv[++i]));
+        }
+        else if (argument == "--bench-fill" && hasValue)
+        {
+            benchOptions.fill = std::min(1.0, std::max(0.0, atof(argv[++i])));
+        }
+        else if (argument == "--bench-runs" && hasValue)
+        {
+            benchOptions.runs = std::max(1, atoi(argv[++i]));
+        }
+        else if (argument == "--bench-seed" && hasValue)
+        {
+            benchOptions.seed = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (argument == "--bench-dir" && hasValue)
+        {
+            benchOptions.directory = argv[++i];
+        }
+        else if (argument == "--delta-cloud" && hasValue)
+        {
+            deltaFiles.push_back({argv[++i], 1});
+        }
+        else if (argument == "--delta-pressure" && hasValue)
+        {
+            deltaFiles.push_back({argv[++i], 2});
+        }
+        else
+        {
+            cerr << "Error: Unknown or incomplete option '" << argument << "'.\n";
+            printUsage(cerr, argv[0]);
+            return ExitUsage;
+        }
     }
 
-    // Return the formatted string
-    return (oss.str());
-}
-
-string GridCellInfo::indMapPrintCell(bool cloud) 
-{
-    ostringstream oss;
-
-    float value = 0;
+    if (benchmark)
+    {
+        return runBenchmark(benchOptions);
+    }
 
-    if (cloud) 
+    if (!regionList.empty())
     {
-        value = cloudCover;
-    } 
-    
-    else 
+        if (!configFile.empty() || !renders.empty() || !imageExports.empty() || summary || timeline || !queries.empty() || !queryFile.empty() ||
+            !serveSocket.empty() || streaming || !snapshotFile.empty() || verifySnapshot || !deltaFiles.empty() || !statsFile.empty())
+        {
+            cerr << "Error: --regions always prints the summaries; it only combines with --region-out, --layout, --grid, --neighborhood, --threads, --no-simd and --quiet.\n";
+            return ExitUsage;
+        }
+        return runRegions(regionList, regionOutputDir, quiet);
+    }
+    if (!regionOutputDir.empty())
     {
-        value = atmosphericPressure;
+        cerr << "Error: --region-out needs --regions.\n";
+        return ExitUsage;
     }
-    oss << setw(leftPadding + 1) << setfill(' ') << ' ' << static_cast<int>(std::max(0.f, value-1)/10.f) << setw(rightPadding + 1) << ' ';
-
-    // Return the formatted string
-    return (oss.str());
-}
 
-char convertToLMHSymbol(float value) {
-    if (value < 35) {
-        return 'L'; // Low cloud cover
-    } else if (value < 65) {
-        return 'M'; // Medium cloud cover
-    } else {
-        return 'H'; // High cloud cover
+    if (configFile.empty())
+    {
+        cerr << "Error: --config is required.\n";
+        printUsage(cerr, argv[0]);
+        return ExitUsage;
     }
-}
-
-string GridCellInfo::lmhMapPrintCell(bool cloud) {
-    ostringstream oss;
-    char letter = ' ';
 
-    float value = 0;
-    if (cloud) 
+    if (streaming && neighborhoodMode == NeighborhoodMode::Exact)
     {
-        value = cloudCover;
-    } 
-    
-    else 
+        cerr << "Error: --streaming only supports the bbox neighborhood, exact neighborhoods need the city layer.\n";
+        return ExitUsage;
+    }
+    if (watch && (serveSocket.empty() || isSnapshotFile(configFile) || !deltaFiles.empty()))
     {
-        value = atmosphericPressure;
+        cerr << "Error: --watch needs --serve and a configuration file; it cannot be combined with a snapshot or --delta-* files.\n";
+        return ExitUsage;
     }
-    letter = convertToLMHSymbol(value);
-
-    // Format the output with the letter centered and padded with spaces
-    oss << setw(leftPadding + 1) << setfill(' ') << ' ' << letter << setw(rightPadding + 1) << ' ';
-
-    // Return the formatted string
-    return (oss.str());
-}
-
-int countNumberOfDigits(int number) 
-{
-    if (number == 0) return 1; // Log10 of 0 is undefined, so we handle it separately
-    return static_cast<int>(log10(abs(number))) + 1; //log10 is from cmath
-}
-
-
-GridCellInfo** grid; // Global grid which houses all the information, 2d array
-int gridXmin = 0, gridXmax = 0, gridYmin = 0, gridYmax = 0; 
-unsigned GridCellInfo::numberOfDigits = 0; // Initialize number of digits for city ID to 0 digits
-unsigned GridCellInfo::numberOfDigitsYaxis = 0; // Initialize number of digits for city ID to 0 digits
-unsigned GridCellInfo::leftPadding = 0; // Initialize left padding for print to 0 space
-unsigned GridCellInfo::rightPadding = 0; // Initialize right padding for print to 0 space
-std::map<int, CityData> cityDataMap; // Map to store city data, key is city ID, value is CityData struct
-
-void promptToEnterOnly() 
-{
-	char enter_key = ' ';
-	do 
+    if (streaming && (!renders.empty() || !imageExports.empty() || !snapshotFile.empty() || !deltaFiles.empty() || timeline || !serveSocket.empty()))
     {
-		cout << endl;
-		cout << "Press <Enter> to go back to main menu ... ";
-		cin.clear(); // resets any error flags which may have been set
-		cin.ignore(numeric_limits<streamsize>::max(), '\n'); // This will clear buffer before taking new
-		enter_key = cin.get();
-	} while (enter_key != '\n');
-}
-
-// Function prototypes
-int mainMenu();
-void allocateMemory(int colSize, int rowSize);
-void deallocateMemory(int colSize, int rowSize);
-void processCityData(const string& line, int fileDataType); // fileDataType: 0 is citylocation.txt, 1 is cloudcover.txt, 2 is pressure.txt
-void printMap(int option);
-void city_Location(const string& filename);
-void cloud_Coverage(const string& filename);
-void pressure_File(const string& filename);
-void displaySummary();
-
-int main(int argc, char *argv[]) 
-{
-    mainMenu(); // Call the mainMenu function
-    deallocateMemory((gridXmax - gridXmin) + 1, (gridYmax - gridYmin) + 1); // Deallocate memory
-}
-
-void allocateMemory(int colSize, int rowSize) 
-{
-    grid = new GridCellInfo*[rowSize]; // Allocate memory for rows
-    for (int x = 0; x < rowSize; x++) {
-        grid[x] = new GridCellInfo[colSize]; // For each row, allocate memory for columns
+        cerr << "Error: --streaming only produces the summary, it cannot render or export maps, apply deltas, show the timeline, serve or save a snapshot.\n";
+        return ExitUsage;
     }
-}
 
-void deallocateMemory(int colSize, int rowSize) 
-{
-    for (int x = 0; x < rowSize; x++) 
+    ostream nullLog(nullptr); // Discards everything written to it
+    ostream& log = quiet ? nullLog : cout;
+    LoadStatus status;
+    if (streaming)
     {
-        delete[] grid[x]; // Delete columns
+        status = streamCitySummaries(configFile, log);
     }
-    delete[] grid; // Delete rows
-}
-
-void processCityData(const string& line, int fileDataType) 
-{ // fileDataType: 0 is citylocation.txt, 1 is cloudcover.txt, 2 is pressure.txt
-    int xPos=-1, yPos=-1, cityID=-1, gridValue=-1; // -1 is invalid value
-
-    size_t dashPosition = line.find('-');
-    if (dashPosition != string::npos) 
+    else if (verifySnapshot && isSnapshotFile(configFile))
     {
-        string beforeDash = line.substr(0, dashPosition);
-        string afterDash = line.substr(dashPosition + 1); // e.g. 50-Big_City
-
-
-        // Remove [] and space from beforeDash
-        beforeDash.erase(remove_if(beforeDash.begin(), beforeDash.end(),[](char c) 
-        {
-            return c == ' ' || c == '[' || c == ']';
-        }), beforeDash.end());
-
-        // Extract coordinates
+        status = loadSnapshot(configFile, log, true);
+    }
+    else
+    {
+        status = loadConfiguration(configFile, log);
+    }
+    if (status == LoadStatus::ConfigUnreadable)
+    {
+        cerr << "Error: Unable to open file! " << configFile << '\n';
+        return ExitConfigUnreadable;
+    }
 
-        size_t commaPosition = beforeDash.find(',');
-        if (commaPosition != string::npos) 
+    for (const auto& delta : deltaFiles)
+    {
+        DeltaResult result;
+        if (!applyDeltaFile(delta.first, delta.second, result))
         {
-            string beforecomma = beforeDash.substr(0, commaPosition); // "10"
-            string aftercomma = beforeDash.substr(commaPosition + 1); // "20"
-
-            // Convert to integers
-            xPos = stoi(beforecomma);
-            yPos = stoi(aftercomma);
-
-            // Validate coordinates by checking for out of bounds
-            if (xPos < gridXmin || xPos > gridXmax || yPos < gridYmin || yPos > gridYmax) 
-            {
-                cerr << "Error: Coordinates (" << xPos << ", " << yPos << ") are out of bounds." << endl;
-                return; // Do not process further by forcing empty return
-            }
-
-            xPos -= gridXmin; // Adjust x position to start from 0
-            yPos -= gridYmin; // Adjust y position to start from 0
+            cerr << "Error: Unable to apply delta file " << delta.first << '\n';
+            status = LoadStatus::DataIncomplete;
+            continue;
         }
+        log << "Applied " << delta.first << ": " << result.cellsChanged << " of " << result.linesApplied
+            << " cells changed, " << result.citiesRecomputed << " cities recomputed\n";
+    }
 
-        
-        // Extract city ID and city size, e.g. "5-Big_City", only will find hyphen if it is a citylocation.txt file
-        size_t hyphenPosition = afterDash.find('-');
-        if (hyphenPosition != string::npos) 
-        {
-            string beforeHyphen = afterDash.substr(0, hyphenPosition); // "5"
-            string cityname = afterDash.substr(hyphenPosition + 1); // "Big_City"
-
-            // Convert to integers
-            cityID = stoi(beforeHyphen); // 5
-            // Validate city ID
-            if (cityID < 0) 
-            {
-                cerr << "Error: Invalid city ID." << endl;
-            }
-
-            grid[xPos][yPos].isCity = true; // Set the cell as a city
-            grid[xPos][yPos].cityId = cityID; // Set the city ID
-
-            cityDataMap[cityID].cityname = cityname; //store city name in
-
-            cityDataMap[cityID].lowerLeftCoord = std::make_pair(
-                std::min(xPos, cityDataMap[cityID].lowerLeftCoord.first),
-                std::min(yPos, cityDataMap[cityID].lowerLeftCoord.second)
-            ); // Set the lower left coordinate
-
-            cityDataMap[cityID].topRightCoord = std::make_pair(
-                std::max(xPos, cityDataMap[cityID].topRightCoord.first),
-                std::max(yPos, cityDataMap[cityID].topRightCoord.second)
-            ); // Set the lower left coordinate
+    if (!snapshotFile.empty() && !saveSnapshot(snapshotFile))
+    {
+        cerr << "Error: Unable to write snapshot " << snapshotFile << '\n';
+        return ExitOutputFailed;
+    }
 
+    if (!exportImages(imageExports, log))
+    {
+        return ExitOutputFailed;
+    }
 
-        } 
-        else 
+    for (const string& name : renders)
+    {
+        MapSelection map = selectMap(name);
+        if (map.printMapOption == 0)
+        {
+            cerr << "Error: Unknown map '" << name << "' (the configuration names no such layer).\n";
+            return ExitUsage;
+        }
+        if (viewportRendering)
         {
-            // Could either be cloudcover.txt or pressure.txt
-            gridValue = stoi(afterDash);
-            // Validate value
-            if (gridValue < 0 || gridValue > 100) 
+            if (map.layerIndex >= 0)
             {
-                cerr << "Error: Invalid atmospheric pressure value." << endl;
+                cerr << "Error: Map '" << name << "' is a named layer; viewports draw the core maps only.\n";
+                return ExitUsage;
             }
-            if (fileDataType == 1) 
-            {
-                // Cloud cover
-                grid[xPos][yPos].cloudCover = static_cast<float>(gridValue); // Explicitly cast to float for code readability
-            } else if (fileDataType == 2) 
+            cout << map.title << '\n';
+            if (!renderViewport(cout, map.printMapOption, viewport))
             {
-                // Atmospheric pressure
-                grid[xPos][yPos].atmosphericPressure = static_cast<float>(gridValue); // Explicitly cast to float for code readability
+                cerr << "Error: The viewport lies outside the grid.\n";
+                return ExitUsage;
             }
+            cout << '\n';
+            continue;
+        }
+        if (map.layerIndex >= 0 && !ensureDataLayer(static_cast<size_t>(map.layerIndex), log))
+        {
+            status = LoadStatus::DataIncomplete;
         }
+        cout << map.title << '\n';
+        renderSelectedMap(cout, map, log);
+        cout << '\n';
+    }
+    if (summary)
+    {
+        if (!ensureAllDataLayers(log))
+        {
+            status = LoadStatus::DataIncomplete;
+        }
+        displaySummary();
+    }
+    if (timeline)
+    {
+        writeTimelineSummary(cout);
     }
-}
-
-
-bool inFile;
-
-void printMap(int option) {
-    int x_range = (gridXmax - gridXmin) + 1;
-    int y_range = (gridYmax - gridYmin) + 1;
 
-    // Print border (top)
-    cout << setw(GridCellInfo::numberOfDigits) << setfill(' ') << " ";
-    for (int i = 0; i < x_range + 2; i++) {
-        cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << ' ' << '#' << ' ';
+    bool queriesValid = true;
+    if (!queries.empty())
+    {
+        std::vector<std::string_view> views(queries.begin(), queries.end());
+        queriesValid = answerCityQueries(views, cout);
+    }
+    if (!queryFile.empty())
+    {
+        MappedFile file;
+        if (!file.open(queryFile))
+        {
+            cerr << "Error: Unable to open query file " << queryFile << '\n';
+            return ExitUsage;
+        }
+        std::vector<std::string_view> lines;
+        forEachLine(file.data(), file.data() + file.size(), [&](std::string_view line) { lines.push_back(line); });
+        queriesValid = answerCityQueries(lines, cout) && queriesValid;
     }
-    cout << endl;
 
-    // Print grid content
-    for (int y = y_range - 1; y >= 0; y--) {
-        cout << y << " # "; // Row label (y-axis)
-        for (int x = 0; x < x_range; x++) {
-            switch (option){
-                case 1: //"Display City Map"
-                    cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << grid[x][y].cityMapPrintCell();
-                    break;
-                case 2: //"Display Cloud Coverage Map (Cloudiness Index)"
-                    cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << grid[x][y].indMapPrintCell(true);
-                    break;
-                case 3: //"Display Cloud Coverage Map (LMH Symbol)"
-                    cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << grid[x][y].lmhMapPrintCell(true);
-                    break;
-                case 4: //"Display atmospheric pressure map (Pressure Index)"
-                    cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << grid[x][y].indMapPrintCell(false);
-                    break;
-                case 5: //"Display atmospheric pressure map (LMH symbol)"
-                    cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << grid[x][y].lmhMapPrintCell(false);
-                    break;
-                default:
-                    break;
+    if (!statsFile.empty())
+    {
+        if (statsFile == "-")
+        {
+            writeStatsJson(cout);
+        }
+        else
+        {
+            ofstream statsOut(statsFile);
+            writeStatsJson(statsOut);
+            if (!statsOut)
+            {
+                cerr << "Error: Unable to write statistics to " << statsFile << '\n';
+                return ExitOutputFailed;
             }
         }
-        cout << " #"; // Right border
-        cout << endl;
     }
 
-    // Print bottom border
-    cout << setw(GridCellInfo::numberOfDigits) << setfill(' ') << " ";
-    for (int x = 0; x < x_range +2; x++) {
-        cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << ' ' << '#' << ' ';
+    cout.flush();
+    if (!cout)
+    {
+        return ExitOutputFailed;
     }
-    cout << endl;
-
-    // Print x-axis labels
-    for (int i = 0; i < 4; i++) {
-        cout << setw(GridCellInfo::leftPadding + 1) << " ";
+    if (!queriesValid)
+    {
+        return ExitUsage;
     }
-    for (int x= 0; x < x_range; x++) {
-        cout << setw(GridCellInfo::leftPadding + 1) << setfill(' ') << ' ' << x << ' ';
+    if (!serveSocket.empty())
+    {
+        cout.flush();
+        return runServer(serveSocket, log, watch ? configFile : "");
     }
-    cout << endl;
+    return (status == LoadStatus::DataIncomplete) ? ExitDataIncomplete : ExitOk;
 }
 
 string studentID = "UOW9090307";
@@ -347,9 +6852,12 @@ int mainMenu() {
         cout << "5.\tDisplay Atmospheric Pressure Coverage Map (Pressure Index)" << endl;
         cout << "6.\tDisplay Atmospheric Pressure Coverage Map (LMH Symbol)" << endl;
         cout << "7.\tShow Weather Forecast Summary" << endl;
-        cout << "8.\tExit \n " << endl;
+        cout << "8.\tExit" << endl;
+        cout << "9.\tApply Forecast Update (Delta) File" << endl;
+        cout << "10.\tShow Load Statistics" << endl;
+        cout << "11.\tShow Forecast Timeline Summary \n " << endl;
 
-        cout << "Please enter your choice (1-8): ";
+        cout << "Please enter your choice (1-11): ";
         cin >> userOption;
 
         if (userOption == 1) {
@@ -357,128 +6865,12 @@ int mainMenu() {
             string fileName;
             cin >> fileName;
 
-            ifstream inFile(fileName); // Read file based on input
-
-            // Check if file cannot be opened
-            if (!inFile.is_open()) {
+            LoadStatus status = loadConfiguration(fileName, cout);
+            if (status == LoadStatus::ConfigUnreadable) {
                 cout << "Error: Unable to open file! Please try again!\n" << fileName << endl;
                 continue;
             }
 
-            string line;
-            string citylocFilePath, cloudcoverageFilePath, pressureFilePath;
-            bool citylocFound = false, cloudcoverFound = false, pressureFound = false;
-
-            // Read the file line by line
-            while (getline(inFile, line)) {
-                // Parse grid ranges
-                size_t gridPosition = line.find("Grid");
-                if (gridPosition == 0) {
-                    size_t equalPosition = line.find('=');
-                    if (equalPosition != string::npos) {
-                        string beforeEqual = line.substr(0, equalPosition);
-                        string afterEqual = line.substr(equalPosition + 1);
-
-                        size_t dashPosition = afterEqual.find('-');
-                        if (dashPosition != string::npos) {
-                            string beforeDash = afterEqual.substr(0, dashPosition);
-                            string afterDash = afterEqual.substr(dashPosition + 1);
-
-                            // Convert string to int to determine range
-                            int min = stoi(beforeDash);
-                            int max = stoi(afterDash);
-
-                            // Setting grid range for x and y
-                            if (beforeEqual == "GridX_IdxRange") {
-                                gridXmin = min;
-                                gridXmax = max;
-                            } else if (beforeEqual == "GridY_IdxRange") {
-                                gridYmin = min;
-                                gridYmax = max;
-                            }
-                        }
-                    }
-                }
-
-                // Check if the line contains "txt"
-                if (line.find("txt") != string::npos) {
-                    if (!citylocFound) {
-                        citylocFilePath = line;
-                        citylocFound = true;
-                    } else if (!cloudcoverFound) {
-                        cloudcoverageFilePath = line;
-                        cloudcoverFound = true;
-                    } else if (!pressureFound) {
-                        pressureFilePath = line;
-                        pressureFound = true;
-                    }
-                }
-            }
-
-            // Display grid ranges
-            cout << "Reading in GridX_IdRange: " << gridXmin << "-" << gridXmax << " ... done!" << endl;
-            cout << "Reading in GridY_IdRange: " << gridYmin << "-" << gridYmax << " ... done!" << endl;
-
-            // Calculate padding and other setup
-            GridCellInfo::numberOfDigits = countNumberOfDigits(gridXmax); // Calculate number of digits for city ID
-            int totalPadding = GridCellInfo::numberOfDigits - 1;
-            GridCellInfo::leftPadding = totalPadding / 2;
-            GridCellInfo::rightPadding = totalPadding - GridCellInfo::leftPadding;
-
-            int rowSize = (gridXmax - gridXmin) + 1;
-            int colSize = (gridYmax - gridYmin) + 1;
-
-            // Allocate memory for the grid
-            allocateMemory(colSize, rowSize);
-
-            // Process the files
-            if (!citylocFound) {
-                cout << "City Location File Not Found" << endl;
-            } else {
-                city_Location(citylocFilePath);
-            }
-
-            if (!cloudcoverFound) {
-                cout << "Cloud Cover File Not Found" << endl;
-            } else {
-                cloud_Coverage(cloudcoverageFilePath);
-            }
-
-            if (!pressureFound) {
-                cout << "Pressure File Not Found" << endl;
-            } else {
-                pressure_File(pressureFilePath);
-            }
-
-            inFile.close();
-            cout << "\nAll records successfully stored. Going back to main menu ...\n" << endl;
-
-            // Process the average atmospheric pressure and cloud cover for each city
-            for (const auto& cityData : cityDataMap) {
-                int cityId = cityData.first;
-                CityData data = cityData.second;
-
-                // Calculate the average atmospheric pressure and cloud cover for each city
-                float totalAtmosphericPressure = 0.f;
-                float totalCloudCover = 0.f;
-                int totalCells = 0;
-
-                for (int x = std::max(data.lowerLeftCoord.first - 1, gridXmin) - gridXmin; x <= std::min(data.topRightCoord.first + 1, gridXmax) - gridXmin; x++) {
-                    for (int y = std::max(data.lowerLeftCoord.second - 1, gridYmin) - gridYmin; y <= std::min(data.topRightCoord.second + 1, gridYmax) - gridYmin; y++) {
-                        totalAtmosphericPressure += grid[x][y].atmosphericPressure;
-                        totalCloudCover += grid[x][y].cloudCover;
-                        totalCells++;
-                    }
-                }
-
-                // Calculate the average atmospheric pressure and cloud cover
-                data.avgAtmosphericPressure = totalAtmosphericPressure / static_cast<float>(totalCells);
-                data.avgCloudCover = totalCloudCover / static_cast<float>(totalCells);
-
-                // Update the city data
-                cityDataMap[cityId] = data;
-            }
-
             cout << "End of Option 1";
             fileProcessed = true; // Set the flag to true after processing the file
         }
@@ -527,6 +6919,42 @@ int mainMenu() {
         } else if (userOption == 8) {
             cout << "Exiting..." << endl;
             break;
+        } else if (userOption == 9) {
+            if (!fileProcessed) {
+                cout << "Error: You must read and process the file first (Option 1)!\n" << endl;
+                continue;
+            }
+            cout << "Which layer does the update revise? (1 = cloud cover, 2 = atmospheric pressure): ";
+            int layer;
+            cin >> layer;
+            cout << "Please enter file name: " << endl;
+            string fileName;
+            cin >> fileName;
+
+            DeltaResult result;
+            if (!applyDeltaFile(fileName, layer, result)) {
+                cout << "Error: Unable to apply update file! Please try again!\n" << fileName << endl;
+                continue;
+            }
+            cout << "Applied " << fileName << ": " << result.cellsChanged << " of " << result.linesApplied
+                 << " cells changed, " << result.citiesRecomputed << " cities recomputed" << endl;
+            promptToEnterOnly();
+        } else if (userOption == 10) {
+            if (!statsEnabled) {
+                statsEnabled = true; // Off by default so ordinary loads pay nothing for it
+                cout << "Load statistics are now enabled. Read and process the file again (Option 1) to record them.\n" << endl;
+                continue;
+            }
+            writeStatsJson(cout);
+            promptToEnterOnly();
+        } else if (userOption == 11) {
+            if (!fileProcessed) {
+                cout << "Error: You must read and process the file first (Option 1)!\n" << endl;
+                continue;
+            }
+            cout << "Display forecast timeline summary report" << endl;
+            writeTimelineSummary(cout);
+            promptToEnterOnly();
         } else {
             cout << "Invalid choice. Please try again." << endl;
         }
@@ -550,10 +6978,10 @@ std::string getLMHSymbol(double value)
     return "N/A";
 }
 
-void printArray(int** array_data, const string& option) 
+void printArray(int** array_data, const string& option, const RegionContext& region = mainRegion) 
 {
-    int x_range = (gridXmax - gridXmin) + 1;
-    int y_range = (gridYmax - gridYmin) + 1;
+    int x_range = (region.gridXmax - region.gridXmin) + 1;
+    int y_range = (region.gridYmax - region.gridYmin) + 1;
 
     // Print border (top)
     cout << setw(3) << setfill(' ') << " ";
@@ -617,116 +7045,82 @@ void printArray(int** array_data, const string& option)
 
 void city_Location(const string& filename) 
 {
-    ifstream cityLocation(filename);
-    string line;
-
-    if (!cityLocation.is_open()) 
+    if (!ingestDataFiles({{filename, 0}})[0]) 
     {
         cout << "Unable to open city file" << endl;
-        return;
-    }
-
-    while (getline(cityLocation, line)) 
-    {
-        processCityData(line, 0);
     }
-
-    cityLocation.close();
 }
 
 //access the data in cloudcover.txt
 void cloud_Coverage(const string& filename) 
 {
-    ifstream cloudCoverage(filename);
-    string line;
-
-    if (!cloudCoverage.is_open()) 
+    if (!ingestDataFiles({{filename, 1}})[0]) 
     {
         cout << "Unable to open cloud file" << endl;
-        return;
     }
-
-    while (getline(cloudCoverage, line)) 
-    {
-        processCityData(line, 1);
-    }
-
-    cloudCoverage.close();
 }
 
 //access the data in pressure.txt
 void pressure_File(const string& filename) 
 {
-    ifstream pressureFile(filename);
-    string line;
-
-    if (!pressureFile.is_open()) 
+    if (!ingestDataFiles({{filename, 2}})[0]) 
     {
-        
         cout << "Unable to open pressure file" << endl;
-        return;
     }
-
-    while (getline(pressureFile, line)) 
-    {
-        processCityData(line, 2);
-    } 
-
-    pressureFile.close();
 }
 
 
-void display_ASCII(int probability) 
+void display_ASCII(ostream& out, int probability) 
 {
     if (probability == 90) 
     {
-        cout << "~~~~" << endl;
-        cout << "~~~~~" << endl;
-        cout << "\\\\\\\\\\" << endl << endl;
+        out << "~~~~" << '\n';
+        out << "~~~~~" << '\n';
+        out << "\\\\\\\\\\" << "\n\n";
     } 
     else if (probability == 80) 
     {
-        cout << "~~~~" << endl;
-        cout << "~~~~~" << endl;
-        cout << " \\\\\\\\" << endl << endl;
+        out << "~~~~" << '\n';
+        out << "~~~~~" << '\n';
+        out << " \\\\\\\\" << "\n\n";
     } 
     else if (probability == 70) 
     {
-        cout << "~~~~" << endl;
-        cout << "~~~~~" << endl;
-        cout << "  \\\\\\" << endl << endl;
+        out << "~~~~" << '\n';
+        out << "~~~~~" << '\n';
+        out << "  \\\\\\" << "\n\n";
     } else if 
     (probability == 60) 
     {
-        cout << "~~~~" << endl;
-        cout << "~~~~~" << endl;
-        cout << "   \\\\" << endl << endl;
+        out << "~~~~" << '\n';
+        out << "~~~~~" << '\n';
+        out << "   \\\\" << "\n\n";
     } 
     else if (probability == 50) 
     {
-        cout << "~~~~" << endl;
-        cout << "~~~~~" << endl;
-        cout << "    \\" << endl << endl;
+        out << "~~~~" << '\n';
+        out << "~~~~~" << '\n';
+        out << "    \\" << "\n\n";
     } 
     else if (probability == 40) 
     {
-        cout << "~~~~" << endl;
-        cout << "~~~~~" << endl << endl;
+        out << "~~~~" << '\n';
+        out << "~~~~~" << "\n\n";
     } 
     else if (probability == 30) 
     {
-        cout << "~~~" << endl;
-        cout << "~~~~" << endl << endl;
+        out << "~~~" << '\n';
+        out << "~~~~" << "\n\n";
     } 
     else if (probability == 20) 
     {
-        cout << "~~" << endl;
-        cout << "~~~" << endl << endl;
+        out << "~~" << '\n';
+        out << "~~~" << "\n\n";
     } 
     else if (probability == 10) 
     {
-        cout << "~" << endl;
-        cout << "~~" << endl << endl;
+        out << "~" << '\n';
+        out << "~~" << "\n\n";
     }
 }
 
@@ -759,24 +7153,114 @@ int rainchance(char acc, char ap)
 }
 
 
+void writeCitySummary(ostream& out, int cityID, const CityData& data) {
+    char ACC_symbol = convertToLMHSymbol(data.avgCloudCover);
+    char AP_symbol = convertToLMHSymbol(data.avgAtmosphericPressure);
+    int rainProbability = rainchance(ACC_symbol, AP_symbol); // Calculate rain probability
+
+    out << "\nShowing Weather Forecast Summary Report ..." << '\n';
+    out << "\nWeather Forecast Summary Report" << '\n';
+    out << "-------------------------------" << '\n';
+    out << "City Name : " << data.cityname << "\n"; // Use data.cityname here
+    out << "City ID : " << cityID << "\n";
+    out << fixed << setprecision(2); // set precision to 2dp
+    out << "Average Cloud Cover (ACC) : " << data.avgCloudCover << " (" << ACC_symbol << ")\n";
+    out << "Average Pressure (AP) : " << data.avgAtmosphericPressure << " (" << AP_symbol << ")\n";
+    for (size_t l = 0; l < data.layerAverages.size() && l < dataLayers.size(); l++) {
+        if (!std::isnan(data.layerAverages[l])) { // Named layers, once loaded
+            out << "Average " << dataLayers[l].spec.name << " : " << data.layerAverages[l] << " ("
+                << layerLMHSymbol(dataLayers[l].spec, data.layerAverages[l]) << ")\n";
+        }
+    }
+    out << "Probability of Rain (%) : " << rainProbability << "\n";
+    display_ASCII(out, rainProbability);
+}
+
+// Reports are formatted in parallel, a block of cities per task, and written in city ID order.
+// Only a window of blocks is held at once so the report never needs to fit in memory.
+void writeSummary(ostream& out, const RegionContext& region) {
+    const size_t citiesPerBlock = 256;
+    if (&region == &mainRegion) {
+        ostream nullLog(nullptr);
+        ensureAllDataLayers(nullLog); // The report covers every named layer
+    }
+    std::vector<const std::pair<const int, CityData>*> cities;
+    cities.reserve(region.cityDataMap.size());
+    for (const auto& cityData : region.cityDataMap) {
+        cities.push_back(&cityData);
+    }
+
+    size_t blockCount = (cities.size() + citiesPerBlock - 1) / citiesPerBlock;
+    size_t blocksPerWindow = static_cast<size_t>(workerThreadCount()) * 8;
+    std::vector<string> blockText(blocksPerWindow);
+    for (size_t firstBlock = 0; firstBlock < blockCount; firstBlock += blocksPerWindow) {
+        size_t windowBlocks = std::min(blocksPerWindow, blockCount - firstBlock);
+        parallelForStealing(windowBlocks, 1, [&](size_t b) {
+            ostringstream text;
+            size_t first = (firstBlock + b) * citiesPerBlock;
+            size_t last = std::min(first + citiesPerBlock, cities.size());
+            for (size_t i = first; i < last; i++) {
+                writeCitySummary(text, cities[i]->first, cities[i]->second);
+            }
+            blockText[b] = text.str();
+        });
+        for (size_t b = 0; b < windowBlocks; b++) {
+            out << blockText[b];
+        }
+    }
+
+    if (!cities.empty()) {
+        out << fixed << setprecision(2); // Leave the stream formatted as the serial loop did
+    }
+}
+
 void displaySummary() {
-    for (const auto& cityData : cityDataMap) {
-        int cityID = cityData.first;
-        CityData data = cityData.second;
-
-        char ACC_symbol = convertToLMHSymbol(data.avgCloudCover);
-        char AP_symbol = convertToLMHSymbol(data.avgAtmosphericPressure);
-        int rainProbability = rainchance(ACC_symbol, AP_symbol); // Calculate rain probability
-
-        cout << "\nShowing Weather Forecast Summary Report ..." << endl;
-        cout << "\nWeather Forecast Summary Report" << endl;
-        cout << "-------------------------------" << endl;
-        std::cout << "City Name : " << data.cityname << "\n"; // Use data.cityname here
-        std::cout << "City ID : " << cityID << "\n";
-        cout << fixed << setprecision(2); // set precision to 2dp
-        std::cout << "Average Cloud Cover (ACC) : " << data.avgCloudCover << " (" << ACC_symbol << ")\n";
-        std::cout << "Average Pressure (AP) : " << data.avgAtmosphericPressure << " (" << AP_symbol << ")\n";
-        std::cout << "Probability of Rain (%) : " << rainProbability << "\n";
-        display_ASCII(rainProbability);
+    writeSummary(cout);
+}
+
+// Per-city report across every forecast timestep: each step, then the extremes and the rainiest step
+void writeTimelineSummary(ostream& out) {
+    const std::map<int, CityData>& cityDataMap = mainRegion.cityDataMap; // The timesteps belong to mainRegion
+    size_t steps = forecastCube.timesteps();
+    if (steps == 0) {
+        out << "The configuration lists a single forecast timestep; see the weather forecast summary report.\n";
+        return;
+    }
+
+    ios::fmtflags savedFlags = out.flags();
+    streamsize savedPrecision = out.precision();
+    out << fixed << setprecision(2);
+    for (size_t c = 0; c < forecastCube.cityIds.size(); c++) {
+        int cityID = forecastCube.cityIds[c];
+        auto city = cityDataMap.find(cityID);
+        if (city == cityDataMap.end()) {
+            continue; // A report must not add cities to the map it reads
+        }
+        const float* cloudSeries = &forecastCube.cloudSeries[c * steps];
+        const float* pressureSeries = &forecastCube.pressureSeries[c * steps];
+
+        out << "\nWeather Forecast Timeline Report" << '\n';
+        out << "--------------------------------" << '\n';
+        out << "City Name : " << city->second.cityname << "\n";
+        out << "City ID : " << cityID << "\n";
+        out << "Step\tACC\t\tAP\t\tRain (%)\n";
+
+        int peakRain = -1;
+        size_t peakStep = 0;
+        for (size_t step = 0; step < steps; step++) {
+            char ACC_symbol = convertToLMHSymbol(cloudSeries[step]);
+            char AP_symbol = convertToLMHSymbol(pressureSeries[step]);
+            int rainProbability = rainchance(ACC_symbol, AP_symbol);
+            if (rainProbability > peakRain) {
+                peakRain = rainProbability;
+                peakStep = step;
+            }
+            out << step << '\t' << cloudSeries[step] << " (" << ACC_symbol << ")\t" << pressureSeries[step] << " (" << AP_symbol << ")\t" << rainProbability << '\n';
+        }
+        out << "ACC min / max : " << *std::min_element(cloudSeries, cloudSeries + steps) << " / " << *std::max_element(cloudSeries, cloudSeries + steps) << '\n';
+        out << "AP min / max : " << *std::min_element(pressureSeries, pressureSeries + steps) << " / " << *std::max_element(pressureSeries, pressureSeries + steps) << '\n';
+        out << "Peak Probability of Rain (%) : " << peakRain << " (step " << peakStep << ")\n";
     }
+    out.flags(savedFlags);
+    out.precision(savedPrecision);
 }
\ No newline at end of file
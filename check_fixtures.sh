@@ -0,0 +1,59 @@
+#!/bin/sh
+# Diff the batch mode against the interactive program on the TestCases_ fixtures: every map and
+# the summary of TestCases_Config.txt, as --render/--summary print them, must match
+# TestCases_Expected.txt, which holds what the original program's menu (options 2-7) printed.
+#
+#   ./check_fixtures.sh [BINARY]               compare (default: ./a1)
+#   ./check_fixtures.sh --regenerate BINARY    rewrite TestCases_Expected.txt from BINARY's menu
+#
+# Menus, prompts and loading progress are left out on both sides, as are blank lines.
+
+# Binaries given by a relative path are found from the caller's directory
+absolute()
+{
+    case $1 in
+        /*) echo "$1" ;;
+        *) echo "$PWD/$1" ;;
+    esac
+}
+if [ "$1" = "--regenerate" ] && [ -n "$2" ]; then
+    source=$(absolute "$2")
+elif [ -n "$1" ] && [ "$1" != "--regenerate" ]; then
+    binary=$(absolute "$1")
+fi
+cd "$(dirname "$0")" || exit 1
+
+# Keep only the report lines of a run
+reportLines()
+{
+    sed -e 's/^Please enter your choice ([0-9-]*): //' |
+        grep -v -e '^Student ID' -e '^Student Name' -e '^-----*$' -e '^ Welcome' -e '^[0-9][0-9]*\.	' \
+            -e '^ *$' -e '^Please enter file name' -e '^Reading in ' -e '^All records successfully stored' \
+            -e '^End of Option' -e '^Press <Enter>' -e '^Exiting' -e '^Display weather forecast summary report'
+}
+
+if [ "$1" = "--regenerate" ]; then
+    if [ -z "$2" ]; then
+        echo "Error: --regenerate needs the binary to take the expected output from" >&2
+        exit 1
+    fi
+    # The original program may crash on exit (option 8) once everything is printed
+    (printf '1\nTestCases_Config.txt\n2\n\n3\n\n4\n\n5\n\n6\n\n7\n\n8\n' | "$source") 2>/dev/null | reportLines > TestCases_Expected.txt
+    echo "Wrote TestCases_Expected.txt ($(wc -l < TestCases_Expected.txt) lines)"
+    exit 0
+fi
+
+binary=${binary:-./a1}
+if [ ! -x "$binary" ]; then
+    echo "Error: Cannot run $binary (build it first)" >&2
+    exit 1
+fi
+actual=$(mktemp) || exit 1
+trap 'rm -f "$actual"' EXIT
+"$binary" --config TestCases_Config.txt --render city,cloud-idx,cloud-lmh,pressure-idx,pressure-lmh --summary 2>/dev/null | reportLines > "$actual"
+if diff -u TestCases_Expected.txt "$actual"; then
+    echo "Fixtures match"
+else
+    echo "Error: Output differs from TestCases_Expected.txt" >&2
+    exit 1
+fi